@@ -0,0 +1,66 @@
+/**
+ * Stats many paths of a hypervfs mount at once, through its bulk stat ioctl.
+ * Build it into a tool with
+ *
+ * gcc -Wall -x c BulkStat.cpp RootPath.cpp StatTool.cpp -o hypervstat
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "BulkStat.h"
+
+int hypervBulkStat(const char* mountpoint, const char** paths, int count, HyperVBulkEntry* entries)
+{
+	int fd = open(mountpoint, O_RDONLY | O_DIRECTORY);
+
+	if (fd < 0) {
+		return errno;
+	}
+
+	HyperVBulkStat request;
+	int done = 0;
+	int err = 0;
+
+	while (done < count) {
+		int first = done;
+
+		request.count = 0;
+		request.size = 0;
+
+		// as many paths as fit, one ioctl is one trip to the host
+		while (done < count && request.count < BULK_STAT_MAX) {
+			int length = strlen(paths[done]) + 1;
+
+			if (request.size + length > BULK_STAT_BUFFER) {
+				break;
+			}
+
+			memcpy(request.buffer + request.size, paths[done], length);
+			request.size += length;
+			request.count++;
+			done++;
+		}
+
+		// a path longer than the whole buffer
+		if (!request.count) {
+			entries[done++].status = ENAMETOOLONG;
+			continue;
+		}
+
+		if (ioctl(fd, HYPERVFS_IOC_BULK_STAT, &request) < 0) {
+			err = errno;
+			break;
+		}
+
+		memcpy(entries + first, request.buffer, request.count * sizeof(HyperVBulkEntry));
+	}
+
+	close(fd);
+
+	return err;
+}
@@ -0,0 +1,38 @@
+#ifndef HYPERVFS_BULK_STAT_H
+#define HYPERVFS_BULK_STAT_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+// the kernel copies fuse ioctl buffers by the size in the command, which has 14 bits
+#define BULK_STAT_BUFFER (16 * 1024 - 64)
+
+// what one path comes back as, status is an errno value, 0 when found
+typedef struct {
+	int32_t status;
+	uint32_t mode;
+	uint32_t nlink;
+	uint32_t atime;
+	uint32_t mtime;
+	uint32_t ctime;
+	uint64_t ino;
+	uint64_t size;
+} HyperVBulkEntry;
+
+#define BULK_STAT_MAX (BULK_STAT_BUFFER / sizeof(HyperVBulkEntry))
+
+// count paths go in as null terminated strings relative to the mount root,
+// and count entries come back in the same buffer, in the same order
+typedef struct {
+	uint32_t count;
+	uint32_t size;
+	char buffer[BULK_STAT_BUFFER];
+} HyperVBulkStat;
+
+#define HYPERVFS_IOC_BULK_STAT _IOWR('H', 1, HyperVBulkStat)
+
+// stats count paths under a mounted hypervfs, in as few ioctls as they fit in,
+// returns 0 or an errno value, per path errors are in the entries
+int hypervBulkStat(const char* mountpoint, const char** paths, int count, HyperVBulkEntry* entries);
+
+#endif
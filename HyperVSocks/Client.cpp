@@ -10,22 +10,100 @@
 
 #define PORT_NUM 5001
 #define SOCKET_NUM 4
+#define MAX_SOCKET_NUM 32
+#define MAX_PENDING 256
+#define READ_AHEAD 65536
+#define SEND_BATCH 64
+#define COMPOUND_MAX 64
+#define COMPOUND_INFLIGHT 8
+#define BULK_STAT_CHUNK 64
+#define MAX_TRANSFER (1024 * 1024)
+#define STRIPE_SIZE (256 * 1024)
+
+// bulk data smaller than this is never compressed
+#define COMPRESS_MIN 4096
+
+// copy_file_range may copy less than asked, callers loop
+#define COPY_MAX (256ULL * 1024 * 1024)
+
+// attributes that came back with a create or mkdir wait this long
+// for the getattr the kernel sends right after it
+#define ATTR_CACHE_SLOTS 1024
+#define ATTR_CACHE_PATH 256
+#define ATTR_CACHE_NS 1000000000ULL
+
+// a cached symlink target is read again after this, in case a rename
+// or rmdir above it moved it without its own path being dropped
+#define LINK_CACHE_NS 10000000000ULL
+
+// allocated ranges fetched for a seek are asked again after this, a write
+// through another handle shows up no later
+#define RANGES_CACHE_NS 1000000000ULL
+
+// whole files fetched by a prefetch, read only opens are served from memory
+#define CONTENT_CACHE_SLOTS 4096
+#define CONTENT_CACHE (128 * 1024 * 1024)
+#define PREFETCH_FILE_MAX (256 * 1024)
+#define BULK_READ_MAX (32 * 1024 * 1024)
+
+// the pool grows when the average wait for a socket goes over this,
+// and shrinks after this many seconds without any waiting
+#define GROW_WAIT_NS 20000
+#define SHRINK_IDLE_SECONDS 30
+
+// how often a thread out of ids or retiring a socket checks again before it sleeps
+#define WAIT_SPINS 64
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpuRelax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpuRelax() __asm__ __volatile__("yield")
+#else
+#define cpuRelax()
+#endif
 
 #include <fuse.h>
 #include <fuse_lowlevel.h> 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <time.h>
+
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <linux/vm_sockets.h>
+#include "BulkStat.h"
+#include "Prefetch.h"
+#include "Tree.h"
+
+#if defined LZ4
+#include <lz4.h>
+#endif
+
+#ifndef VMADDR_CID_LOCAL
+#define VMADDR_CID_LOCAL 1
+#endif
 
 #if defined VMNET
-#include <netinet/ip.h>
-#include <arpa/inet.h>
+#define DEFAULT_TRANSPORT "tcp"
+#define DEFAULT_HOST "192.168.0.100"
 #else
-#include <linux/vm_sockets.h>
+#define DEFAULT_TRANSPORT "vsock"
+#define DEFAULT_HOST "127.0.0.1"
 #endif
 
 typedef uint64_t uint64;
@@ -48,11 +126,26 @@ typedef struct
 	uint32 ctime;
 } HyperVStat;
 
+// every message starts with this, replies echo the id and op code of the request,
+// the last dataSize bytes of a message are bulk data sent straight from the caller's buffer,
+// compressed bulk data is rawSize bytes once unpacked
+typedef struct
+{
+	uint64 size;
+	uint64 dataSize;
+	uint32 id;
+	short op;
+	short status;
+	uint32 flags;
+	uint32 rawSize;
+} HyperVHeader;
+
 enum
 {
 	HYPERV_OK = 0,
 	HYPERV_NOENT = ENOENT,
 	HYPERV_EXIST = EEXIST,
+	HYPERV_INVAL = EINVAL,
 
 	// op codes
 	HYPERV_ATTR = 10,
@@ -67,657 +160,3789 @@ enum
 	HYPERV_RENAME = 100,
 	HYPERV_SYMLINK = 110,
 	HYPERV_LINK = 120,
-	HYPERV_READLINK = 130
+	HYPERV_READLINK = 130,
+	HYPERV_HELLO = 140,
+	HYPERV_COMPOUND = 150,
+	HYPERV_CREATE_WITH_DATA = 160,
+	HYPERV_OPEN = 170,
+	HYPERV_RELEASE = 180,
+	HYPERV_COPY = 190,
+	HYPERV_FALLOCATE = 200,
+	HYPERV_QUERY_RANGES = 210,
+	HYPERV_WALK = 220,
+	HYPERV_BULK_STAT = 230,
+	HYPERV_BULK_READ = 240,
+	HYPERV_RMTREE = 250,
+	HYPERV_COPYTREE = 260
+};
+
+// open flags, mapped from the O_ flags so the server doesn't depend on their values
+enum
+{
+	HYPERV_OPEN_READ = 1,
+	HYPERV_OPEN_WRITE = 2,
+	HYPERV_OPEN_CREATE = 4,
+	HYPERV_OPEN_EXCL = 8,
+	HYPERV_OPEN_TRUNC = 16,
+	HYPERV_OPEN_APPEND = 32
+};
+
+// fallocate modes, mapped from the FALLOC_FL_ flags
+enum
+{
+	HYPERV_FALLOC_KEEP_SIZE = 1,
+	HYPERV_FALLOC_PUNCH_HOLE = 2,
+	HYPERV_FALLOC_ZERO_RANGE = 4
+};
+
+// what a connection is used for, sent in the hello
+enum
+{
+	HYPERV_ROLE_DATA = 0,
+	HYPERV_ROLE_CHANGE = 1
+};
+
+enum
+{
+	HYPERV_FLAG_COMPRESSED = 1
+};
+
+// which attributes follow the reply of a mutating op
+enum
+{
+	HYPERV_ATTR_SELF = 1,
+	HYPERV_ATTR_PARENT = 2
 };
 
+// what a connection can use, agreed on in HELLO
+enum
+{
+	HYPERV_FEATURE_LZ4 = 1
+};
+
+#if defined LZ4
+#define HYPERV_FEATURES HYPERV_FEATURE_LZ4
+#else
+#define HYPERV_FEATURES 0
+#endif
+
+// data connections are split by op class, so small metadata ops
+// never queue behind large reads and writes
+enum
+{
+	HYPERV_LANE_META = 0,
+	HYPERV_LANE_BULK = 1,
+	LANE_NUM
+};
+
+typedef struct
+{
+	int connections;
+	int metaConnections;
+	int maxConnections;
+	char* transport;
+	char* host;
+	int port;
+	char* socketPath;
+	int busyPoll;
+	int maxTransfer;
+	int stripeSize;
+	int compress;
+	int writeBehind;
+	int contentCache;
+} HyperVOptions;
+
+// how often spinning caught a reply before going to sleep, printed at unmount
+typedef struct
+{
+	uint64 waitHits;
+	uint64 waitMisses;
+	uint64 recvHits;
+	uint64 recvMisses;
+} HyperVBusyStats;
+
+// bulk data before and after compression, both ways, printed at unmount
+typedef struct
+{
+	uint64 rawBytes;
+	uint64 wireBytes;
+} HyperVCompressStats;
+
+typedef struct
+{
+	const char* name;
+	int (*connect)();
+} HyperVTransport;
+
 struct xmp_dirp {
 	void* entry;
 };
 
-typedef struct QueueNode {
+enum
+{
+	OP_FREE = 0,
+	OP_SENT,
+	OP_DONE
+};
+
+// a request waiting to go out, whoever holds the socket sends all of them
+typedef struct HyperVFrame {
+	char* buffer;
+	const struct fuse_buf* data;
+	uint64 queuedNs;
+	struct HyperVFrame* next;
+} HyperVFrame;
+
+// bytes received ahead of the message being parsed, so back to back
+// small messages cost a single recv
+typedef struct {
 	int socket;
-	struct QueueNode* next;
-} QueueNode;
+	uint64 busyPollNs;
+	uint32 start;
+	uint32 end;
+	char buffer[READ_AHEAD];
+} HyperVInput;
 
+// padded to a cache line, so threads sending on different sockets don't contend
 typedef struct {
-	QueueNode* head;
-	QueueNode* tail;
-} Queue;
+	int socket;
+	short lane;
+	int busy;
+	int users;
+	int retired;
+	int draining;
+	sem_t drained;
+	HyperVFrame* frames;
+	pthread_t reader;
+} __attribute__((aligned(64))) HyperVConnection;
 
-int sSockets[SOCKET_NUM] = { 0 };
-int changeSocket = 0;
-Queue queue = { 0 };
-pthread_mutex_t changeSocketLock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t sSocketLock = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t sSocketCond = PTHREAD_COND_INITIALIZER;
+typedef struct {
+	HyperVConnection connections[MAX_SOCKET_NUM];
+	short lane;
+	int active;
+	int max;
+	int idleSeconds;
+
+	// time frames spent queued on a busy socket, read and reset by the pool monitor
+	uint64 aquireCount;
+	uint64 aquireWaitNs;
+} HyperVPool;
+
+// where the bulk data of a reply goes, filled in by the reader thread,
+// whatever doesn't fit in the pipe is received into the overflow buffer
+typedef struct {
+	char* data;
+	int pipe;
+	uint64 capacity;
+	uint64 piped;
+	char* overflow;
+} HyperVSink;
 
-int readMessage(int socket, char** buffer);
+typedef struct {
+	int fds[2];
+	int capacity;
+} HyperVPipe;
 
-void enqueue(Queue* queue, int socket)
-{
-	QueueNode* node = (QueueNode*)malloc(sizeof(QueueNode));
-	node->socket = socket;
-	node->next = NULL;
+// a request waiting for its reply, the request id is the index in the pending table
+typedef struct {
+	int socket;
+	int state;
+	int next;
+	char* response;
+	HyperVSink* sink;
+	HyperVFrame frame;
+	uint64 spinNs;
+	sem_t done;
+} PendingOp;
 
-	if (queue->tail) {
-		queue->tail->next = node;
-	}
+typedef struct {
+	int lock;
+	uint64 expiresNs;
+	char path[ATTR_CACHE_PATH];
+	HyperVStat stat;
+} HyperVCachedAttr;
+
+// symlink targets that came with attributes, kept until the path changes or
+// they expire, the kernel only asks again after it dropped its own copy
+typedef struct {
+	int lock;
+	short ext;
+	uint64 expiresNs;
+	char path[ATTR_CACHE_PATH];
+	char* target;
+} HyperVCachedLink;
+
+// a file and its stat as a prefetch got them, kept until the path changes
+typedef struct HyperVCachedContent {
+	char* path;
+	HyperVStat stat;
+	char* data;
+	uint64 size;
+	struct HyperVCachedContent* next;
+} HyperVCachedContent;
 
-	queue->tail = node;
+// directories already walked to, so links into them don't walk again
+typedef struct {
+	int lock;
+	char path[ATTR_CACHE_PATH];
+} HyperVWalkedDir;
+
+// a getattr waiting to go out, whoever is sending sends all of them in one compound
+typedef struct HyperVAttrWait {
+	const char* path;
+	HyperVStat stat;
+	int err;
+	sem_t done;
+	struct HyperVAttrWait* next;
+} HyperVAttrWait;
+
+// a new file kept here until it is closed, then created with its data in one message,
+// once it is on the server writes go straight through
+typedef struct HyperVDirtyFile {
+	char* path;
+	uint32 mode;
+	uint64 fileid;
+	char* data;
+	uint64 size;
+	uint64 capacity;
+	int created;
+	int err;
+	pthread_mutex_t lock;
+	struct HyperVDirtyFile* next;
+} HyperVDirtyFile;
 
-	if (!queue->head) {
-		queue->head = queue->tail;
-	}
-}
+// the allocated parts of a file as the host reported them, sorted by offset
+typedef struct {
+	int64 offset;
+	int64 length;
+} HyperVRange;
+
+typedef struct {
+	int64 size;
+	uint32 count;
+	uint64 fetched;
+	HyperVRange* list;
+} HyperVRanges;
+
+// what fi->fh points to, a file still being written behind or served from the
+// content cache has no handle, a read only open gets one with its first read,
+// the ranges answer SEEK_DATA and SEEK_HOLE until this handle changes the file
+typedef struct {
+	uint64 handle;
+	HyperVDirtyFile* dirty;
+	pthread_mutex_t lock;
+	HyperVRanges* ranges;
+	int cached;
+} HyperVFile;
+
+HyperVOptions options = { SOCKET_NUM, 2, 16, DEFAULT_TRANSPORT, DEFAULT_HOST, PORT_NUM, "/tmp/hypervfs.sock", 0, MAX_TRANSFER, STRIPE_SIZE, 0, 0, CONTENT_CACHE };
+HyperVBusyStats busyStats = { 0 };
+HyperVCompressStats compressStats = { 0 };
+uint32 maxTransfer = 0;
+uint32 features = 0;
+
+// the server keeps open files per session, all connections of a mount share one
+uint64 sessionId = 0;
+const HyperVTransport* transport = NULL;
+HyperVPool pools[LANE_NUM] = { 0 };
+int nextHome = 0;
+__thread int homeSocket = -1;
+pthread_t monitor;
+pthread_mutex_t monitorLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t monitorCond = PTHREAD_COND_INITIALIZER;
+int unmounting = 0;
+int changeSocket = 0;
+pthread_mutex_t changeSocketLock = PTHREAD_MUTEX_INITIALIZER;
 
-int dequeue(Queue* queue)
+// free ids form a stack, the low half of the head is the top id + 1,
+// the high half is bumped on every change so a stale head never matches
+PendingOp pending[MAX_PENDING];
+uint64 freeIds = 0;
+sem_t idsLeft;
+struct fuse* mountedFuse = NULL;
+int connected = 0;
+pthread_key_t pipeKey;
+pthread_once_t pipeOnce = PTHREAD_ONCE_INIT;
+HyperVCachedAttr attrCache[ATTR_CACHE_SLOTS] = { 0 };
+HyperVCachedLink linkCache[ATTR_CACHE_SLOTS] = { 0 };
+HyperVWalkedDir walkedDirs[ATTR_CACHE_SLOTS] = { 0 };
+HyperVCachedContent* contentCache[CONTENT_CACHE_SLOTS] = { 0 };
+pthread_rwlock_t contentLock = PTHREAD_RWLOCK_INITIALIZER;
+uint64 contentBytes = 0;
+uint32 contentFiles = 0;
+HyperVAttrWait* attrWaits = NULL;
+int attrSenders = 0;
+HyperVDirtyFile* dirtyFiles = NULL;
+pthread_mutex_t dirtyLock = PTHREAD_MUTEX_INITIALIZER;
+
+// the host has no inode for a buffered file yet, it gets one from the
+// top of the range, the same for as long as it stays buffered
+uint64 dirtyInodes = 1ULL << 63;
+
+int readMessage(HyperVInput* input, char** buffer);
+char* requestOpBuf(char* request, const struct fuse_buf* data, HyperVSink* sink, int* err);
+int submitOp(char* request, const struct fuse_buf* data, HyperVSink* sink, int stripe, int* err);
+char* finishOp(int id, int* err);
+void dropAttr(const char* path);
+void dropLink(const char* path);
+void dropContent(const char* path);
+char* compressRequest(char* request, const struct fuse_buf* data);
+
+int trySocket(HyperVConnection* conn)
 {
-	if (!queue->head) {
+	int idle = 0;
+
+	if (__atomic_load_n(&conn->busy, __ATOMIC_RELAXED)) {
 		return 0;
 	}
 
-	QueueNode* node = queue->head;
-
-	if (node->next) {
-		queue->head = node->next;
-	}
-	else {
-		queue->head = queue->tail = NULL;
-	}
+	return __atomic_compare_exchange_n(&conn->busy, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
 
-	int socket = node->socket;
-	free(node);
+uint64 monotonicNs()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	return socket;
+	return (uint64)now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
-int aquireSocket()
+short opLane(short opCode)
 {
-	pthread_mutex_lock(&sSocketLock);
+	switch (opCode)
+	{
+	case HYPERV_READ:
+	case HYPERV_WRITE:
+	case HYPERV_CREATE_WITH_DATA:
+	case HYPERV_COPY:
+	case HYPERV_FALLOCATE:
+	case HYPERV_BULK_READ:
+	case HYPERV_RMTREE:
+	case HYPERV_COPYTREE:
+		return HYPERV_LANE_BULK;
+	default:
+		return HYPERV_LANE_META;
+	}
+}
 
-aquire:;
-	int socket = dequeue(&queue);
+// a socket leaving the pool is waited for, see retireConnection
+void putSocket(HyperVConnection* conn)
+{
+	if (__atomic_sub_fetch(&conn->users, 1, __ATOMIC_SEQ_CST) == 0 && __atomic_load_n(&conn->draining, __ATOMIC_SEQ_CST)) {
+		sem_post(&conn->drained);
+	}
+}
 
-	if (!socket) {
-		pthread_cond_wait(&sSocketCond, &sSocketLock);
-		goto aquire;
+HyperVConnection* pickSocket(HyperVPool* pool, int stripe)
+{
+	// every thread sticks to its own socket, and only moves
+	// to another one when its own is busy sending, the chunks
+	// of a striped read each start from a different one
+	if (homeSocket < 0) {
+		homeSocket = __atomic_fetch_add(&nextHome, 1, __ATOMIC_RELAXED);
 	}
 
-	pthread_mutex_unlock(&sSocketLock);
+	__atomic_fetch_add(&pool->aquireCount, 1, __ATOMIC_RELAXED);
 
-	return socket;
-}
+	for (;;) {
+		int active = __atomic_load_n(&pool->active, __ATOMIC_ACQUIRE);
+		int index = (homeSocket + stripe) % active;
 
-void releaseSocket(int socket)
-{
-	pthread_mutex_lock(&sSocketLock);
+		for (int i = 0; i < active; i++) {
+			if (!__atomic_load_n(&pool->connections[(homeSocket + stripe + i) % active].busy, __ATOMIC_RELAXED)) {
+				index = (homeSocket + stripe + i) % active;
+				break;
+			}
+		}
 
-	enqueue(&queue, socket);
+		// the pool might have shrunk past it meanwhile, see retireConnection
+		HyperVConnection* conn = &pool->connections[index];
+		__atomic_fetch_add(&conn->users, 1, __ATOMIC_SEQ_CST);
 
-	pthread_cond_signal(&sSocketCond);
+		if (index < __atomic_load_n(&pool->active, __ATOMIC_SEQ_CST)) {
+			return conn;
+		}
 
-	pthread_mutex_unlock(&sSocketLock);
+		putSocket(conn);
+	}
 }
 
-struct timespec toTimeSpec(uint32 sec)
+void releaseSocket(HyperVConnection* conn)
 {
-	struct timespec time = {
-		.tv_sec = sec,
-		.tv_nsec = 0
-	};
+	__atomic_store_n(&conn->busy, 0, __ATOMIC_SEQ_CST);
 
-	return time;
+	if (__atomic_load_n(&conn->draining, __ATOMIC_SEQ_CST)) {
+		sem_post(&conn->drained);
+	}
 }
 
-static void signalExit(struct fuse* fuse)
+uint64 makeHead(uint64 head, int id)
 {
-	fuse_session_exit(fuse_get_session(fuse));
+	return ((head >> 32) + 1) << 32 | (uint32)(id + 1);
 }
 
-static void* invalidatePath(void* data)
+void initPending()
 {
-	struct fuse* fuse = (struct fuse*)data;
-	char* response = NULL;
-	char* path = NULL;
+	for (int i = 0; i < MAX_PENDING; i++) {
+		sem_init(&pending[i].done, 0, 0);
+		pending[i].next = i + 1 < MAX_PENDING ? i + 1 : -1;
+	}
 
-	pthread_mutex_lock(&changeSocketLock);
+	freeIds = makeHead(0, 0);
+	sem_init(&idsLeft, 0, MAX_PENDING);
+}
 
-	while (readMessage(changeSocket, &response)) {
-		// get path
-		path = (char*)(response + sizeof(uint64) + sizeof(short) + sizeof(short));
+// the semaphore counts the ids on the stack, so once it's taken one is there
+int aquireId()
+{
+	// all ids are in flight, spin a little for one to come back, then sleep
+	for (int spins = 0; sem_trywait(&idsLeft) != 0; spins++) {
+		if (spins >= WAIT_SPINS) {
+			while (sem_wait(&idsLeft) != 0);
+			break;
+		}
 
-		printf("Should invalidate path %s\n", path);
+		cpuRelax();
+	}
 
-		fuse_invalidate_path(fuse, path);
+	uint64 head = __atomic_load_n(&freeIds, __ATOMIC_ACQUIRE);
 
-		free(response);
-	}
+	for (;;) {
+		int id = (int)(uint32)head - 1;
 
-	pthread_mutex_unlock(&changeSocketLock);
+		// a release pushes before it posts, so this only races with that push
+		if (id < 0) {
+			cpuRelax();
+			head = __atomic_load_n(&freeIds, __ATOMIC_ACQUIRE);
+			continue;
+		}
 
-	// socket was closed
-	signalExit(fuse);
+		int next = __atomic_load_n(&pending[id].next, __ATOMIC_RELAXED);
 
-	return NULL;
+		if (__atomic_compare_exchange_n(&freeIds, &head, makeHead(head, next), 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			pending[id].response = NULL;
+			pending[id].sink = NULL;
+			return id;
+		}
+	}
 }
 
-char* opReadAttr(const char* path)
+void releaseId(int id)
 {
-	short opCode = HYPERV_ATTR;
-	short pathLength = strlen(path) + 1;
-	uint64 size = sizeof(uint64) + sizeof(short) + sizeof(short) + pathLength;
-	char* request = (char*)malloc(size);
+	uint64 head = __atomic_load_n(&freeIds, __ATOMIC_RELAXED);
 
-	memcpy(request, &size, sizeof(uint64));
-	memcpy(request + sizeof(uint64), &opCode, sizeof(short));
-	memcpy(request + sizeof(uint64) + sizeof(short), &pathLength, sizeof(short));
-	memcpy(request + sizeof(uint64) + sizeof(short) + sizeof(short), path, pathLength);
+	__atomic_store_n(&pending[id].state, OP_FREE, __ATOMIC_RELAXED);
 
-	return request;
+	do {
+		__atomic_store_n(&pending[id].next, (int)(uint32)head - 1, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&freeIds, &head, makeHead(head, id), 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	sem_post(&idsLeft);
 }
 
-char* opReadDir(const char* path)
+uint64 busyPollNs(short lane)
 {
-	short opCode = HYPERV_READDIR;
-	short pathLength = strlen(path) + 1;
-	uint64 size = sizeof(uint64) + sizeof(short) + sizeof(short) + pathLength;
-	char* request = (char*)malloc(size);
-
-	memcpy(request, &size, sizeof(uint64));
-	memcpy(request + sizeof(uint64), &opCode, sizeof(short));
-	memcpy(request + sizeof(uint64) + sizeof(short), &pathLength, sizeof(short));
-	memcpy(request + sizeof(uint64) + sizeof(short) + sizeof(short), path, pathLength);
-
-	return request;
+	// only metadata round trips are short enough to be worth a core
+	return lane == HYPERV_LANE_META ? (uint64)options.busyPoll * 1000 : 0;
 }
 
-char* opRead(const char* path, uint64 rSize, int64 rOffset)
+int spinOp(int id, uint64 spinNs)
 {
-	short opCode = HYPERV_READ;
-	short pathLength = strlen(path) + 1;
-	uint64 size = sizeof(uint64) + sizeof(short) + sizeof(short) + pathLength + sizeof(uint64) + sizeof(int64);
-	char* request = (char*)malloc(size);
+	if (sem_trywait(&pending[id].done) == 0) {
+		return 1;
+	}
 
-	int offset = 0;
-	memcpy(request + offset, &size, sizeof(uint64));
+	uint64 deadline = monotonicNs() + spinNs;
 
-	offset += sizeof(uint64);
-	memcpy(request + offset, &opCode, sizeof(short));
+	do {
+		cpuRelax();
 
-	offset += sizeof(short);
-	memcpy(request + offset, &pathLength, sizeof(short));
+		if (sem_trywait(&pending[id].done) == 0) {
+			__atomic_fetch_add(&busyStats.waitHits, 1, __ATOMIC_RELAXED);
+			return 1;
+		}
+	} while (monotonicNs() < deadline);
 
-	offset += sizeof(short);
-	memcpy(request + offset, path, pathLength);
+	__atomic_fetch_add(&busyStats.waitMisses, 1, __ATOMIC_RELAXED);
 
-	offset += pathLength;
-	memcpy(request + offset, &rSize, sizeof(uint64));
+	return 0;
+}
 
-	offset += sizeof(uint64);
-	memcpy(request + offset, &rOffset, sizeof(int64));
+char* waitOp(int id, uint64 spinNs)
+{
+	// a reply that comes in while spinning doesn't pay for a wake up
+	if (spinNs && spinOp(id, spinNs)) {
+		return pending[id].response;
+	}
 
-	return request;
+	while (sem_wait(&pending[id].done) && errno == EINTR);
+
+	return pending[id].response;
 }
 
-char* opCreate(const char* path, uint32 mode)
+void cancelOp(int id)
 {
-	short opCode = HYPERV_CREATE;
-	short pathLength = strlen(path) + 1;
-	uint64 size = sizeof(uint64) + sizeof(short) + sizeof(short) + pathLength + sizeof(uint32);
-	char* request = (char*)malloc(size);
+	int sent = OP_SENT;
 
-	int offset = 0;
-	memcpy(request + offset, &size, sizeof(uint64));
-
-	offset += sizeof(uint64);
-	memcpy(request + offset, &opCode, sizeof(short));
+	// the reader might have failed it already, take its wake up
+	if (!__atomic_compare_exchange_n(&pending[id].state, &sent, OP_FREE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		waitOp(id, 0);
+	}
+}
 
-	offset += sizeof(short);
-	memcpy(request + offset, &pathLength, sizeof(short));
+int registerOp(int id, int socket)
+{
+	pending[id].socket = socket;
+	__atomic_store_n(&pending[id].state, OP_SENT, __ATOMIC_SEQ_CST);
 
-	offset += sizeof(short);
-	memcpy(request + offset, path, pathLength);
+	if (__atomic_load_n(&connected, __ATOMIC_SEQ_CST)) {
+		return 1;
+	}
 
-	offset += pathLength;
-	memcpy(request + offset, &mode, sizeof(uint32));
+	cancelOp(id);
 
-	return request;
+	return 0;
 }
 
-char* opWrite(const char* path, uint64 wSize, int64 wOffset, const char* buffer)
+int completeOp(int id, char* response)
 {
-	short opCode = HYPERV_WRITE;
-	short pathLength = strlen(path) + 1;
-	uint64 size = sizeof(uint64) + sizeof(short) + sizeof(short) + pathLength + sizeof(uint64) + sizeof(int64) + wSize;
-	char* request = (char*)malloc(size);
+	int sent = OP_SENT;
 
-	int offset = 0;
-	memcpy(request + offset, &size, sizeof(uint64));
-
-	offset += sizeof(uint64);
-	memcpy(request + offset, &opCode, sizeof(short));
+	// the waiter reads the response once it is woken up
+	if (!__atomic_compare_exchange_n(&pending[id].state, &sent, OP_DONE, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		return 0;
+	}
 
-	offset += sizeof(short);
-	memcpy(request + offset, &pathLength, sizeof(short));
+	pending[id].response = response;
+	sem_post(&pending[id].done);
 
-	offset += sizeof(short);
-	memcpy(request + offset, path, pathLength);
+	return 1;
+}
 
-	offset += pathLength;
-	memcpy(request + offset, &wSize, sizeof(uint64));
+void failOps(int socket)
+{
+	// nothing new can be registered once connected is cleared
+	__atomic_store_n(&connected, 0, __ATOMIC_SEQ_CST);
 
-	offset += sizeof(uint64);
-	memcpy(request + offset, &wOffset, sizeof(int64));
+	for (int i = 0; i < MAX_PENDING; i++) {
+		if (pending[i].socket == socket) {
+			completeOp(i, NULL);
+		}
+	}
+}
 
-	offset += sizeof(int64);
-	memcpy(request + offset, buffer, wSize);
+struct timespec toTimeSpec(uint32 sec)
+{
+	struct timespec time = {
+		.tv_sec = sec,
+		.tv_nsec = 0
+	};
 
-	return request;
+	return time;
 }
 
-char* opUnlink(const char* path)
+static void signalExit(struct fuse* fuse)
 {
-	short opCode = HYPERV_UNLINK;
-	short pathLength = strlen(path) + 1;
-	uint64 size = sizeof(uint64) + sizeof(short) + sizeof(short) + pathLength;
-	char* request = (char*)malloc(size);
+	fuse_session_exit(fuse_get_session(fuse));
+}
 
-	int offset = 0;
-	memcpy(request + offset, &size, sizeof(uint64));
+int recvAll(int socket, char* buffer, uint64 size)
+{
+	while (size > 0)
+	{
+		ssize_t ret = recv(socket, buffer, size, 0);
 
-	offset += sizeof(uint64);
-	memcpy(request + offset, &opCode, sizeof(short));
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
 
-	offset += sizeof(short);
-	memcpy(request + offset, &pathLength, sizeof(short));
+		// if we read 0 bytes, connection might be closed, return
+		if (ret <= 0) {
+			return 0;
+		}
 
-	offset += sizeof(short);
-	memcpy(request + offset, path, pathLength);
+		size -= ret;
+		buffer += ret;
+	}
 
-	return request;
+	return 1;
 }
 
-char* opTruncate(const char* path, int64 tOffset)
+HyperVInput* openInput(int socket, uint64 busyPollNs)
 {
-	short opCode = HYPERV_TRUNCATE;
-	short pathLength = strlen(path) + 1;
-	uint64 size = sizeof(uint64) + sizeof(short) + sizeof(short) + pathLength + sizeof(int64);
-	char* request = (char*)malloc(size);
-
-	int offset = 0;
-	memcpy(request + offset, &size, sizeof(uint64));
-
-	offset += sizeof(uint64);
-	memcpy(request + offset, &opCode, sizeof(short));
+	HyperVInput* input = (HyperVInput*)malloc(sizeof(HyperVInput));
+	int kernelPoll = 0;
+	socklen_t size = sizeof kernelPoll;
 
-	offset += sizeof(short);
-	memcpy(request + offset, &pathLength, sizeof(short));
+	input->socket = socket;
+	input->start = 0;
+	input->end = 0;
 
-	offset += sizeof(short);
-	memcpy(request + offset, path, pathLength);
+	// with SO_BUSY_POLL the kernel spins in recv itself
+	if (getsockopt(socket, SOL_SOCKET, SO_BUSY_POLL, &kernelPoll, &size) || kernelPoll > 0) {
+		busyPollNs = 0;
+	}
 
-	offset += pathLength;
-	memcpy(request + offset, &tOffset, sizeof(int64));
+	input->busyPollNs = busyPollNs;
 
-	return request;
+	return input;
 }
 
-char* opMkdir(const char* path, uint32 mode)
+int pollInput(HyperVInput* input)
 {
-	short opCode = HYPERV_MKDIR;
-	short pathLength = strlen(path) + 1;
-	uint64 size = sizeof(uint64) + sizeof(short) + sizeof(short) + pathLength + sizeof(uint32);
+	uint64 deadline = 0;
+
+	for (;;) {
+		ssize_t ret = recv(input->socket, input->buffer, READ_AHEAD, MSG_DONTWAIT);
+
+		if (ret > 0) {
+			if (deadline) {
+				__atomic_fetch_add(&busyStats.recvHits, 1, __ATOMIC_RELAXED);
+			}
+
+			input->start = 0;
+			input->end = ret;
+			return 1;
+		}
+
+		if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+			return -1;
+		}
+
+		uint64 now = monotonicNs();
+
+		if (!deadline) {
+			deadline = now + input->busyPollNs;
+		} else if (now >= deadline) {
+			break;
+		}
+
+		cpuRelax();
+	}
+
+	__atomic_fetch_add(&busyStats.recvMisses, 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+int fillInput(HyperVInput* input)
+{
+	// spin on a non blocking recv for a while before sleeping in a blocking one
+	if (input->busyPollNs) {
+		int ret = pollInput(input);
+
+		if (ret) {
+			return ret > 0;
+		}
+	}
+
+	for (;;) {
+		ssize_t ret = recv(input->socket, input->buffer, READ_AHEAD, 0);
+
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (ret <= 0) {
+			return 0;
+		}
+
+		input->start = 0;
+		input->end = ret;
+
+		return 1;
+	}
+}
+
+int readInput(HyperVInput* input, char* buffer, uint64 size)
+{
+	while (size > 0)
+	{
+		uint64 buffered = input->end - input->start;
+
+		if (buffered) {
+			uint64 n = buffered < size ? buffered : size;
+			memcpy(buffer, input->buffer + input->start, n);
+			input->start += n;
+			buffer += n;
+			size -= n;
+			continue;
+		}
+
+		// large reads skip the buffer
+		if (size >= READ_AHEAD) {
+			return recvAll(input->socket, buffer, size);
+		}
+
+		if (!fillInput(input)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int64 spliceData(int socket, HyperVSink* sink, uint64 size)
+{
+	while (size > 0)
+	{
+		ssize_t ret = splice(socket, NULL, sink->pipe, NULL, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+		if (ret > 0) {
+			sink->piped += ret;
+			size -= ret;
+			continue;
+		}
+
+		if (ret == 0) {
+			return -1;
+		}
+
+		if (errno == EINTR) {
+			continue;
+		}
+
+		// this transport can't splice, receive the rest
+		if (errno != EAGAIN) {
+			break;
+		}
+
+		// nothing to read yet, or the pipe ran out of slots, which
+		// is the case if the socket is readable and splice still failed
+		struct pollfd pfd = { socket, POLLIN, 0 };
+
+		if (poll(&pfd, 1, 0) > 0) {
+			break;
+		}
+
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+			return -1;
+		}
+	}
+
+	return size;
+}
+
+// throws away data nobody can take, so the socket stays in step
+int skipInput(HyperVInput* input, uint64 size)
+{
+	char scratch[READ_AHEAD];
+
+	while (size > 0) {
+		uint64 chunk = size < sizeof(scratch) ? size : sizeof(scratch);
+
+		if (!readInput(input, scratch, chunk)) {
+			return 0;
+		}
+
+		size -= chunk;
+	}
+
+	return 1;
+}
+
+// -1 when the data didn't fit the sink and was skipped
+int recvData(HyperVInput* input, HyperVSink* sink, uint64 size)
+{
+	if (size > sink->capacity) {
+		return skipInput(input, size) ? -1 : 0;
+	}
+
+	if (sink->data) {
+		return readInput(input, sink->data, size);
+	}
+
+	// what was read ahead goes into the pipe first, it is empty
+	// and at least as large as the data
+	while (size > 0 && input->start < input->end) {
+		uint64 buffered = input->end - input->start;
+		ssize_t ret = write(sink->pipe, input->buffer + input->start, buffered < size ? buffered : size);
+
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (ret <= 0) {
+			return 0;
+		}
+
+		input->start += ret;
+		sink->piped += ret;
+		size -= ret;
+	}
+
+	int64 left = spliceData(input->socket, sink, size);
+
+	if (left <= 0) {
+		return left == 0;
+	}
+
+	sink->overflow = (char*)malloc(left);
+
+	if (!readInput(input, sink->overflow, left)) {
+		free(sink->overflow);
+		sink->overflow = NULL;
+		return 0;
+	}
+
+	return 1;
+}
+
+// compressed bulk data is received whole and unpacked where the sink says,
+// a pipe sink gets it in its overflow buffer
+int readCompressed(HyperVInput* input, HyperVHeader* header, HyperVSink* sink, char** response)
+{
+#if defined LZ4
+	uint64 headSize = header->size - header->dataSize;
+	uint64 size = sink ? headSize : headSize + header->rawSize;
+	char* raw = NULL;
+	HyperVHeader* reply = NULL;
+
+	*response = (char*)malloc(size);
+	memcpy(*response, header, sizeof(HyperVHeader));
+
+	// more than was asked for, only this request fails
+	if (sink && header->rawSize > sink->capacity) {
+		if (!readInput(input, *response + sizeof(HyperVHeader), headSize - sizeof(HyperVHeader))
+			|| !skipInput(input, header->dataSize)) {
+			free(*response);
+			return 0;
+		}
+
+		reply = (HyperVHeader*)*response;
+		reply->size = headSize;
+		reply->dataSize = 0;
+		reply->status = EIO;
+
+		return 1;
+	}
+
+	char* compressed = (char*)malloc(header->dataSize);
+
+	if (!readInput(input, *response + sizeof(HyperVHeader), headSize - sizeof(HyperVHeader))
+		|| !readInput(input, compressed, header->dataSize)) {
+		goto fail;
+	}
+
+	if (!sink) {
+		raw = *response + headSize;
+	} else if (sink->data) {
+		raw = sink->data;
+	} else {
+		raw = sink->overflow = (char*)malloc(header->rawSize);
+	}
+
+	if (LZ4_decompress_safe(compressed, raw, header->dataSize, header->rawSize) != (int)header->rawSize) {
+		goto fail;
+	}
+
+	__atomic_fetch_add(&compressStats.rawBytes, header->rawSize, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&compressStats.wireBytes, header->dataSize, __ATOMIC_RELAXED);
+	free(compressed);
+
+	reply = (HyperVHeader*)*response;
+	reply->size = headSize + header->rawSize;
+	reply->dataSize = header->rawSize;
+	reply->flags &= ~HYPERV_FLAG_COMPRESSED;
+
+	return 1;
+
+fail:
+	if (sink && sink->overflow) {
+		free(sink->overflow);
+		sink->overflow = NULL;
+	}
+
+	free(compressed);
+	free(*response);
+
+	return 0;
+#else
+	// never asked for
+	return 0;
+#endif
+}
+
+int readReply(HyperVInput* input, char** response)
+{
+	HyperVHeader header;
+
+	if (!readInput(input, (char*)&header, sizeof(HyperVHeader))) {
+		return 0;
+	}
+
+	if (header.size < sizeof(HyperVHeader) || header.dataSize > header.size - sizeof(HyperVHeader)) {
+		return 0;
+	}
+
+	// bulk data skips the response buffer when the request said where it goes
+	HyperVSink* sink = header.id < MAX_PENDING ? pending[header.id].sink : NULL;
+
+	if (header.flags & HYPERV_FLAG_COMPRESSED) {
+		return readCompressed(input, &header, sink, response);
+	}
+
+	uint64 size = sink ? header.size - header.dataSize : header.size;
+
+	*response = (char*)malloc(size);
+	memcpy(*response, &header, sizeof(HyperVHeader));
+
+	if (!readInput(input, *response + sizeof(HyperVHeader), size - sizeof(HyperVHeader))) {
+		free(*response);
+		return 0;
+	}
+
+	int received = sink && header.dataSize ? recvData(input, sink, header.dataSize) : 1;
+
+	if (!received) {
+		free(*response);
+		return 0;
+	}
+
+	// more than was asked for, only this request fails
+	if (received < 0) {
+		((HyperVHeader*)*response)->status = EIO;
+	}
+
+	return 1;
+}
+
+static void* readReplies(void* data)
+{
+	HyperVConnection* conn = (HyperVConnection*)data;
+	int socket = conn->socket;
+	HyperVInput* input = openInput(socket, busyPollNs(conn->lane));
+	char* response = NULL;
+
+	// replies can arrive in any order, hand each one to the request waiting for it
+	while (readReply(input, &response)) {
+		HyperVHeader* header = (HyperVHeader*)response;
+
+		if (header->id >= MAX_PENDING) {
+			free(response);
+			continue;
+		}
+
+		if (!completeOp(header->id, response)) {
+			free(response);
+		}
+	}
+
+	free(input);
+
+	// the pool shrank, the server closes the socket once it answered everything
+	if (__atomic_load_n(&conn->retired, __ATOMIC_ACQUIRE)) {
+		close(socket);
+		return NULL;
+	}
+
+	// socket was closed, fail the requests still waiting on it
+	failOps(socket);
+
+	signalExit(mountedFuse);
+
+	return NULL;
+}
+
+static void* invalidatePath(void* data)
+{
+	struct fuse* fuse = (struct fuse*)data;
+	char* response = NULL;
+	char* path = NULL;
+
+	pthread_mutex_lock(&changeSocketLock);
+
+	HyperVInput* input = openInput(changeSocket, 0);
+
+	while (readMessage(input, &response)) {
+		// get path
+		path = (char*)(response + sizeof(HyperVHeader) + sizeof(short));
+
+		printf("Should invalidate path %s\n", path);
+
+		dropAttr(path);
+		dropLink(path);
+		dropContent(path);
+		fuse_invalidate_path(fuse, path);
+
+		free(response);
+	}
+
+	free(input);
+
+	pthread_mutex_unlock(&changeSocketLock);
+
+	// socket was closed
+	signalExit(fuse);
+
+	return NULL;
+}
+
+int writeHeader(char* buffer, uint64 size, short opCode)
+{
+	// the request id is set by requestOp
+	HyperVHeader header = { 0 };
+	header.size = size;
+	header.op = opCode;
+
+	memcpy(buffer, &header, sizeof(HyperVHeader));
+
+	return sizeof(HyperVHeader);
+}
+
+char* opHello(short role, short lane, short connections, uint32 transfer, uint32 wantedFeatures)
+{
+	short opCode = HYPERV_HELLO;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short) + sizeof(short) + sizeof(short) + sizeof(uint32) + sizeof(uint32) + sizeof(uint64);
 	char* request = (char*)malloc(size);
 
-	int offset = 0;
-	memcpy(request + offset, &size, sizeof(uint64));
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &role, sizeof(short));
 
-	offset += sizeof(uint64);
-	memcpy(request + offset, &opCode, sizeof(short));
+	offset += sizeof(short);
+	memcpy(request + offset, &lane, sizeof(short));
 
 	offset += sizeof(short);
+	memcpy(request + offset, &connections, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, &transfer, sizeof(uint32));
+
+	offset += sizeof(uint32);
+	memcpy(request + offset, &wantedFeatures, sizeof(uint32));
+
+	offset += sizeof(uint32);
+	memcpy(request + offset, &sessionId, sizeof(uint64));
+
+	return request;
+}
+
+char* opReadAttr(const char* path)
+{
+	short opCode = HYPERV_ATTR;
+	short pathLength = strlen(path) + 1;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short) + pathLength;
+	char* request = (char*)malloc(size);
+
+	int offset = writeHeader(request, size, opCode);
 	memcpy(request + offset, &pathLength, sizeof(short));
 
 	offset += sizeof(short);
 	memcpy(request + offset, path, pathLength);
 
-	offset += pathLength;
-	memcpy(request + offset, &mode, sizeof(uint32));
-
 	return request;
 }
 
-char* opRmdir(const char* path)
+char* opWalk(const char* path)
 {
-	short opCode = HYPERV_RMDIR;
+	short opCode = HYPERV_WALK;
 	short pathLength = strlen(path) + 1;
-	uint64 size = sizeof(uint64) + sizeof(short) + sizeof(short) + pathLength;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short) + pathLength;
+	char* request = (char*)malloc(size);
+
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &pathLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, path, pathLength);
+
+	return request;
+}
+
+char* opBulkStat(char** paths, short count)
+{
+	short opCode = HYPERV_BULK_STAT;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short);
+
+	for (short i = 0; i < count; i++) {
+		size += sizeof(short) + strlen(paths[i]) + 1;
+	}
+
+	char* request = (char*)malloc(size);
+
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &count, sizeof(short));
+
+	offset += sizeof(short);
+
+	for (short i = 0; i < count; i++) {
+		short pathLength = strlen(paths[i]) + 1;
+		memcpy(request + offset, &pathLength, sizeof(short));
+
+		offset += sizeof(short);
+		memcpy(request + offset, paths[i], pathLength);
+
+		offset += pathLength;
+	}
+
+	return request;
+}
+
+char* opBulkRead(char** paths, short count, uint64 maxFile, uint64 maxTotal, const char* resume)
+{
+	short opCode = HYPERV_BULK_READ;
+	short resumeLength = resume ? strlen(resume) + 1 : 0;
+	uint64 size = sizeof(HyperVHeader) + sizeof(uint64) + sizeof(uint64) + sizeof(short) + resumeLength + sizeof(short);
+
+	for (short i = 0; i < count; i++) {
+		size += sizeof(short) + strlen(paths[i]) + 1;
+	}
+
 	char* request = (char*)malloc(size);
 
-	int offset = 0;
-	memcpy(request + offset, &size, sizeof(uint64));
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &maxFile, sizeof(uint64));
+
+	offset += sizeof(uint64);
+	memcpy(request + offset, &maxTotal, sizeof(uint64));
 
 	offset += sizeof(uint64);
-	memcpy(request + offset, &opCode, sizeof(short));
+	memcpy(request + offset, &resumeLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, resume, resumeLength);
+
+	offset += resumeLength;
+	memcpy(request + offset, &count, sizeof(short));
+
+	offset += sizeof(short);
+
+	for (short i = 0; i < count; i++) {
+		short pathLength = strlen(paths[i]) + 1;
+		memcpy(request + offset, &pathLength, sizeof(short));
+
+		offset += sizeof(short);
+		memcpy(request + offset, paths[i], pathLength);
+
+		offset += pathLength;
+	}
+
+	return request;
+}
+
+char* opRmTree(const char* path)
+{
+	short opCode = HYPERV_RMTREE;
+	short pathLength = strlen(path) + 1;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short) + pathLength;
+	char* request = (char*)malloc(size);
+
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &pathLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, path, pathLength);
+
+	return request;
+}
+
+char* opCopyTree(const char* from, const char* to, const char* resume)
+{
+	short opCode = HYPERV_COPYTREE;
+	short fromLength = strlen(from) + 1;
+	short toLength = strlen(to) + 1;
+	short resumeLength = resume[0] ? strlen(resume) + 1 : 0;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short) + fromLength + sizeof(short) + toLength
+		+ sizeof(short) + resumeLength;
+	char* request = (char*)malloc(size);
+
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &fromLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, from, fromLength);
+
+	offset += fromLength;
+	memcpy(request + offset, &toLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, to, toLength);
+
+	offset += toLength;
+	memcpy(request + offset, &resumeLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, resume, resumeLength);
+
+	return request;
+}
+
+char* opReadDir(const char* path)
+{
+	short opCode = HYPERV_READDIR;
+	short pathLength = strlen(path) + 1;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short) + pathLength;
+	char* request = (char*)malloc(size);
+
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &pathLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, path, pathLength);
+
+	return request;
+}
+
+char* opRead(const char* path, uint64 rSize, int64 rOffset, uint64 handle)
+{
+	short opCode = HYPERV_READ;
+	short pathLength = strlen(path) + 1;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short) + pathLength + sizeof(uint64) + sizeof(int64) + sizeof(uint64);
+	char* request = (char*)malloc(size);
+
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &pathLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, path, pathLength);
+
+	offset += pathLength;
+	memcpy(request + offset, &rSize, sizeof(uint64));
+
+	offset += sizeof(uint64);
+	memcpy(request + offset, &rOffset, sizeof(int64));
+
+	offset += sizeof(int64);
+	memcpy(request + offset, &handle, sizeof(uint64));
+
+	return request;
+}
+
+char* opCreateWithData(const char* path, uint32 mode, uint64 cSize)
+{
+	short opCode = HYPERV_CREATE_WITH_DATA;
+	short pathLength = strlen(path) + 1;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short) + pathLength + sizeof(uint32);
+	char* request = (char*)malloc(size);
+
+	// the data is sent from the write behind buffer
+	int offset = writeHeader(request, size + cSize, opCode);
+	((HyperVHeader*)request)->dataSize = cSize;
+	memcpy(request + offset, &pathLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, path, pathLength);
+
+	offset += pathLength;
+	memcpy(request + offset, &mode, sizeof(uint32));
+
+	return request;
+}
+
+char* opOpen(const char* path, uint32 flags, uint32 mode)
+{
+	short opCode = HYPERV_OPEN;
+	short pathLength = strlen(path) + 1;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short) + pathLength + sizeof(uint32) + sizeof(uint32);
+	char* request = (char*)malloc(size);
+
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &pathLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, path, pathLength);
+
+	offset += pathLength;
+	memcpy(request + offset, &flags, sizeof(uint32));
+
+	offset += sizeof(uint32);
+	memcpy(request + offset, &mode, sizeof(uint32));
+
+	return request;
+}
+
+char* opRelease(uint64 handle)
+{
+	short opCode = HYPERV_RELEASE;
+	uint64 size = sizeof(HyperVHeader) + sizeof(uint64);
+	char* request = (char*)malloc(size);
+
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &handle, sizeof(uint64));
+
+	return request;
+}
+
+char* opWrite(const char* path, uint64 wSize, int64 wOffset, uint64 handle)
+{
+	short opCode = HYPERV_WRITE;
+	short pathLength = strlen(path) + 1;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short) + pathLength + sizeof(uint64) + sizeof(int64) + sizeof(uint64);
+	char* request = (char*)malloc(size);
+
+	// the data itself is sent from the fuse buffer by requestOpData
+	int offset = writeHeader(request, size + wSize, opCode);
+	((HyperVHeader*)request)->dataSize = wSize;
+	memcpy(request + offset, &pathLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, path, pathLength);
+
+	offset += pathLength;
+	memcpy(request + offset, &wSize, sizeof(uint64));
+
+	offset += sizeof(uint64);
+	memcpy(request + offset, &wOffset, sizeof(int64));
+
+	offset += sizeof(int64);
+	memcpy(request + offset, &handle, sizeof(uint64));
+
+	return request;
+}
+
+char* opUnlink(const char* path)
+{
+	short opCode = HYPERV_UNLINK;
+	short pathLength = strlen(path) + 1;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short) + pathLength;
+	char* request = (char*)malloc(size);
+
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &pathLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, path, pathLength);
+
+	return request;
+}
+
+char* opTruncate(const char* path, int64 tOffset, uint64 handle)
+{
+	short opCode = HYPERV_TRUNCATE;
+	short pathLength = strlen(path) + 1;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short) + pathLength + sizeof(int64) + sizeof(uint64);
+	char* request = (char*)malloc(size);
+
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &pathLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, path, pathLength);
+
+	offset += pathLength;
+	memcpy(request + offset, &tOffset, sizeof(int64));
+
+	offset += sizeof(int64);
+	memcpy(request + offset, &handle, sizeof(uint64));
+
+	return request;
+}
+
+char* opCopy(const char* from, int64 fromOffset, uint64 fromHandle,
+	const char* to, int64 toOffset, uint64 toHandle, uint64 cSize)
+{
+	short opCode = HYPERV_COPY;
+	short fromLength = strlen(from) + 1;
+	short toLength = strlen(to) + 1;
+	uint64 size = sizeof(HyperVHeader) + 2 * (sizeof(short) + sizeof(int64) + sizeof(uint64))
+		+ fromLength + toLength + sizeof(uint64);
+	char* request = (char*)malloc(size);
+
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &fromLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, from, fromLength);
+
+	offset += fromLength;
+	memcpy(request + offset, &fromOffset, sizeof(int64));
+
+	offset += sizeof(int64);
+	memcpy(request + offset, &fromHandle, sizeof(uint64));
+
+	offset += sizeof(uint64);
+	memcpy(request + offset, &toLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, to, toLength);
+
+	offset += toLength;
+	memcpy(request + offset, &toOffset, sizeof(int64));
+
+	offset += sizeof(int64);
+	memcpy(request + offset, &toHandle, sizeof(uint64));
+
+	offset += sizeof(uint64);
+	memcpy(request + offset, &cSize, sizeof(uint64));
+
+	return request;
+}
+
+char* opFallocate(const char* path, uint32 mode, int64 fOffset, int64 fLength, uint64 handle)
+{
+	short opCode = HYPERV_FALLOCATE;
+	short pathLength = strlen(path) + 1;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short) + pathLength + sizeof(uint32) + 2 * sizeof(int64) + sizeof(uint64);
+	char* request = (char*)malloc(size);
+
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &pathLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, path, pathLength);
+
+	offset += pathLength;
+	memcpy(request + offset, &mode, sizeof(uint32));
+
+	offset += sizeof(uint32);
+	memcpy(request + offset, &fOffset, sizeof(int64));
+
+	offset += sizeof(int64);
+	memcpy(request + offset, &fLength, sizeof(int64));
+
+	offset += sizeof(int64);
+	memcpy(request + offset, &handle, sizeof(uint64));
+
+	return request;
+}
+
+char* opQueryRanges(const char* path, uint64 handle)
+{
+	short opCode = HYPERV_QUERY_RANGES;
+	short pathLength = strlen(path) + 1;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short) + pathLength + sizeof(uint64);
+	char* request = (char*)malloc(size);
+
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &pathLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, path, pathLength);
+
+	offset += pathLength;
+	memcpy(request + offset, &handle, sizeof(uint64));
+
+	return request;
+}
+
+char* opMkdir(const char* path, uint32 mode)
+{
+	short opCode = HYPERV_MKDIR;
+	short pathLength = strlen(path) + 1;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short) + pathLength + sizeof(uint32);
+	char* request = (char*)malloc(size);
+
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &pathLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, path, pathLength);
+
+	offset += pathLength;
+	memcpy(request + offset, &mode, sizeof(uint32));
+
+	return request;
+}
+
+char* opRmdir(const char* path)
+{
+	short opCode = HYPERV_RMDIR;
+	short pathLength = strlen(path) + 1;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short) + pathLength;
+	char* request = (char*)malloc(size);
+
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &pathLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, path, pathLength);
+
+	return request;
+}
+
+char* opRename(const char* from, const char* to)
+{
+	short opCode = HYPERV_RENAME;
+	short fromLength = strlen(from) + 1;
+	short toLength = strlen(to) + 1;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short) + fromLength + sizeof(short) + toLength;
+	char* request = (char*)malloc(size);
+
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &fromLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, from, fromLength);
+
+	offset += fromLength;
+	memcpy(request + offset, &toLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, to, toLength);
+
+	return request;
+}
+
+char* opSymlink(const char* from, const char* to, short ext)
+{
+	short opCode = HYPERV_SYMLINK;
+	short fromLength = strlen(from) + 1;
+	short toLength = strlen(to) + 1;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short) + fromLength + sizeof(short) + toLength + sizeof(short);
+	char* request = (char*)malloc(size);
+
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &fromLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, from, fromLength);
+
+	offset += fromLength;
+	memcpy(request + offset, &toLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, to, toLength);
+
+	offset += toLength;
+	memcpy(request + offset, &ext, sizeof(short));
+
+	return request;
+}
+
+char* opLink(const char* from, const char* to)
+{
+	short opCode = HYPERV_LINK;
+	short fromLength = strlen(from) + 1;
+	short toLength = strlen(to) + 1;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short) + fromLength + sizeof(short) + toLength;
+	char* request = (char*)malloc(size);
+
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &fromLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, from, fromLength);
+
+	offset += fromLength;
+	memcpy(request + offset, &toLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, to, toLength);
+
+	return request;
+}
+
+char* opReadlink(const char* path)
+{
+	short opCode = HYPERV_READLINK;
+	short pathLength = strlen(path) + 1;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short) + pathLength;
+	char* request = (char*)malloc(size);
+
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &pathLength, sizeof(short));
+
+	offset += sizeof(short);
+	memcpy(request + offset, path, pathLength);
+
+	return request;
+}
+
+// takes ownership of the requests, they are copied one after the other
+char* opCompound(char** requests, short count)
+{
+	short opCode = HYPERV_COMPOUND;
+	uint64 size = sizeof(HyperVHeader) + sizeof(short);
+
+	for (int i = 0; i < count; i++) {
+		size += ((HyperVHeader*)requests[i])->size;
+	}
+
+	char* request = (char*)malloc(size);
+
+	int offset = writeHeader(request, size, opCode);
+	memcpy(request + offset, &count, sizeof(short));
+
+	offset += sizeof(short);
+
+	for (int i = 0; i < count; i++) {
+		uint64 subSize = ((HyperVHeader*)requests[i])->size;
+
+		memcpy(request + offset, requests[i], subSize);
+		offset += subSize;
+		free(requests[i]);
+	}
+
+	return request;
+}
+
+char* mountPath()
+{
+	return *((char**)fuse_get_session(fuse_get_context()->fuse));
+}
+
+char* makeLocalPath(const char* path, const char* name)
+{
+	int len = strlen(name);
+	int size = len == 0 ? 1 : len + 1;
+
+	char* filePath = (char*)calloc(1, strlen(path) + size);
+
+	strcpy(filePath, path);
+
+	if (len) {
+		strcat(filePath, name);
+	}
+
+	return filePath;
+}
+
+int relativeToMountpoint(const char* mountpoint, const char* path)
+{
+	int mountLen = strlen(mountpoint);
+
+	// does not start with the mountpoint
+	if (strncmp(mountpoint, path, mountLen) != 0) {
+		return 0;
+	}
+
+	const char* start = path + mountLen;
+	const char* end = start;
+
+	while (*end)
+	{
+		// find next segment
+		while (*end && *end != '/') {
+			++end;
+		}
+
+		// check for . or ..
+		if (end - start == 2 && start[1] == '.') {
+			return 0;
+		}
+
+		if (end - start == 3 && start[1] == '.' && start[2] == '.') {
+			return 0;
+		}
+
+		start = end++;
+	}
+
+	return mountLen;
+}
+
+int readMessage(HyperVInput* input, char** buffer)
+{
+	HyperVHeader header;
+
+	if (!readInput(input, (char*)&header, sizeof(HyperVHeader))) {
+		return 0;
+	}
+
+	if (header.size < sizeof(HyperVHeader)) {
+		return 0;
+	}
+
+	*buffer = (char*)malloc(header.size);
+	memcpy(*buffer, &header, sizeof(HyperVHeader));
+
+	if (!readInput(input, *buffer + sizeof(HyperVHeader), header.size - sizeof(HyperVHeader))) {
+		free(*buffer);
+		return 0;
+	}
+
+	return header.size;
+}
+
+int sendIov(int socket, struct iovec* iov, int count, int flags)
+{
+	struct msghdr msg = { 0 };
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+
+	while (msg.msg_iovlen > 0)
+	{
+		ssize_t ret = sendmsg(socket, &msg, MSG_NOSIGNAL | flags);
+
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (ret <= 0) {
+			return 0;
+		}
+
+		// skip what was sent, sendmsg can stop anywhere
+		while (msg.msg_iovlen > 0 && (size_t)ret >= msg.msg_iov->iov_len) {
+			ret -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + ret;
+			msg.msg_iov->iov_len -= ret;
+		}
+	}
+
+	return 1;
+}
+
+int sendMessageData(int socket, char* buffer, const char* data)
+{
+	HyperVHeader* header = (HyperVHeader*)buffer;
+
+	// header and data go out in one call, without copying the data
+	struct iovec iov[2] = {
+		{ buffer, header->size - header->dataSize },
+		{ (void*)data, header->dataSize }
+	};
+
+	if (!sendIov(socket, iov, header->dataSize ? 2 : 1, 0)) {
+		return 0;
+	}
+
+	return header->size;
+}
+
+int sendMessageFd(int socket, char* buffer, const struct fuse_buf* data)
+{
+	HyperVHeader* header = (HyperVHeader*)buffer;
+	uint64 left = header->dataSize;
+	loff_t pos = data->pos;
+
+	// the header goes first, then the data is moved from the fuse pipe
+	struct iovec iov = { buffer, header->size - header->dataSize };
+
+	if (!sendIov(socket, &iov, 1, MSG_MORE)) {
+		return 0;
+	}
+
+	while (left > 0)
+	{
+		ssize_t ret = splice(data->fd, (data->flags & FUSE_BUF_FD_SEEK) ? &pos : NULL, socket, NULL, left, SPLICE_F_MOVE);
+
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (ret <= 0) {
+			return 0;
+		}
+
+		left -= ret;
+	}
+
+	return header->size;
+}
+
+int sendMessage(int socket, char* buffer)
+{
+	return sendMessageData(socket, buffer, NULL);
+}
+
+void flushFrames(HyperVPool* pool, HyperVConnection* conn)
+{
+	HyperVFrame* frames = __atomic_exchange_n(&conn->frames, NULL, __ATOMIC_ACQUIRE);
+	HyperVFrame* ordered = NULL;
+	uint64 now = 0;
+
+	// the stack comes out newest first
+	while (frames) {
+		HyperVFrame* next = frames->next;
+		frames->next = ordered;
+		ordered = frames;
+		frames = next;
+	}
+
+	while (ordered) {
+		struct iovec iov[SEND_BATCH * 2];
+		HyperVFrame* spliced = NULL;
+		int count = 0;
+
+		// everything is read from the frames before sending, a frame
+		// belongs to a waiting request and is gone once its reply is in
+		for (int i = 0; ordered && i < SEND_BATCH; i++) {
+			HyperVFrame* frame = ordered;
+			HyperVHeader* header = (HyperVHeader*)frame->buffer;
+			ordered = frame->next;
+
+			if (frame->queuedNs) {
+				now = now ? now : monotonicNs();
+				__atomic_fetch_add(&pool->aquireWaitNs, now - frame->queuedNs, __ATOMIC_RELAXED);
+			}
+
+			// data in a pipe is spliced after the frames before it
+			if (frame->data && (frame->data->flags & FUSE_BUF_IS_FD)) {
+				spliced = frame;
+				break;
+			}
+
+			iov[count].iov_base = frame->buffer;
+			iov[count++].iov_len = header->size - header->dataSize;
+
+			if (header->dataSize) {
+				iov[count].iov_base = frame->data->mem;
+				iov[count++].iov_len = header->dataSize;
+			}
+		}
+
+		int sent = !count || sendIov(conn->socket, iov, count, spliced ? MSG_MORE : 0);
+
+		if (sent && spliced) {
+			sent = sendMessageFd(conn->socket, spliced->buffer, spliced->data) > 0;
+		}
+
+		// the reader fails everything in flight on this socket once it is down
+		if (!sent) {
+			shutdown(conn->socket, SHUT_RDWR);
+			return;
+		}
+	}
+}
+
+void sendFrame(HyperVPool* pool, HyperVConnection* conn, HyperVFrame* frame)
+{
+	int idle = 0;
+
+	// the wait on a busy socket is timed until its holder sends the frame
+	if (__atomic_load_n(&conn->busy, __ATOMIC_RELAXED)) {
+		frame->queuedNs = monotonicNs();
+	}
+
+	frame->next = __atomic_load_n(&conn->frames, __ATOMIC_RELAXED);
+
+	while (!__atomic_compare_exchange_n(&conn->frames, &frame->next, frame, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	// whoever holds the socket sends everything queued on it, and checks again
+	// after letting go, so a frame queued while it was sending is never left behind
+	while (__atomic_load_n(&conn->frames, __ATOMIC_SEQ_CST)
+		&& __atomic_compare_exchange_n(&conn->busy, &idle, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		flushFrames(pool, conn);
+		releaseSocket(conn);
+		idle = 0;
+	}
+}
+
+char* requestOp(char* request, int* err)
+{
+	return requestOpBuf(request, NULL, NULL, err);
+}
+
+char* requestOpBuf(char* request, const struct fuse_buf* data, HyperVSink* sink, int* err)
+{
+	int id = submitOp(request, data, sink, 0, err);
+
+	if (id < 0) {
+		return NULL;
+	}
+
+	return finishOp(id, err);
+}
+
+// sends a request without waiting for the reply, finishOp waits for it,
+// the request buffer is freed once the reply is in
+int submitOp(char* request, const struct fuse_buf* data, HyperVSink* sink, int stripe, int* err)
+{
+	HyperVHeader* header = (HyperVHeader*)request;
+	HyperVPool* pool = &pools[opLane(header->op)];
+	int id = aquireId();
+	HyperVConnection* conn = pickSocket(pool, stripe);
+	*err = 0;
+
+	header->id = id;
+	pending[id].sink = sink;
+	pending[id].spinNs = busyPollNs(pool->lane);
+	pending[id].frame.buffer = request;
+	pending[id].frame.data = data;
+	pending[id].frame.queuedNs = 0;
+
+	if (!registerOp(id, conn->socket)) {
+		putSocket(conn);
+		free(request);
+		releaseId(id);
+		*err = ENOTCONN;
+		return -1;
+	}
+
+	// the frame might go out with others queued on the same socket,
+	// a failed send shows up as a failed reply
+	sendFrame(pool, conn, &pending[id].frame);
+	putSocket(conn);
+
+	return id;
+}
+
+char* finishOp(int id, int* err)
+{
+	char* response = waitOp(id, pending[id].spinNs);
+	*err = 0;
+
+	if (!response) {
+		*err = ENOTCONN;
+		goto out;
+	}
+
+	short status = ((HyperVHeader*)response)->status;
+
+	if (status != HYPERV_OK) {
+		free(response);
+		*err = (int)status;
+		goto out;
+	}
+
+out:
+	free(pending[id].frame.buffer);
+	releaseId(id);
+	return *err ? NULL : response;
+}
+
+// the reply of the index-th sub op, the count was checked by the server
+HyperVHeader* compoundReply(char* response, int index)
+{
+	char* reply = response + sizeof(HyperVHeader) + sizeof(short);
+
+	for (int i = 0; i < index; i++) {
+		reply += ((HyperVHeader*)reply)->size;
+	}
+
+	return (HyperVHeader*)reply;
+}
+
+uint32 pathHash(const char* path)
+{
+	// fnv-1a
+	uint32 hash = 2166136261u;
+
+	for (const char* c = path; *c; c++) {
+		hash = (hash ^ (unsigned char)*c) * 16777619u;
+	}
+
+	return hash;
+}
+
+void lockSlot(int* lock)
+{
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+		cpuRelax();
+	}
+}
+
+void unlockSlot(int* lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+HyperVCachedAttr* lockAttr(const char* path)
+{
+	HyperVCachedAttr* slot = &attrCache[pathHash(path) % ATTR_CACHE_SLOTS];
+	lockSlot(&slot->lock);
+
+	return slot;
+}
+
+void unlockAttr(HyperVCachedAttr* slot)
+{
+	unlockSlot(&slot->lock);
+}
+
+void cacheAttr(const char* path, const HyperVStat* stat)
+{
+	if (strlen(path) >= ATTR_CACHE_PATH) {
+		return;
+	}
+
+	HyperVCachedAttr* slot = lockAttr(path);
+
+	strcpy(slot->path, path);
+	slot->stat = *stat;
+	slot->expiresNs = monotonicNs() + ATTR_CACHE_NS;
+
+	unlockAttr(slot);
+}
+
+// a hit is used up, the kernel keeps the attributes from then on
+int takeAttr(const char* path, HyperVStat* stat)
+{
+	HyperVCachedAttr* slot = lockAttr(path);
+	int hit = slot->expiresNs && strcmp(slot->path, path) == 0;
+
+	if (hit) {
+		hit = monotonicNs() < slot->expiresNs;
+		*stat = slot->stat;
+		slot->expiresNs = 0;
+	}
+
+	unlockAttr(slot);
+
+	return hit;
+}
+
+void dropAttr(const char* path)
+{
+	HyperVCachedAttr* slot = lockAttr(path);
+
+	if (slot->expiresNs && strcmp(slot->path, path) == 0) {
+		slot->expiresNs = 0;
+	}
+
+	unlockAttr(slot);
+}
+
+// a link entry as the server sends it after a stat, [ext][length][target],
+// cached unless the target couldn't be read, returns its size
+int cacheLink(const char* path, const char* link)
+{
+	short ext;
+	short targetLength;
+
+	memcpy(&ext, link, sizeof(short));
+	memcpy(&targetLength, link + sizeof(short), sizeof(short));
+
+	if (!targetLength || strlen(path) >= ATTR_CACHE_PATH) {
+		return 2 * sizeof(short) + targetLength;
+	}
+
+	char* target = strndup(link + 2 * sizeof(short), targetLength);
+	HyperVCachedLink* slot = &linkCache[pathHash(path) % ATTR_CACHE_SLOTS];
+	lockSlot(&slot->lock);
+
+	free(slot->target);
+	strcpy(slot->path, path);
+	slot->ext = ext;
+	slot->expiresNs = monotonicNs() + LINK_CACHE_NS;
+	slot->target = target;
+
+	unlockSlot(&slot->lock);
+
+	return 2 * sizeof(short) + targetLength;
+}
+
+// the target as readlink returns it, or NULL when it isn't cached
+char* findLink(const char* path, short* ext)
+{
+	HyperVCachedLink* slot = &linkCache[pathHash(path) % ATTR_CACHE_SLOTS];
+	char* target = NULL;
+
+	lockSlot(&slot->lock);
+
+	if (slot->target && strcmp(slot->path, path) == 0 && monotonicNs() < slot->expiresNs) {
+		target = strdup(slot->target);
+		*ext = slot->ext;
+	}
+
+	unlockSlot(&slot->lock);
+
+	return target;
+}
+
+void dropLink(const char* path)
+{
+	HyperVCachedLink* slot = &linkCache[pathHash(path) % ATTR_CACHE_SLOTS];
+	lockSlot(&slot->lock);
+
+	if (slot->target && strcmp(slot->path, path) == 0) {
+		free(slot->target);
+		slot->target = NULL;
+	}
+
+	unlockSlot(&slot->lock);
+}
+
+// with the content lock held
+HyperVCachedContent** findContent(const char* path)
+{
+	HyperVCachedContent** next = &contentCache[pathHash(path) % CONTENT_CACHE_SLOTS];
+
+	while (*next && strcmp((*next)->path, path) != 0) {
+		next = &(*next)->next;
+	}
+
+	return next;
+}
+
+// takes the data, unless the cache is full
+int cacheContent(const char* path, const HyperVStat* stat, char* data, uint64 size)
+{
+	int cached = 0;
+
+	pthread_rwlock_wrlock(&contentLock);
+
+	HyperVCachedContent** slot = findContent(path);
+	uint64 replaced = *slot ? (*slot)->size : 0;
+
+	if (contentBytes - replaced + size <= (uint64)options.contentCache) {
+		if (!*slot) {
+			*slot = (HyperVCachedContent*)calloc(1, sizeof(HyperVCachedContent));
+			(*slot)->path = strdup(path);
+			contentFiles++;
+		}
+
+		free((*slot)->data);
+		(*slot)->stat = *stat;
+		(*slot)->data = data;
+		(*slot)->size = size;
+		contentBytes += size - replaced;
+		cached = 1;
+	}
+
+	pthread_rwlock_unlock(&contentLock);
+
+	return cached;
+}
+
+// unlinks the entry, with the content lock held
+void freeContent(HyperVCachedContent** slot)
+{
+	HyperVCachedContent* content = *slot;
+
+	*slot = content->next;
+	contentBytes -= content->size;
+	contentFiles--;
+
+	free(content->data);
+	free(content->path);
+	free(content);
+}
+
+// copies out what the kernel asked for, -1 when the file isn't cached
+ssize_t readContent(const char* path, char* buf, size_t size, off_t offset, HyperVStat* stat)
+{
+	ssize_t bytesRead = -1;
+
+	pthread_rwlock_rdlock(&contentLock);
+
+	HyperVCachedContent* content = *findContent(path);
+
+	if (content) {
+		uint64 left = (uint64)offset < content->size ? content->size - offset : 0;
+		bytesRead = left < size ? left : size;
+	}
+
+	if (content && stat) {
+		*stat = content->stat;
+	}
+
+	if (bytesRead > 0) {
+		memcpy(buf, content->data + offset, bytesRead);
+	}
+
+	pthread_rwlock_unlock(&contentLock);
+
+	return bytesRead;
+}
+
+int contentAttr(const char* path, HyperVStat* stat)
+{
+	return __atomic_load_n(&contentFiles, __ATOMIC_RELAXED) && readContent(path, NULL, 0, 0, stat) == 0;
+}
+
+void dropContent(const char* path)
+{
+	if (!__atomic_load_n(&contentFiles, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	pthread_rwlock_wrlock(&contentLock);
+
+	HyperVCachedContent** slot = findContent(path);
+
+	if (*slot) {
+		freeContent(slot);
+	}
+
+	pthread_rwlock_unlock(&contentLock);
+}
+
+// path is root or anything under it
+int inTree(const char* path, const char* root)
+{
+	int length = strlen(root);
+
+	if (!strcmp(root, "/")) {
+		return 1;
+	}
+
+	return !strncmp(path, root, length) && (path[length] == '/' || !path[length]);
+}
+
+// forgets everything cached under a tree, one pass over each cache
+void dropTree(const char* root)
+{
+	for (int i = 0; i < ATTR_CACHE_SLOTS; i++) {
+		HyperVCachedAttr* attr = &attrCache[i];
+		HyperVCachedLink* link = &linkCache[i];
+
+		lockSlot(&attr->lock);
+
+		if (attr->expiresNs && inTree(attr->path, root)) {
+			attr->expiresNs = 0;
+		}
+
+		unlockSlot(&attr->lock);
+		lockSlot(&link->lock);
+
+		if (link->target && inTree(link->path, root)) {
+			free(link->target);
+			link->target = NULL;
+		}
+
+		unlockSlot(&link->lock);
+	}
+
+	if (!__atomic_load_n(&contentFiles, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	pthread_rwlock_wrlock(&contentLock);
+
+	for (int i = 0; i < CONTENT_CACHE_SLOTS; i++) {
+		HyperVCachedContent** next = &contentCache[i];
+
+		while (*next) {
+			if (inTree((*next)->path, root)) {
+				freeContent(next);
+			} else {
+				next = &(*next)->next;
+			}
+		}
+	}
+
+	pthread_rwlock_unlock(&contentLock);
+}
+
+// the directory holding path, the root is its own parent
+char* parentPath(const char* path)
+{
+	const char* slash = strrchr(path, '/');
+	int length = slash && slash != path ? (int)(slash - path) : 1;
+	char* parent = (char*)malloc(length + 1);
+
+	memcpy(parent, slash ? path : "/", length);
+	parent[length] = '\0';
+
+	return parent;
+}
+
+// an entry of a listed directory
+char* joinPath(const char* path, const char* name)
+{
+	int root = strcmp(path, "/") == 0;
+	char* entryPath = (char*)malloc(strlen(path) + strlen(name) + 2);
+
+	sprintf(entryPath, "%s/%s", root ? "" : path, name);
+
+	return entryPath;
+}
+
+// mutating replies end with the attributes of the path after the change, and of
+// its parent when an entry was added or removed, they wait in the cache for the
+// getattr the kernel sends next
+void cacheReplyAttrs(char* response, uint64 bodySize, const char* path)
+{
+	int offset = sizeof(HyperVHeader) + bodySize;
+	short mask = 0;
+
+	if (((HyperVHeader*)response)->size < offset + sizeof(short) + 2 * sizeof(HyperVStat)) {
+		return;
+	}
+
+	memcpy(&mask, response + offset, sizeof(short));
+	offset += sizeof(short);
+
+	if (mask & HYPERV_ATTR_SELF) {
+		cacheAttr(path, (HyperVStat*)(response + offset));
+	}
+
+	offset += sizeof(HyperVStat);
+
+	if (mask & HYPERV_ATTR_PARENT) {
+		char* parent = parentPath(path);
+		cacheAttr(parent, (HyperVStat*)(response + offset));
+		free(parent);
+	}
+}
+
+// for the ops that reply with nothing but the attributes
+int requestMutation(char* request, const char* path)
+{
+	int err;
+
+	char* inBuffer = requestOp(
+		request,
+		&err
+	);
+
+	if (err) {
+		return err;
+	}
+
+	cacheReplyAttrs(inBuffer, 0, path);
+	free(inBuffer);
+
+	return 0;
+}
+
+uint32 openFlags(int flags)
+{
+	uint32 openFlags = 0;
+	int access = flags & O_ACCMODE;
+
+	if (access == O_RDONLY || access == O_RDWR) {
+		openFlags |= HYPERV_OPEN_READ;
+	}
+
+	if (access == O_WRONLY || access == O_RDWR) {
+		openFlags |= HYPERV_OPEN_WRITE;
+	}
+
+	openFlags |= flags & O_CREAT ? HYPERV_OPEN_CREATE : 0;
+	openFlags |= flags & O_EXCL ? HYPERV_OPEN_EXCL : 0;
+	openFlags |= flags & O_TRUNC ? HYPERV_OPEN_TRUNC : 0;
+	openFlags |= flags & O_APPEND ? HYPERV_OPEN_APPEND : 0;
+
+	return openFlags;
+}
+
+HyperVFile* newFile(HyperVDirtyFile* dirty)
+{
+	HyperVFile* file = (HyperVFile*)calloc(1, sizeof(HyperVFile));
+	file->dirty = dirty;
+	pthread_mutex_init(&file->lock, NULL);
+
+	return file;
+}
+
+void freeRanges(HyperVRanges* ranges)
+{
+	if (ranges) {
+		free(ranges->list);
+		free(ranges);
+	}
+}
+
+void freeFile(HyperVFile* file)
+{
+	freeRanges(file->ranges);
+	pthread_mutex_destroy(&file->lock);
+	free(file);
+}
+
+// creating and truncating happen on the host in the same step as the open,
+// the attributes in the reply answer the getattr that follows
+int openFile(const char* path, struct fuse_file_info* fi, int flags, uint32 mode)
+{
+	int err;
+	HyperVFile* file = NULL;
+
+	// a plain read only open waits for its first read, opens that never
+	// read anything cost no round trip
+	if (!(flags & (O_ACCMODE | O_TRUNC | O_CREAT | O_EXCL | O_APPEND))) {
+		fi->fh = (uintptr_t)newFile(NULL);
+		return 0;
+	}
+
+	char* inBuffer = requestOp(
+		opOpen(path, openFlags(flags), mode),
+		&err
+	);
+
+	if (err) {
+		return err;
+	}
+
+	// reads and writes go to the handle, instead of opening the path every time
+	file = newFile(NULL);
+	memcpy(&file->handle, inBuffer + sizeof(HyperVHeader), sizeof(uint64));
+	fi->fh = (uintptr_t)file;
+
+	cacheReplyAttrs(inBuffer, sizeof(uint64), path);
+	free(inBuffer);
+
+	return 0;
+}
+
+// 0 makes the server open the path for that op
+uint64 fileHandle(struct fuse_file_info* fi)
+{
+	return fi && fi->fh ? __atomic_load_n(&((HyperVFile*)(uintptr_t)fi->fh)->handle, __ATOMIC_ACQUIRE) : 0;
+}
+
+// gives a file without a handle one before it is read, so its reads don't
+// open the path on the host every time, it is released with the file
+int openForRead(const char* path, struct fuse_file_info* fi)
+{
+	HyperVFile* file = fi ? (HyperVFile*)(uintptr_t)fi->fh : NULL;
+	int err = 0;
+
+	if (!file || fileHandle(fi)) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&file->lock);
+
+	if (!file->handle) {
+		char* inBuffer = requestOp(
+			opOpen(path, openFlags(O_RDONLY), 0),
+			&err
+		);
+
+		if (!err) {
+			uint64 handle;
+			memcpy(&handle, inBuffer + sizeof(HyperVHeader), sizeof(uint64));
+			__atomic_store_n(&file->handle, handle, __ATOMIC_RELEASE);
+
+			cacheReplyAttrs(inBuffer, sizeof(uint64), path);
+			free(inBuffer);
+		}
+	}
+
+	pthread_mutex_unlock(&file->lock);
+
+	return err;
+}
+
+HyperVDirtyFile* dirtyFile(struct fuse_file_info* fi)
+{
+	return fi && fi->fh ? ((HyperVFile*)(uintptr_t)fi->fh)->dirty : NULL;
+}
+
+// anything that can change what is allocated forgets the ranges
+void dropRanges(struct fuse_file_info* fi)
+{
+	HyperVFile* file = fi ? (HyperVFile*)(uintptr_t)fi->fh : NULL;
+
+	// writes come through here, most files never had a seek
+	if (!file || !__atomic_load_n(&file->ranges, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	pthread_mutex_lock(&file->lock);
+	freeRanges(file->ranges);
+	file->ranges = NULL;
+	pthread_mutex_unlock(&file->lock);
+}
+
+// sends a buffered file with its data, with the file lock held,
+// a failure is kept and reported again by every flush
+int createDirty(HyperVDirtyFile* file)
+{
+	if (file->created) {
+		return file->err;
+	}
+
+	int err;
+	char* request = opCreateWithData(file->path, file->mode, file->size);
+	struct fuse_buf data = { 0 };
+	data.size = file->size;
+	data.mem = file->data;
+
+	char* compressed = compressRequest(request, &data);
+
+	if (compressed) {
+		data.mem = compressed;
+		data.size = ((HyperVHeader*)request)->dataSize;
+	}
+
+	char* inBuffer = requestOpBuf(
+		request,
+		file->size ? &data : NULL,
+		NULL,
+		&err
+	);
+
+	free(compressed);
+	free(file->data);
+	file->data = NULL;
+	file->created = 1;
+	file->err = err;
+	dropContent(file->path);
+
+	if (err) {
+		return err;
+	}
+
+	cacheReplyAttrs(inBuffer, 0, file->path);
+	free(inBuffer);
+
+	return 0;
+}
+
+// buffers the write while the file stays small, else sends the file
+// so the caller writes through
+int writeDirty(HyperVDirtyFile* file, struct fuse_bufvec* buf, off_t offset, int* err)
+{
+	size_t size = fuse_buf_size(buf);
+	int buffered = 0;
+
+	pthread_mutex_lock(&file->lock);
+
+	if (!file->created && offset + size <= (uint64)options.writeBehind) {
+		if (offset + size > file->capacity) {
+			uint64 capacity = file->capacity ? file->capacity : 4096;
+
+			while (capacity < offset + size) {
+				capacity *= 2;
+			}
+
+			file->data = (char*)realloc(file->data, capacity);
+			file->capacity = capacity;
+		}
+
+		// a write past the end leaves a hole of zeroes
+		if ((uint64)offset > file->size) {
+			memset(file->data + file->size, 0, offset - file->size);
+		}
+
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+		dst.buf[0].mem = file->data + offset;
+		ssize_t copied = fuse_buf_copy(&dst, buf, (enum fuse_buf_copy_flags)0);
+
+		if (copied < 0) {
+			*err = -copied;
+		} else if ((uint64)offset + copied > file->size) {
+			file->size = offset + copied;
+		}
+
+		buffered = 1;
+	} else {
+		*err = createDirty(file);
+	}
+
+	pthread_mutex_unlock(&file->lock);
+
+	return buffered;
+}
+
+HyperVDirtyFile* findDirty(const char* path)
+{
+	for (HyperVDirtyFile* file = dirtyFiles; file; file = file->next) {
+		if (!file->created && strcmp(file->path, path) == 0) {
+			return file;
+		}
+	}
+
+	return NULL;
+}
+
+int samePath(const char* path, const char* other)
+{
+	return strcmp(path, other) == 0;
+}
+
+// an entry of dir itself, not of one of its subdirectories
+int inDir(const char* path, const char* dir)
+{
+	const char* name = strrchr(path, '/');
+
+	if (!strcmp(dir, "/")) {
+		return name == path && path[1];
+	}
+
+	return inTree(path, dir) && name == path + strlen(dir);
+}
+
+// anything else done to a file still buffered needs it on the server first,
+// match picks the files by their path, the list isn't locked while sending
+int createDirtyFiles(const char* path, int (*match)(const char* path, const char* other))
+{
+	int err = 0;
+
+	while (__atomic_load_n(&dirtyFiles, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&dirtyLock);
+		HyperVDirtyFile* file = dirtyFiles;
+
+		for (; file; file = file->next) {
+			if (!file->created && match(file->path, path)) {
+				break;
+			}
+		}
+
+		// removeDirty waits for the file lock, so the file stays around
+		if (file) {
+			pthread_mutex_lock(&file->lock);
+		}
+
+		pthread_mutex_unlock(&dirtyLock);
+
+		if (!file) {
+			break;
+		}
+
+		int fileErr = file->created ? 0 : createDirty(file);
+		pthread_mutex_unlock(&file->lock);
+
+		err = err ? err : fileErr;
+	}
+
+	return err;
+}
+
+int createDirtyPath(const char* path)
+{
+	return createDirtyFiles(path, samePath);
+}
+
+// what getattr answers for a file the server doesn't have yet
+int dirtyAttr(const char* path, HyperVStat* stat)
+{
+	if (!__atomic_load_n(&dirtyFiles, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&dirtyLock);
+	HyperVDirtyFile* file = findDirty(path);
+
+	if (file) {
+		uint32 now = (uint32)time(NULL);
+
+		pthread_mutex_lock(&file->lock);
+		memset(stat, 0, sizeof(HyperVStat));
+		stat->type = 1;
+		stat->mode = S_IFREG | (file->mode & 07777);
+		stat->fileid = file->fileid;
+		stat->nlink = 1;
+		stat->size = file->size;
+		stat->used = file->capacity;
+		stat->atime = now;
+		stat->mtime = now;
+		stat->ctime = now;
+		pthread_mutex_unlock(&file->lock);
+	}
+
+	pthread_mutex_unlock(&dirtyLock);
+
+	return file != NULL;
+}
+
+void addDirty(const char* path, uint32 mode, struct fuse_file_info* fi)
+{
+	HyperVDirtyFile* file = (HyperVDirtyFile*)calloc(1, sizeof(HyperVDirtyFile));
+	file->path = strdup(path);
+	file->mode = mode;
+	file->fileid = __atomic_add_fetch(&dirtyInodes, 1, __ATOMIC_RELAXED);
+	pthread_mutex_init(&file->lock, NULL);
+	dropContent(path);
+
+	pthread_mutex_lock(&dirtyLock);
+	file->next = dirtyFiles;
+	dirtyFiles = file;
+	pthread_mutex_unlock(&dirtyLock);
+
+	fi->fh = (uintptr_t)newFile(file);
+}
+
+void removeDirty(HyperVDirtyFile* file)
+{
+	pthread_mutex_lock(&dirtyLock);
+
+	for (HyperVDirtyFile** next = &dirtyFiles; *next; next = &(*next)->next) {
+		if (*next == file) {
+			*next = file->next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&dirtyLock);
+
+	pthread_mutex_lock(&file->lock);
+	pthread_mutex_unlock(&file->lock);
+
+	pthread_mutex_destroy(&file->lock);
+	free(file->data);
+	free(file->path);
+	free(file);
+}
+
+// a single getattr goes out as it is, more than one as compounds,
+// a few compounds are sent before waiting for any reply
+void readAttrBatch(HyperVAttrWait* batch)
+{
+	while (batch) {
+		int ids[COMPOUND_INFLIGHT];
+		HyperVAttrWait* first[COMPOUND_INFLIGHT + 1];
+		int sent = 0;
+
+		for (; batch && sent < COMPOUND_INFLIGHT; sent++) {
+			char* requests[COMPOUND_MAX];
+			short count = 0;
+			int err;
+
+			first[sent] = batch;
+
+			for (; batch && count < COMPOUND_MAX; batch = batch->next) {
+				requests[count++] = opReadAttr(batch->path);
+			}
+
+			ids[sent] = submitOp(count > 1 ? opCompound(requests, count) : requests[0], NULL, NULL, 0, &err);
+		}
+
+		first[sent] = batch;
+
+		for (int i = 0; i < sent; i++) {
+			HyperVAttrWait* wait = first[i];
+			int err = ENOTCONN;
+			char* inBuffer = ids[i] < 0 ? NULL : finishOp(ids[i], &err);
+			int single = wait->next == first[i + 1];
+
+			// the waiter is gone once posted, so its next is read first
+			for (int index = 0; wait != first[i + 1]; index++) {
+				HyperVAttrWait* next = wait->next;
+				HyperVHeader* reply = !inBuffer ? NULL : single ? (HyperVHeader*)inBuffer : compoundReply(inBuffer, index);
+
+				wait->err = reply ? reply->status : err;
+
+				if (!wait->err) {
+					memcpy(&wait->stat, reply + 1, sizeof(HyperVStat));
+
+					if (S_ISLNK(wait->stat.mode) && reply->size > sizeof(HyperVHeader) + sizeof(HyperVStat)) {
+						cacheLink(wait->path, (char*)(reply + 1) + sizeof(HyperVStat));
+					}
+				}
+
+				sem_post(&wait->done);
+				wait = next;
+			}
+
+			free(inBuffer);
+		}
+	}
+}
+
+int readAttr(const char* path, HyperVStat* stat)
+{
+	HyperVAttrWait wait = { path };
+	int active = __atomic_load_n(&pools[HYPERV_LANE_META].active, __ATOMIC_RELAXED);
+	int senders = 0;
+
+	sem_init(&wait.done, 0, 0);
+
+	do {
+		wait.next = __atomic_load_n(&attrWaits, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&attrWaits, &wait.next, &wait, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	// one sender per metadata connection, the rest queue up behind them
+	// and go out together in the next round
+	while (__atomic_load_n(&attrWaits, __ATOMIC_SEQ_CST)
+		&& (senders = __atomic_load_n(&attrSenders, __ATOMIC_SEQ_CST)) < (active > 1 ? active : 1)
+		&& __atomic_compare_exchange_n(&attrSenders, &senders, senders + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		HyperVAttrWait* batch = __atomic_exchange_n(&attrWaits, NULL, __ATOMIC_ACQ_REL);
+
+		if (batch) {
+			readAttrBatch(batch);
+		}
+
+		__atomic_fetch_sub(&attrSenders, 1, __ATOMIC_SEQ_CST);
+	}
+
+	while (sem_wait(&wait.done) && errno == EINTR);
+
+	sem_destroy(&wait.done);
+
+	if (!wait.err) {
+		*stat = wait.stat;
+	}
+
+	return wait.err;
+}
+
+static void closePipe(void* data)
+{
+	HyperVPipe* pipe = (HyperVPipe*)data;
+
+	close(pipe->fds[0]);
+	close(pipe->fds[1]);
+	free(pipe);
+}
+
+static void createPipeKey()
+{
+	pthread_key_create(&pipeKey, closePipe);
+}
+
+int openPipe(HyperVPipe* pipe)
+{
+	if (pipe2(pipe->fds, O_CLOEXEC)) {
+		return 0;
+	}
+
+	if (pipe->capacity) {
+		fcntl(pipe->fds[0], F_SETPIPE_SZ, pipe->capacity);
+	}
+
+	pipe->capacity = fcntl(pipe->fds[0], F_GETPIPE_SZ);
+
+	return 1;
+}
+
+void resetPipe(HyperVPipe* pipe)
+{
+	close(pipe->fds[0]);
+	close(pipe->fds[1]);
+
+	if (!openPipe(pipe)) {
+		pthread_setspecific(pipeKey, NULL);
+		free(pipe);
+	}
+}
+
+// every fuse thread splices its read replies through its own pipe,
+// fuse drains it into the kernel before the thread takes the next request
+HyperVPipe* threadPipe(uint64 size)
+{
+	pthread_once(&pipeOnce, createPipeKey);
+
+	HyperVPipe* pipe = (HyperVPipe*)pthread_getspecific(pipeKey);
+	int queued = 0;
+
+	if (!pipe) {
+		pipe = (HyperVPipe*)calloc(1, sizeof(HyperVPipe));
+
+		if (!openPipe(pipe)) {
+			free(pipe);
+			return NULL;
+		}
+
+		pthread_setspecific(pipeKey, pipe);
+	}
+
+	// a reply that failed halfway leaves data behind, start over
+	if (ioctl(pipe->fds[0], FIONREAD, &queued) || queued) {
+		resetPipe(pipe);
+		pipe = (HyperVPipe*)pthread_getspecific(pipeKey);
+
+		if (!pipe) {
+			return NULL;
+		}
+	}
+
+	// the pipe grows to the largest read, when pipes that large are allowed
+	if ((uint64)pipe->capacity < size) {
+		int capacity = fcntl(pipe->fds[0], F_SETPIPE_SZ, size);
+
+		if (capacity < 0) {
+			return NULL;
+		}
+
+		pipe->capacity = capacity;
+	}
+
+	return pipe;
+}
+
+static void* xmp_init(struct fuse_conn_info* conn,
+	struct fuse_config* cfg)
+{
+	printf("Function call [init]\n");
+
+	// open gets O_TRUNC instead of a separate truncate
+	if (conn->capable & FUSE_CAP_ATOMIC_O_TRUNC) {
+		conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+	}
+
+	// the bulk stat ioctl is sent to the mount root
+	if (conn->capable & FUSE_CAP_IOCTL_DIR) {
+		conn->want |= FUSE_CAP_IOCTL_DIR;
+	}
+
+#ifdef FUSE_CAP_CACHE_SYMLINKS
+	// readlink is answered once per inode, the kernel keeps the target after that
+	if (conn->capable & FUSE_CAP_CACHE_SYMLINKS) {
+		conn->want |= FUSE_CAP_CACHE_SYMLINKS;
+	}
+#endif
+
+	// read replies are spliced from the socket into the kernel
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+		conn->want |= FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+	}
+
+	// written data has to be in memory to be compressed
+	if ((conn->capable & FUSE_CAP_SPLICE_READ) && !(features & HYPERV_FEATURE_LZ4)) {
+		conn->want |= FUSE_CAP_SPLICE_READ;
+	}
+
+	// reads and writes come in chunks as large as the server takes,
+	// the kernel still caps them at its own page limit
+	if (maxTransfer) {
+		conn->max_write = maxTransfer;
+		conn->max_readahead = maxTransfer;
+	}
+
+	cfg->use_ino = 1;
+	cfg->entry_timeout = 500000;
+	cfg->attr_timeout = 500000;
+	cfg->negative_timeout = 500000;
+
+	return NULL;
+}
+
+static int xmp_getattr(const char* path, struct stat* stbuf,
+	struct fuse_file_info* fi)
+{
+	printf("Function call [getattr] on path %s\n", path);
+
+	(void)fi;
+	HyperVStat cached;
+	HyperVStat* stat = &cached;
+
+	if (!dirtyAttr(path, stat) && !takeAttr(path, stat) && !contentAttr(path, stat)) {
+		int err = readAttr(path, stat);
+
+		if (err) {
+			return -err;
+		}
+	}
+
+	// stbuf->st_dev = stat->fsid;
+	stbuf->st_ino = stat->fileid;
+	stbuf->st_nlink = stat->nlink;
+	stbuf->st_mode = stat->mode;
+	stbuf->st_gid = getgid();
+	stbuf->st_uid = getuid();
+	stbuf->st_size = stat->size;
+	stbuf->st_atim = toTimeSpec(stat->atime);
+	stbuf->st_mtim = toTimeSpec(stat->mtime);
+	stbuf->st_ctim = toTimeSpec(stat->ctime);
+
+	return 0;
+}
+
+static int xmp_access(const char* path, int mask)
+{
+	fprintf(stderr, "UNIMPLEMENTED: Function call [access] on path %s\n", path);
+
+	return 0;
+}
+
+// the kernel looks up a path one component at a time, one walk gets the
+// attributes of all of them, each used up by the lookup it answers
+int walkPath(const char* path)
+{
+	int err;
+
+	char* inBuffer = requestOp(
+		opWalk(path),
+		&err
+	);
+
+	if (err) {
+		return err;
+	}
+
+	short count;
+	uint64 offset = sizeof(HyperVHeader);
+	memcpy(&count, inBuffer + offset, sizeof(short));
+
+	offset += sizeof(short);
+
+	char* component = strdup(path);
+	int length = strlen(path);
+	int end = 1;
+
+	for (short i = 0; i < count && offset + sizeof(HyperVStat) <= ((HyperVHeader*)inBuffer)->size; i++) {
+		char saved = component[end];
+		component[end] = '\0';
+
+		HyperVStat* stat = (HyperVStat*)(inBuffer + offset);
+		offset += sizeof(HyperVStat);
+		cacheAttr(component, stat);
+
+		if (S_ISLNK(stat->mode)) {
+			offset += cacheLink(component, inBuffer + offset);
+		}
+
+		component[end] = saved;
+
+		char* slash = end < length ? strchr(component + end + 1, '/') : NULL;
+		end = slash ? (int)(slash - component) : length;
+	}
+
+	free(component);
+	free(inBuffer);
+
+	return 0;
+}
+
+// a walk only pays off the first time, after that the kernel knows the directories
+int firstWalk(const char* path)
+{
+	char* parent = parentPath(path);
+	int first = strlen(parent) < ATTR_CACHE_PATH;
+
+	if (first) {
+		HyperVWalkedDir* slot = &walkedDirs[pathHash(parent) % ATTR_CACHE_SLOTS];
+		lockSlot(&slot->lock);
+
+		first = strcmp(slot->path, parent) != 0;
+		strcpy(slot->path, parent);
+
+		unlockSlot(&slot->lock);
+	}
+
+	free(parent);
+
+	return first;
+}
+
+static int xmp_readlink(const char* path, char* buf, size_t size)
+{
+	printf("Function call [readlink] on path %s\n", path);
+
+	int err;
+	short ext = 0;
+	char* lPath = findLink(path, &ext);
+
+	// the getattr or readdir before this usually brought the target along
+	if (!lPath) {
+		char* inBuffer = requestOp(
+			opReadlink(path),
+			&err
+		);
+
+		if (err) {
+			return -err;
+		}
+
+		cacheLink(path, inBuffer + sizeof(HyperVHeader));
+		memcpy(&ext, inBuffer + sizeof(HyperVHeader), sizeof(short));
+		lPath = strdup(inBuffer + sizeof(HyperVHeader) + 2 * sizeof(short));
+
+		free(inBuffer);
+	}
+
+	// the kernel follows the link next, from the root down
+	if (!ext && lPath[0] == '/' && firstWalk(lPath)) {
+		walkPath(lPath);
+	}
+
+	// fill the buffer with the path
+	char* linkPath = !ext ? makeLocalPath(mountPath(), lPath) : strdup(lPath);
+	int len = strlen(linkPath) + 1;
+
+	int bufSize = size > len ? len : size;
+	memcpy(buf, linkPath, bufSize);
+	buf[bufSize - 1] = '\0';
+
+	free(linkPath);
+	free(lPath);
+
+	return 0;
+}
+
+static int xmp_opendir(const char* path, struct fuse_file_info* fi)
+{
+	printf("Function call [opendir] on path %s\n", path);
+
+	struct xmp_dirp* d = malloc(sizeof(struct xmp_dirp));
+
+	if (d == NULL) {
+		return -ENOMEM;
+	}
+
+	d->entry = NULL;
+	fi->fh = (uint64)d;
+
+	return 0;
+}
+
+// the size of the link entry after a listed stat
+int linkLength(HyperVStat* stat, char* link)
+{
+	short targetLength;
+
+	if (!S_ISLNK(stat->mode)) {
+		return 0;
+	}
+
+	memcpy(&targetLength, link + sizeof(short), sizeof(short));
+
+	return 2 * sizeof(short) + targetLength;
+}
+
+static int xmp_readdir(const char* path, void* buf, fuse_fill_dir_t filler,
+	off_t offset, struct fuse_file_info* fi,
+	enum fuse_readdir_flags flags)
+{
+	printf("Function call [readdir] on path %s\n", path);
+
+	(void)flags;
+
+	char* inBuffer = NULL;
+	struct xmp_dirp* d = (struct xmp_dirp*)fi->fh;
+
+	// if we have a entry, we don't need to fetch again
+	if (d->entry) {
+		inBuffer = (char*)d->entry;
+		goto fill;
+	}
+
+	// only the files listed here have to be on the server
+	int err = createDirtyFiles(path, inDir);
+
+	if (err) {
+		return -err;
+	}
+
+	inBuffer = requestOp(
+		opReadDir(path),
+		&err
+	);
+
+	if (err) {
+		return -err;
+	}
+
+fill:;
+	int64 dOffset = 1;
+	uint64 readSize = sizeof(HyperVHeader);
+	uint64* size = (uint64*)inBuffer;
+
+	// seek to the correct offset position
+	while (dOffset < offset + 1 && *size > readSize) {
+		short* nLen = (short*)(inBuffer + readSize);
+		readSize += sizeof(short) + *nLen;
+
+		HyperVStat* stat = (HyperVStat*)(inBuffer + readSize);
+		readSize += sizeof(HyperVStat) + linkLength(stat, inBuffer + readSize + sizeof(HyperVStat));
+		dOffset++;
+	}
+
+	while (*size > readSize) {
+		// we also have the name size, but names are NULL terminated
+		short* nameLength = (short*)(inBuffer + readSize);
+		readSize += sizeof(short);
+
+		// read name
+		char* name = (char*)(inBuffer + readSize);
+		readSize += *nameLength;
+
+		// read stat
+		HyperVStat* stat = (HyperVStat*)(inBuffer + readSize);
+		readSize += sizeof(HyperVStat);
+
+		// symlinks are followed by their target, which readlink will want next
+		if (S_ISLNK(stat->mode)) {
+			char* entryPath = joinPath(path, name);
+			readSize += cacheLink(entryPath, inBuffer + readSize);
+			free(entryPath);
+		}
+
+		// convert
+		struct stat st = { 0 };
+		st.st_dev = stat->fsid;
+		st.st_ino = stat->fileid;
+		st.st_nlink = stat->nlink;
+		st.st_mode = stat->mode;
+		st.st_gid = getgid();
+		st.st_uid = getuid();
+		st.st_size = stat->size;
+		st.st_atim = toTimeSpec(stat->atime);
+		st.st_mtim = toTimeSpec(stat->mtime);
+		st.st_ctim = toTimeSpec(stat->ctime);
+
+		if (filler(buf, name, &st, dOffset, FUSE_FILL_DIR_PLUS)) {
+			// buffer is full
+			break;
+		}
+
+		dOffset++;
+	}
+
+	// save the buffer and hope we don't have a memory leak
+	d->entry = (void*)inBuffer;
+
+	return 0;
+}
+
+static int xmp_releasedir(const char* path, struct fuse_file_info* fi)
+{
+	printf("Function call [releasedir] on path %s\n", path);
+
+	(void)path;
+
+	struct xmp_dirp* d = (struct xmp_dirp*)fi->fh;
+
+	if (d->entry) {
+		free(d->entry);
+	}
+
+	free(d);
+	fi->fh = 0;
+
+	return 0;
+}
+
+static int xmp_mknod(const char* path, mode_t mode, dev_t rdev)
+{
+	fprintf(stderr, "UNIMPLEMENTED: Function call [mknod] on path %s\n", path);
+
+	return -ENOSYS;
+}
+
+static int xmp_mkdir(const char* path, mode_t mode)
+{
+	printf("Function call [mkdir] on path %s\n", path);
+
+	return -requestMutation(opMkdir(path, mode), path);
+}
+
+static int xmp_unlink(const char* path)
+{
+	printf("Function call [unlink] on path %s\n", path);
+
+	int err = createDirtyPath(path);
+
+	if (err) {
+		return -err;
+	}
+
+	dropAttr(path);
+	dropLink(path);
+	dropContent(path);
+
+	return -requestMutation(opUnlink(path), path);
+}
+
+static int xmp_rmdir(const char* path)
+{
+	printf("Function call [rmdir] on path %s\n", path);
+
+	// a buffered file in it keeps it from being empty on the host too
+	int err = createDirtyFiles(path, inTree);
+
+	if (err) {
+		return -err;
+	}
+
+	dropTree(path);
+
+	return -requestMutation(opRmdir(path), path);
+}
+
+static int xmp_symlink(const char* from, const char* to)
+{
+	printf("Function call [symlink] on path %s to %s\n", from, to);
+
+	int offset = relativeToMountpoint(mountPath(), from);
+	short ext = offset ? 0 : 1;
+
+	dropLink(to);
+
+	// TODO: maybe send the a flag if from is external if it is a dir
+	return -requestMutation(opSymlink(from + offset, to, ext), to);
+}
+
+static int xmp_rename(const char* from, const char* to, unsigned int flags)
+{
+	printf("Function call [rename] on path %s\n", from);
+
+	// buffered files under a directory have to move with it
+	int err = createDirtyFiles(from, inTree);
+
+	if (err) {
+		return -err;
+	}
+
+	// the reply only has the new side, and a directory takes everything under it along
+	char* parent = parentPath(from);
+	dropAttr(parent);
+	dropTree(from);
+	dropTree(to);
+	free(parent);
+
+	return -requestMutation(opRename(from, to), to);
+}
+
+static int xmp_link(const char* from, const char* to)
+{
+	printf("Function call [link] on path %s to %s\n", from, to);
+
+	int err = createDirtyPath(from);
+
+	if (err) {
+		return -err;
+	}
+
+	return -requestMutation(opLink(from, to), to);
+}
+
+static int xmp_chmod(const char* path, mode_t mode,
+	struct fuse_file_info* fi)
+{
+	fprintf(stderr, "UNIMPLEMENTED: Function call [chmod] on path %s\n", path);
+
+	// nothing reaches the host, the next getattr asks it again
+	dropAttr(path);
+
+	return -ENOSYS;
+}
+
+static int xmp_chown(const char* path, uid_t uid, gid_t gid,
+	struct fuse_file_info* fi)
+{
+	fprintf(stderr, "UNIMPLEMENTED: Function call [chown] on path %s\n", path);
+
+	// nothing reaches the host, the next getattr asks it again
+	dropAttr(path);
+
+	return -ENOSYS;
+}
+
+static int xmp_truncate(const char* path, off_t offset,
+	struct fuse_file_info* fi)
+{
+	printf("Function call [truncate] on path %s\n", path);
+
+	int err = createDirtyPath(path);
+
+	if (err) {
+		return -err;
+	}
+
+	dropRanges(fi);
+	dropContent(path);
+
+	return -requestMutation(opTruncate(path, offset, fileHandle(fi)), path);
+}
+
+static int xmp_create(const char* path, mode_t mode,
+	struct fuse_file_info* fi)
+{
+	printf("Function call [create] on path %s\n", path);
 
-	offset += sizeof(short);
-	memcpy(request + offset, &pathLength, sizeof(short));
+	dropContent(path);
 
-	offset += sizeof(short);
-	memcpy(request + offset, path, pathLength);
+	// small new files are sent with their data once closed
+	if (options.writeBehind > 0) {
+		addDirty(path, mode, fi);
+		return 0;
+	}
 
-	return request;
+	return -openFile(path, fi, fi->flags | O_CREAT, mode);
 }
 
-char* opRename(const char* from, const char* to)
+static int xmp_open(const char* path, struct fuse_file_info* fi)
 {
-	short opCode = HYPERV_RENAME;
-	short fromLength = strlen(from) + 1;
-	short toLength = strlen(to) + 1;
-	uint64 size = sizeof(uint64) + sizeof(short) + sizeof(short) + fromLength + sizeof(short) + toLength;
-	char* request = (char*)malloc(size);
-
-	int offset = 0;
-	memcpy(request + offset, &size, sizeof(uint64));
+	printf("Function call [open] on path %s\n", path);
 
-	offset += sizeof(uint64);
-	memcpy(request + offset, &opCode, sizeof(short));
+	int err = createDirtyPath(path);
 
-	offset += sizeof(short);
-	memcpy(request + offset, &fromLength, sizeof(short));
+	if (err) {
+		return -err;
+	}
 
-	offset += sizeof(short);
-	memcpy(request + offset, from, fromLength);
+	// a prefetched file is read from memory, until something changes it
+	if (!(fi->flags & (O_ACCMODE | O_TRUNC)) && contentAttr(path, NULL)) {
+		HyperVFile* file = newFile(NULL);
+		file->cached = 1;
+		fi->fh = (uintptr_t)file;
+		fi->keep_cache = 1;
 
-	offset += fromLength;
-	memcpy(request + offset, &toLength, sizeof(short));
+		return 0;
+	}
 
-	offset += sizeof(short);
-	memcpy(request + offset, to, toLength);
+	if (fi->flags & (O_ACCMODE | O_TRUNC)) {
+		dropContent(path);
+	}
 
-	return request;
+	return -openFile(path, fi, fi->flags, 0);
 }
 
-char* opSymlink(const char* from, const char* to, short ext)
+// -1 when the file isn't served from the content cache, or left it since the open
+ssize_t cachedRead(const char* path, struct fuse_file_info* fi, char* buf, size_t size, off_t offset)
 {
-	short opCode = HYPERV_SYMLINK;
-	short fromLength = strlen(from) + 1;
-	short toLength = strlen(to) + 1;
-	uint64 size = sizeof(uint64) + sizeof(short) + sizeof(short) + fromLength + sizeof(short) + toLength + sizeof(short);
-	char* request = (char*)malloc(size);
+	HyperVFile* file = fi ? (HyperVFile*)(uintptr_t)fi->fh : NULL;
 
-	int offset = 0;
-	memcpy(request + offset, &size, sizeof(uint64));
-
-	offset += sizeof(uint64);
-	memcpy(request + offset, &opCode, sizeof(short));
+	if (!file || !file->cached) {
+		return -1;
+	}
 
-	offset += sizeof(short);
-	memcpy(request + offset, &fromLength, sizeof(short));
+	return readContent(path, buf, size, offset, NULL);
+}
 
-	offset += sizeof(short);
-	memcpy(request + offset, from, fromLength);
+int stripeCount(size_t size)
+{
+	if (options.stripeSize <= 0 || size < 2 * (size_t)options.stripeSize) {
+		return 1;
+	}
 
-	offset += fromLength;
-	memcpy(request + offset, &toLength, sizeof(short));
+	int count = size / options.stripeSize;
+	int active = __atomic_load_n(&pools[HYPERV_LANE_BULK].active, __ATOMIC_RELAXED);
 
-	offset += sizeof(short);
-	memcpy(request + offset, to, toLength);
+	return count < active ? count : active;
+}
 
-	offset += toLength;
-	memcpy(request + offset, &ext, sizeof(short));
+// what a read or write hands back to fuse, which counts in an int,
+// never more than was asked for
+int fuseResult(uint64 bytes, size_t size)
+{
+	uint64 limit = size < INT_MAX ? size : INT_MAX;
 
-	return request;
+	return bytes < limit ? (int)bytes : (int)limit;
 }
 
-char* opLink(const char* from, const char* to)
+// a large read is split in chunks sent on different bulk connections at once,
+// every chunk is received in place, so buf is in order once all of them are in
+ssize_t readStriped(const char* path, uint64 handle, char* buf, size_t size, off_t offset, int count)
 {
-	short opCode = HYPERV_LINK;
-	short fromLength = strlen(from) + 1;
-	short toLength = strlen(to) + 1;
-	uint64 size = sizeof(uint64) + sizeof(short) + sizeof(short) + fromLength + sizeof(short) + toLength;
-	char* request = (char*)malloc(size);
+	int ids[MAX_SOCKET_NUM];
+	HyperVSink sinks[MAX_SOCKET_NUM];
+	size_t chunk = ((size + count - 1) / count + 4095) & ~(size_t)4095;
+	size_t total = 0;
+	int shortChunk = 0;
+	int err = 0;
+
+	for (int i = 0; i < count; i++) {
+		size_t cOffset = i * chunk;
+		size_t cSize = cOffset < size ? size - cOffset : 0;
+		cSize = cSize < chunk ? cSize : chunk;
+		ids[i] = -1;
+
+		if (!cSize || err) {
+			continue;
+		}
 
-	int offset = 0;
-	memcpy(request + offset, &size, sizeof(uint64));
+		sinks[i] = (HyperVSink){ buf + cOffset, -1, cSize, 0, NULL };
+		ids[i] = submitOp(opRead(path, cSize, offset + cOffset, handle), NULL, &sinks[i], i, &err);
+	}
 
-	offset += sizeof(uint64);
-	memcpy(request + offset, &opCode, sizeof(short));
+	// the data ends at the first chunk that came up short
+	for (int i = 0; i < count; i++) {
+		int cErr = 0;
 
-	offset += sizeof(short);
-	memcpy(request + offset, &fromLength, sizeof(short));
+		if (ids[i] < 0) {
+			continue;
+		}
 
-	offset += sizeof(short);
-	memcpy(request + offset, from, fromLength);
+		char* response = finishOp(ids[i], &cErr);
 
-	offset += fromLength;
-	memcpy(request + offset, &toLength, sizeof(short));
+		if (!response) {
+			err = err ? err : cErr;
+			continue;
+		}
 
-	offset += sizeof(short);
-	memcpy(request + offset, to, toLength);
+		uint64 bytesRead = 0;
+		memcpy(&bytesRead, response + sizeof(HyperVHeader), sizeof(uint64));
+		free(response);
 
-	return request;
+		if (!shortChunk) {
+			total += bytesRead;
+			shortChunk = bytesRead < sinks[i].capacity;
+		}
+	}
+
+	return err ? -err : (ssize_t)total;
 }
 
-char* opReadlink(const char* path)
+static int xmp_read(const char* path, char* buf, size_t size, off_t offset,
+	struct fuse_file_info* fi)
 {
-	short opCode = HYPERV_READLINK;
-	short pathLength = strlen(path) + 1;
-	uint64 size = sizeof(uint64) + sizeof(short) + sizeof(short) + pathLength;
-	char* request = (char*)malloc(size);
+	printf("Function call [read] on path %s\n", path);
 
-	int offset = 0;
-	memcpy(request + offset, &size, sizeof(uint64));
+	int err = createDirtyPath(path);
+	int stripes = stripeCount(size);
 
-	offset += sizeof(uint64);
-	memcpy(request + offset, &opCode, sizeof(short));
+	if (err) {
+		return -err;
+	}
 
-	offset += sizeof(short);
-	memcpy(request + offset, &pathLength, sizeof(short));
+	ssize_t bytesCached = cachedRead(path, fi, buf, size, offset);
 
-	offset += sizeof(short);
-	memcpy(request + offset, path, pathLength);
+	if (bytesCached >= 0) {
+		return fuseResult(bytesCached, size);
+	}
 
-	return request;
-}
+	err = openForRead(path, fi);
 
-char* mountPath()
-{
-	return *((char**)fuse_get_session(fuse_get_context()->fuse));
-}
+	if (err) {
+		return -err;
+	}
 
-char* makeLocalPath(const char* path, const char* name)
-{
-	int len = strlen(name);
-	int size = len == 0 ? 1 : len + 1;
+	if (stripes > 1) {
+		ssize_t bytesRead = readStriped(path, fileHandle(fi), buf, size, offset, stripes);
 
-	char* filePath = (char*)calloc(1, strlen(path) + size);
+		return bytesRead < 0 ? (int)bytesRead : fuseResult(bytesRead, size);
+	}
 
-	strcpy(filePath, path);
+	// the data is received straight into the fuse buffer
+	HyperVSink sink = { buf, -1, size, 0, NULL };
 
-	if (len) {
-		strcat(filePath, name);
+	char* inBuffer = requestOpBuf(
+		opRead(path, size, offset, fileHandle(fi)),
+		NULL,
+		&sink,
+		&err
+	);
+
+	if (err) {
+		return -err;
 	}
 
-	return filePath;
+	uint64 bytesRead = 0;
+	int iOffset = sizeof(HyperVHeader);
+	memcpy(&bytesRead, inBuffer + iOffset, sizeof(uint64));
+
+	free(inBuffer);
+
+	return fuseResult(bytesRead, size);
 }
 
-int relativeToMountpoint(const char* mountpoint, const char* path)
+static int xmp_read_buf(const char* path, struct fuse_bufvec** bufp, size_t size,
+	off_t offset, struct fuse_file_info* fi)
 {
-	int mountLen = strlen(mountpoint);
+	printf("Function call [read_buf] on path %s\n", path);
 
-	// does not start with the mountpoint
-	if (strncmp(mountpoint, path, mountLen) != 0) {
-		return 0;
+	int err = createDirtyPath(path);
+	int stripes = stripeCount(size);
+	HyperVFile* file = fi ? (HyperVFile*)(uintptr_t)fi->fh : NULL;
+
+	if (err) {
+		return -err;
 	}
 
-	const char* start = path + mountLen;
-	const char* end = start;
+	if (file && file->cached) {
+		char* buf = (char*)malloc(size ? size : 1);
+		ssize_t bytesRead = cachedRead(path, fi, buf, size, offset);
 
-	while (*end)
-	{
-		// find next segment
-		while (*end && *end != '/') {
-			++end;
-		}
+		if (bytesRead >= 0) {
+			*bufp = (struct fuse_bufvec*)malloc(sizeof(struct fuse_bufvec));
+			**bufp = FUSE_BUFVEC_INIT(bytesRead);
+			(*bufp)->buf[0].mem = buf;
 
-		// check for . or ..
-		if (end - start == 2 && start[1] == '.') {
 			return 0;
 		}
 
-		if (end - start == 3 && start[1] == '.' && start[2] == '.') {
-			return 0;
-		}
+		free(buf);
+	}
 
-		start = end++;
+	err = openForRead(path, fi);
+
+	if (err) {
+		return -err;
 	}
 
-	return mountLen;
-}
+	// striped chunks come in on different sockets, they can't share a pipe
+	if (stripes > 1) {
+		char* buf = (char*)malloc(size);
+		ssize_t bytesRead = readStriped(path, fileHandle(fi), buf, size, offset, stripes);
 
-int readMessage(int socket, char** buffer)
-{
-	uint64 size = 0;
-	char sizeBuffer[sizeof(uint64)];
+		if (bytesRead < 0) {
+			free(buf);
+			return (int)bytesRead;
+		}
 
-	int ret = recv(socket, sizeBuffer, sizeof(uint64), MSG_WAITALL);
+		*bufp = (struct fuse_bufvec*)malloc(sizeof(struct fuse_bufvec));
+		**bufp = FUSE_BUFVEC_INIT(bytesRead);
+		(*bufp)->buf[0].mem = buf;
 
-	// if we read 0 bytes, connection might be closed, return
-	if (ret <= 0) {
 		return 0;
 	}
 
-	memcpy(&size, sizeBuffer, sizeof(uint64));
+	// splice through the thread pipe when there is one big enough,
+	// else receive into memory that fuse frees once it replied
+	HyperVPipe* pipe = threadPipe(size);
+	HyperVSink sink = { NULL, -1, size, 0, NULL };
 
-	*buffer = (char*)malloc(size);
-	memcpy(*buffer, sizeBuffer, sizeof(uint64));
+	if (pipe) {
+		sink.pipe = pipe->fds[1];
+	} else {
+		sink.data = (char*)malloc(size);
+	}
 
-	uint64 rOffset = sizeof(uint64);
-	uint64 rSize = size - rOffset;
+	char* inBuffer = requestOpBuf(
+		opRead(path, size, offset, fileHandle(fi)),
+		NULL,
+		&sink,
+		&err
+	);
 
-	while (rSize > 0)
-	{
-		ret = recv(socket, *buffer + rOffset, rSize, 0);
+	if (err) {
+		free(sink.data);
+		free(sink.overflow);
 
-		// if we read 0 bytes, connection might be closed, return
-		if (ret <= 0) {
-			free(buffer);
-			return 0;
+		if (pipe && sink.piped) {
+			resetPipe(pipe);
 		}
 
-		rSize -= ret;
-		rOffset += ret;
+		return -err;
 	}
 
-	return size;
-}
+	uint64 bytesRead = 0;
+	int iOffset = sizeof(HyperVHeader);
+	memcpy(&bytesRead, inBuffer + iOffset, sizeof(uint64));
 
-int sendMessage(int socket, char* buffer)
-{
-	uint64* size = (uint64*)buffer;
+	free(inBuffer);
+
+	// room for the piped part and the overflow
+	struct fuse_bufvec* src = (struct fuse_bufvec*)malloc(sizeof(struct fuse_bufvec) + sizeof(struct fuse_buf));
+	*src = FUSE_BUFVEC_INIT(bytesRead);
+
+	if (!pipe) {
+		src->buf[0].mem = sink.data;
+	} else if (sink.piped) {
+		src->buf[0].flags = FUSE_BUF_IS_FD;
+		src->buf[0].fd = pipe->fds[0];
+		src->buf[0].size = sink.piped;
+
+		if (sink.overflow) {
+			src->buf[1] = src->buf[0];
+			src->buf[1].flags = (enum fuse_buf_flags)0;
+			src->buf[1].fd = -1;
+			src->buf[1].mem = sink.overflow;
+			src->buf[1].size = bytesRead - sink.piped;
+			src->count = 2;
+		}
+	} else {
+		src->buf[0].mem = sink.overflow;
+	}
 
-	return send(socket, buffer, *size, 0);
+	*bufp = src;
+
+	return 0;
 }
 
-char* requestOp(char* request, int* err)
+// swaps the bulk data of a request for its compressed form, when the server
+// takes it and that saves enough, the caller frees what is returned
+char* compressRequest(char* request, const struct fuse_buf* data)
 {
-	int socket = aquireSocket();
-	char* response = NULL;
-	*err = 0;
+#if defined LZ4
+	HyperVHeader* header = (HyperVHeader*)request;
 
-	if (!sendMessage(socket, request)) {
-		signalExit(fuse_get_context()->fuse);
-		*err = ENOTCONN;
-		goto out;
+	if (!(features & HYPERV_FEATURE_LZ4) || (data->flags & FUSE_BUF_IS_FD) || header->dataSize < COMPRESS_MIN) {
+		return NULL;
 	}
 
-	if (!readMessage(socket, &response)) {
-		signalExit(fuse_get_context()->fuse);
-		*err = ENOTCONN;
-		goto out;
-	}
+	int rawSize = (int)header->dataSize;
+	int limit = rawSize - rawSize / 16;
+	char* compressed = (char*)malloc(limit);
 
-	short status = *(short*)(response + sizeof(uint64));
+	// it gives up once the output would not fit, then the data goes raw
+	int size = LZ4_compress_default((const char*)data->mem, compressed, rawSize, limit);
+	__atomic_fetch_add(&compressStats.rawBytes, rawSize, __ATOMIC_RELAXED);
 
-	if (status != HYPERV_OK) {
-		free(response);
-		*err = (int)status;
-		goto out;
+	if (size <= 0) {
+		__atomic_fetch_add(&compressStats.wireBytes, rawSize, __ATOMIC_RELAXED);
+		free(compressed);
+		return NULL;
 	}
 
-out:
-	free(request);
-	releaseSocket(socket);
-	return *err ? NULL : response;
-}
+	__atomic_fetch_add(&compressStats.wireBytes, size, __ATOMIC_RELAXED);
 
+	header->flags |= HYPERV_FLAG_COMPRESSED;
+	header->rawSize = rawSize;
+	header->size -= rawSize - size;
+	header->dataSize = size;
 
+	return compressed;
+#else
+	return NULL;
+#endif
+}
 
-static void* xmp_init(struct fuse_conn_info* conn,
-	struct fuse_config* cfg)
+static int xmp_write_buf(const char* path, struct fuse_bufvec* buf,
+	off_t offset, struct fuse_file_info* fi)
 {
-	printf("Function call [init]\n");
-	(void)conn;
+	printf("Function call [write_buf] on path %s\n", path);
 
-	cfg->use_ino = 1;
-	cfg->entry_timeout = 500000;
-	cfg->attr_timeout = 500000;
-	cfg->negative_timeout = 500000;
+	int err = 0;
+	HyperVDirtyFile* file = dirtyFile(fi);
 
-	return NULL;
-}
+	dropContent(path);
 
-static int xmp_getattr(const char* path, struct stat* stbuf,
-	struct fuse_file_info* fi)
-{
-	printf("Function call [getattr] on path %s\n", path);
+	if (file && writeDirty(file, buf, offset, &err)) {
+		return err ? -err : fuseResult(fuse_buf_size(buf), fuse_buf_size(buf));
+	}
 
-	(void)fi;
-	int err;
+	if (err) {
+		return -err;
+	}
 
-	char* inBuffer = requestOp(
-		opReadAttr(path),
+	size_t size = fuse_buf_size(buf);
+	struct fuse_bufvec gathered = FUSE_BUFVEC_INIT(size);
+	struct fuse_buf* data = &buf->buf[0];
+
+	// a single buffer is sent as it is, spliced when it is the fuse pipe,
+	// anything else is gathered into memory first
+	if (buf->count != 1 || buf->idx != 0 || buf->off != 0) {
+		gathered.buf[0].mem = malloc(size);
+
+		ssize_t copied = fuse_buf_copy(&gathered, buf, (enum fuse_buf_copy_flags)0);
+
+		if (copied < 0) {
+			free(gathered.buf[0].mem);
+			return copied;
+		}
+
+		size = copied;
+		gathered.buf[0].size = size;
+		data = &gathered.buf[0];
+	}
+
+	char* request = opWrite(path, size, offset, fileHandle(fi));
+	struct fuse_buf packed = *data;
+	char* compressed = compressRequest(request, data);
+
+	if (compressed) {
+		packed.mem = compressed;
+		packed.size = ((HyperVHeader*)request)->dataSize;
+		data = &packed;
+	}
+
+	char* inBuffer = requestOpBuf(
+		request,
+		data,
+		NULL,
 		&err
 	);
 
+	free(gathered.buf[0].mem);
+	free(compressed);
+
 	if (err) {
 		return -err;
 	}
 
-	HyperVStat* stat = (HyperVStat*)(inBuffer + sizeof(uint64) + sizeof(short));
-
-	// stbuf->st_dev = stat->fsid;
-	stbuf->st_ino = stat->fileid;
-	stbuf->st_nlink = stat->nlink;
-	stbuf->st_mode = stat->mode;
-	stbuf->st_gid = getgid();
-	stbuf->st_uid = getuid();
-	stbuf->st_size = stat->size;
-	stbuf->st_atim = toTimeSpec(stat->atime);
-	stbuf->st_mtim = toTimeSpec(stat->mtime);
-	stbuf->st_ctim = toTimeSpec(stat->ctime);
+	uint64 bytesWritten = 0;
+	int iOffset = sizeof(HyperVHeader);
+	memcpy(&bytesWritten, inBuffer + iOffset, sizeof(uint64));
 
+	cacheReplyAttrs(inBuffer, sizeof(uint64), path);
 	free(inBuffer);
+	dropRanges(fi);
 
-	return 0;
+	return fuseResult(bytesWritten, size);
 }
 
-static int xmp_access(const char* path, int mask)
+static int xmp_write(const char* path, const char* buf, size_t size,
+	off_t offset, struct fuse_file_info* fi)
 {
-	fprintf(stderr, "UNIMPLEMENTED: Function call [access] on path %s\n", path);
+	struct fuse_bufvec data = FUSE_BUFVEC_INIT(size);
+	data.buf[0].mem = (void*)buf;
 
-	return 0;
+	return xmp_write_buf(path, &data, offset, fi);
 }
 
-static int xmp_readlink(const char* path, char* buf, size_t size)
-{
-	printf("Function call [readlink] on path %s\n", path);
+// the host copies the range itself, nothing is read into the vm,
+// one op copies at most COPY_MAX so a bulk worker isn't held too long
+static ssize_t xmp_copy_file_range(const char* from, struct fuse_file_info* fromFi, off_t fromOffset,
+	const char* to, struct fuse_file_info* toFi, off_t toOffset, size_t size, int flags)
+{
+	printf("Function call [copy_file_range] from %s to %s\n", from, to);
+
+	if (flags) {
+		return -EINVAL;
+	}
+
+	// both sides have to exist on the host before it can copy between them
+	int err = createDirtyPath(from);
+
+	if (!err) {
+		err = createDirtyPath(to);
+	}
+
+	if (!err) {
+		err = openForRead(from, fromFi);
+	}
+
+	if (err) {
+		return -err;
+	}
 
-	int err;
+	dropContent(to);
 
 	char* inBuffer = requestOp(
-		opReadlink(path),
+		opCopy(from, fromOffset, fileHandle(fromFi), to, toOffset, fileHandle(toFi), size < COPY_MAX ? size : COPY_MAX),
 		&err
 	);
 
@@ -725,433 +3950,586 @@ static int xmp_readlink(const char* path, char* buf, size_t size)
 		return -err;
 	}
 
-	// fill the buffer with the path
-	int offset = sizeof(uint64) + sizeof(short);
-	short* ext = (short*)(inBuffer + offset);
-
-	offset += sizeof(short) + sizeof(short);
-	char* lPath = (char*)(inBuffer + offset);
-	char* linkPath = !*ext ? makeLocalPath(mountPath(), lPath) : strdup(lPath);
-	int len = strlen(linkPath) + 1;
-
-	int bufSize = size > len ? len : size;
-	memcpy(buf, linkPath, bufSize);
-	buf[bufSize - 1] = '\0';
+	uint64 copied;
+	memcpy(&copied, inBuffer + sizeof(HyperVHeader), sizeof(uint64));
 
-	free(linkPath);
+	cacheReplyAttrs(inBuffer, sizeof(uint64), to);
 	free(inBuffer);
+	dropRanges(toFi);
 
-	return 0;
+	return copied;
 }
 
-static int xmp_opendir(const char* path, struct fuse_file_info* fi)
+// space is reserved or zeroed on the host, so nothing is zero filled through the socket
+static int xmp_fallocate(const char* path, int mode, off_t offset, off_t length,
+	struct fuse_file_info* fi)
 {
-	printf("Function call [opendir] on path %s\n", path);
+	printf("Function call [fallocate] on path %s\n", path);
 
-	struct xmp_dirp* d = malloc(sizeof(struct xmp_dirp));
+	uint32 fMode = 0;
 
-	if (d == NULL) {
-		return -ENOMEM;
+	// collapsing and inserting ranges has no windows equivalent
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+		return -EOPNOTSUPP;
 	}
 
-	d->entry = NULL;
-	fi->fh = (uint64)d;
+	// the kernel only allows a punch together with keep size
+	if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)) {
+		return -EOPNOTSUPP;
+	}
 
-	return 0;
+	// windows gives space past the end back when the handle closes, so
+	// it is only kept while the file has a handle of its own
+	if (mode == FALLOC_FL_KEEP_SIZE && !fileHandle(fi)) {
+		return -EOPNOTSUPP;
+	}
+
+	fMode |= mode & FALLOC_FL_KEEP_SIZE ? HYPERV_FALLOC_KEEP_SIZE : 0;
+	fMode |= mode & FALLOC_FL_PUNCH_HOLE ? HYPERV_FALLOC_PUNCH_HOLE : 0;
+	fMode |= mode & FALLOC_FL_ZERO_RANGE ? HYPERV_FALLOC_ZERO_RANGE : 0;
+
+	int err = createDirtyPath(path);
+
+	if (err) {
+		return -err;
+	}
+
+	dropRanges(fi);
+	dropContent(path);
+
+	return -requestMutation(opFallocate(path, fMode, offset, length, fileHandle(fi)), path);
 }
 
-static int xmp_readdir(const char* path, void* buf, fuse_fill_dir_t filler,
-	off_t offset, struct fuse_file_info* fi,
-	enum fuse_readdir_flags flags)
+// fills count entries from a bulk stat reply, and the caches with them
+void readBulkStat(char* response, char** paths, HyperVBulkEntry* entries, short count)
 {
-	printf("Function call [readdir] on path %s\n", path);
+	uint64 offset = sizeof(HyperVHeader) + sizeof(short);
 
-	(void)flags;
+	for (short i = 0; i < count; i++) {
+		short status;
+		memcpy(&status, response + offset, sizeof(short));
+		offset += sizeof(short);
 
-	char* inBuffer = NULL;
-	struct xmp_dirp* d = (struct xmp_dirp*)fi->fh;
+		entries[i].status = status;
 
-	// if we have a entry, we don't need to fetch again
-	if (d->entry) {
-		inBuffer = (char*)d->entry;
-		goto fill;
-	}
+		if (status) {
+			continue;
+		}
 
-	int err;
+		HyperVStat* stat = (HyperVStat*)(response + offset);
+		offset += sizeof(HyperVStat);
 
-	inBuffer = requestOp(
-		opReadDir(path),
-		&err
-	);
+		entries[i].mode = stat->mode;
+		entries[i].nlink = stat->nlink;
+		entries[i].atime = stat->atime;
+		entries[i].mtime = stat->mtime;
+		entries[i].ctime = stat->ctime;
+		entries[i].ino = stat->fileid;
+		entries[i].size = stat->size;
 
-	if (err) {
-		return -err;
+		cacheAttr(paths[i], stat);
+
+		if (S_ISLNK(stat->mode)) {
+			offset += cacheLink(paths[i], response + offset);
+		}
 	}
+}
 
-fill:;
-	int64 dOffset = 1;
-	uint64 readSize = sizeof(uint64) + sizeof(short);
-	uint64* size = (uint64*)inBuffer;
+// the paths go out in chunks all at once, so the host stats them on several workers
+int bulkStat(HyperVBulkStat* request)
+{
+	if (request->count > BULK_STAT_MAX || request->size > BULK_STAT_BUFFER) {
+		return EINVAL;
+	}
 
-	// seek to the correct offset position
-	while (dOffset < offset + 1 && *size > readSize) {
-		short* nLen = (short*)(inBuffer + readSize);
-		readSize += sizeof(short) + *nLen + sizeof(HyperVStat);
-		dOffset++;
+	char** paths = (char**)malloc((request->count ? request->count : 1) * sizeof(char*));
+	char* next = request->buffer;
+	char* end = request->buffer + request->size;
+
+	for (uint32 i = 0; i < request->count; i++) {
+		char* terminator = memchr(next, '\0', end - next);
+
+		if (!terminator) {
+			free(paths);
+			return EINVAL;
+		}
+
+		paths[i] = next;
+		next = terminator + 1;
 	}
 
-	while (*size > readSize) {
-		// we also have the name size, but names are NULL terminated
-		short* nameLength = (short*)(inBuffer + readSize);
-		readSize += sizeof(short);
+	int chunks = (request->count + BULK_STAT_CHUNK - 1) / BULK_STAT_CHUNK;
+	int ids[BULK_STAT_MAX / BULK_STAT_CHUNK + 1];
+	HyperVBulkEntry* entries = (HyperVBulkEntry*)calloc(request->count ? request->count : 1, sizeof(HyperVBulkEntry));
+	int result = 0;
 
-		// read name
-		char* name = (char*)(inBuffer + readSize);
-		readSize += *nameLength;
+	for (int i = 0; i < chunks; i++) {
+		int first = i * BULK_STAT_CHUNK;
+		short count = request->count - first < BULK_STAT_CHUNK ? request->count - first : BULK_STAT_CHUNK;
+		int err;
 
-		// read stat
-		HyperVStat* stat = (HyperVStat*)(inBuffer + readSize);
-		readSize += sizeof(HyperVStat);
+		ids[i] = submitOp(opBulkStat(paths + first, count), NULL, NULL, 0, &err);
+	}
 
-		// convert
-		struct stat st = { 0 };
-		st.st_dev = stat->fsid;
-		st.st_ino = stat->fileid;
-		st.st_nlink = stat->nlink;
-		st.st_mode = stat->mode;
-		st.st_gid = getgid();
-		st.st_uid = getuid();
-		st.st_size = stat->size;
-		st.st_atim = toTimeSpec(stat->atime);
-		st.st_mtim = toTimeSpec(stat->mtime);
-		st.st_ctim = toTimeSpec(stat->ctime);
+	for (int i = 0; i < chunks; i++) {
+		int first = i * BULK_STAT_CHUNK;
+		short count = request->count - first < BULK_STAT_CHUNK ? request->count - first : BULK_STAT_CHUNK;
+		int err = ENOTCONN;
+		char* inBuffer = ids[i] < 0 ? NULL : finishOp(ids[i], &err);
 
-		if (filler(buf, name, &st, dOffset, FUSE_FILL_DIR_PLUS)) {
-			// buffer is full
-			break;
+		if (!inBuffer) {
+			result = err;
+			continue;
 		}
 
-		dOffset++;
+		readBulkStat(inBuffer, paths + first, entries + first, count);
+		free(inBuffer);
 	}
 
-	// save the buffer and hope we don't have a memory leak
-	d->entry = (void*)inBuffer;
+	// the paths were read from the same buffer
+	if (!result) {
+		memcpy(request->buffer, entries, request->count * sizeof(HyperVBulkEntry));
+	}
 
-	return 0;
+	free(entries);
+	free(paths);
+
+	return result;
 }
 
-static int xmp_releasedir(const char* path, struct fuse_file_info* fi)
+// caches every file in one reply, returns 0 once the cache is full
+int readBulkRead(char* response, HyperVPrefetch* request, char** resume)
 {
-	printf("Function call [releasedir] on path %s\n", path);
+	int offset = sizeof(HyperVHeader);
+	uint32 count = 0;
+	short resumeLength = 0;
+	int room = 1;
 
-	(void)path;
+	memcpy(&count, response + offset, sizeof(uint32));
 
-	struct xmp_dirp* d = (struct xmp_dirp*)fi->fh;
+	offset += sizeof(uint32);
+	memcpy(&resumeLength, response + offset, sizeof(short));
 
-	if (d->entry) {
-		free(d->entry);
-	}
+	offset += sizeof(short);
+	*resume = resumeLength ? strdup(response + offset) : NULL;
 
-	free(d);
-	fi->fh = 0;
+	offset += resumeLength;
 
-	return 0;
-}
+	for (uint32 i = 0; i < count && room; i++) {
+		short pathLength;
+		memcpy(&pathLength, response + offset, sizeof(short));
 
-static int xmp_mknod(const char* path, mode_t mode, dev_t rdev)
-{
-	fprintf(stderr, "UNIMPLEMENTED: Function call [mknod] on path %s\n", path);
+		offset += sizeof(short);
+		char* path = response + offset;
 
-	return -ENOSYS;
-}
+		offset += pathLength;
+		HyperVStat* stat = (HyperVStat*)(response + offset);
 
-static int xmp_mkdir(const char* path, mode_t mode)
-{
-	printf("Function call [mkdir] on path %s\n", path);
+		offset += sizeof(HyperVStat);
+		uint64 length;
+		memcpy(&length, response + offset, sizeof(uint64));
 
-	int err;
+		offset += sizeof(uint64);
+		char* data = (char*)malloc(length ? length : 1);
+		memcpy(data, response + offset, length);
 
-	char* inBuffer = requestOp(
-		opMkdir(path, mode),
-		&err
-	);
+		offset += length;
 
-	if (err) {
-		return -err;
-	}
+		// the size it was read at, in case it changed in between
+		stat->size = length;
 
-	free(inBuffer);
+		if (!cacheContent(path, stat, data, length)) {
+			free(data);
+			room = 0;
+			continue;
+		}
 
-	return 0;
+		request->files++;
+		request->bytes += length;
+	}
+
+	return room;
 }
 
-static int xmp_unlink(const char* path)
+// the host walks the paths and sends back whole files, a reply at a time,
+// until it has nothing left or the cache is full
+int prefetch(HyperVPrefetch* request)
 {
-	printf("Function call [unlink] on path %s\n", path);
+	if (request->size > PREFETCH_BUFFER || request->count > PREFETCH_BUFFER) {
+		return EINVAL;
+	}
 
-	int err;
+	char** paths = (char**)malloc((request->count ? request->count : 1) * sizeof(char*));
+	char* next = request->buffer;
+	char* end = request->buffer + request->size;
 
-	char* inBuffer = requestOp(
-		opUnlink(path),
-		&err
-	);
+	for (uint32 i = 0; i < request->count; i++) {
+		char* terminator = memchr(next, '\0', end - next);
 
-	if (err) {
-		return -err;
+		if (!terminator) {
+			free(paths);
+			return EINVAL;
+		}
+
+		paths[i] = next;
+		next = terminator + 1;
 	}
 
-	free(inBuffer);
+	uint64 transfer = maxTransfer ? maxTransfer : MAX_TRANSFER;
+	uint64 maxFile = request->maxFileSize ? request->maxFileSize : PREFETCH_FILE_MAX;
+	char* resume = NULL;
+	int room = 1;
+	int err = 0;
 
-	return 0;
-}
+	maxFile = maxFile < transfer ? maxFile : transfer;
+	request->files = 0;
+	request->bytes = 0;
 
-static int xmp_rmdir(const char* path)
-{
-	printf("Function call [rmdir] on path %s\n", path);
+	do {
+		uint64 cached = __atomic_load_n(&contentBytes, __ATOMIC_RELAXED);
+		uint64 left = cached < (uint64)options.contentCache ? options.contentCache - cached : 0;
 
-	int err;
+		if (!left) {
+			break;
+		}
 
-	char* inBuffer = requestOp(
-		opRmdir(path),
-		&err
-	);
+		char* inBuffer = requestOp(
+			opBulkRead(paths, request->count, maxFile, left < BULK_READ_MAX ? left : BULK_READ_MAX, resume),
+			&err
+		);
 
-	if (err) {
-		return -err;
-	}
+		free(resume);
+		resume = NULL;
 
-	free(inBuffer);
+		if (err) {
+			break;
+		}
 
-	return 0;
+		room = readBulkRead(inBuffer, request, &resume);
+		free(inBuffer);
+	} while (resume && room);
+
+	free(resume);
+	free(paths);
+
+	return err;
 }
 
-static int xmp_symlink(const char* from, const char* to)
+int treePath(const char* path)
 {
-	printf("Function call [symlink] on path %s to %s\n", from, to);
+	return path[0] == '/' && memchr(path, '\0', TREE_PATH_MAX) != NULL;
+}
 
-	int offset = relativeToMountpoint(mountPath(), from);
-	short ext = offset ? 0 : 1;
+// the kernel forgets the tree in one go, its entries are looked up again
+void invalidateTree(const char* path)
+{
+	dropTree(path);
+	fuse_invalidate_path(fuse_get_context()->fuse, path);
+}
 
-	int err;
+// a step of removing a tree on the host, files still buffered under it go out
+// first, so none of them shows up again once they are closed
+int removeTree(HyperVTreeStep* step)
+{
+	if (!treePath(step->from)) {
+		return EINVAL;
+	}
+
+	int err = createDirtyFiles(step->from, inTree);
+
+	if (err) {
+		return err;
+	}
 
 	char* inBuffer = requestOp(
-		// TODO: maybe send the a flag if from is external if it is a dir
-		opSymlink(from + offset, to, ext),
+		opRmTree(step->from),
 		&err
 	);
 
+	invalidateTree(step->from);
+
 	if (err) {
-		return -err;
+		return err;
 	}
 
+	int offset = sizeof(HyperVHeader);
+	short done = 0;
+
+	memcpy(&step->files, inBuffer + offset, sizeof(uint32));
+
+	offset += sizeof(uint32);
+	memcpy(&step->dirs, inBuffer + offset, sizeof(uint32));
+
+	offset += sizeof(uint32);
+	memcpy(&done, inBuffer + offset, sizeof(short));
+
+	step->bytes = 0;
+	step->done = done;
+
+	cacheReplyAttrs(inBuffer, offset + sizeof(short) - sizeof(HyperVHeader), step->from);
 	free(inBuffer);
 
 	return 0;
 }
 
-static int xmp_rename(const char* from, const char* to, unsigned int flags)
+// a step of copying a tree on the host, it picks up where the last one stopped
+int copyTree(HyperVTreeStep* step)
 {
-	printf("Function call [rename] on path %s\n", from);
+	if (!treePath(step->from) || !treePath(step->to) || !memchr(step->resume, '\0', TREE_PATH_MAX)) {
+		return EINVAL;
+	}
 
-	int err;
+	int err = createDirtyFiles(step->from, inTree);
+
+	if (err) {
+		return err;
+	}
 
 	char* inBuffer = requestOp(
-		opRename(from, to),
+		opCopyTree(step->from, step->to, step->resume),
 		&err
 	);
 
+	invalidateTree(step->to);
+
 	if (err) {
-		return -err;
+		return err;
 	}
 
-	free(inBuffer);
+	int offset = sizeof(HyperVHeader);
+	short resumeLength = 0;
 
-	return 0;
-}
+	memcpy(&step->files, inBuffer + offset, sizeof(uint32));
 
-static int xmp_link(const char* from, const char* to)
-{
-	printf("Function call [link] on path %s to %s\n", from, to);
+	offset += sizeof(uint32);
+	memcpy(&step->dirs, inBuffer + offset, sizeof(uint32));
 
-	int err;
+	offset += sizeof(uint32);
+	memcpy(&step->bytes, inBuffer + offset, sizeof(uint64));
 
-	char* inBuffer = requestOp(
-		opLink(from, to),
-		&err
-	);
+	offset += sizeof(uint64);
+	memcpy(&resumeLength, inBuffer + offset, sizeof(short));
 
-	if (err) {
-		return -err;
+	offset += sizeof(short);
+	step->resume[0] = '\0';
+
+	if (resumeLength && resumeLength <= TREE_PATH_MAX) {
+		memcpy(step->resume, inBuffer + offset, resumeLength);
 	}
 
+	offset += resumeLength;
+	step->done = !step->resume[0];
+
+	cacheReplyAttrs(inBuffer, offset - sizeof(HyperVHeader), step->to);
 	free(inBuffer);
 
 	return 0;
 }
 
-static int xmp_chmod(const char* path, mode_t mode,
-	struct fuse_file_info* fi)
+static int xmp_ioctl(const char* path, unsigned int cmd, void* arg,
+	struct fuse_file_info* fi, unsigned int flags, void* data)
 {
-	fprintf(stderr, "UNIMPLEMENTED: Function call [chmod] on path %s\n", path);
+	printf("Function call [ioctl] on path %s\n", path);
 
-	return -ENOSYS;
+	(void)arg;
+	(void)fi;
+
+	if (flags & FUSE_IOCTL_COMPAT) {
+		return -ENOSYS;
+	}
+
+	switch (cmd)
+	{
+	case HYPERVFS_IOC_BULK_STAT:
+		return -bulkStat((HyperVBulkStat*)data);
+	case HYPERVFS_IOC_PREFETCH:
+		return -prefetch((HyperVPrefetch*)data);
+	case HYPERVFS_IOC_RMTREE:
+		return -removeTree((HyperVTreeStep*)data);
+	case HYPERVFS_IOC_COPYTREE:
+		return -copyTree((HyperVTreeStep*)data);
+	default:
+		return -ENOTTY;
+	}
 }
 
-static int xmp_chown(const char* path, uid_t uid, gid_t gid,
-	struct fuse_file_info* fi)
+static int xmp_statfs(const char* path, struct statvfs* stbuf)
 {
-	fprintf(stderr, "UNIMPLEMENTED: Function call [chown] on path %s\n", path);
+	fprintf(stderr, "UNIMPLEMENTED: Function call [statfs] on path %s\n", path);
 
 	return -ENOSYS;
 }
 
-static int xmp_truncate(const char* path, off_t offset,
-	struct fuse_file_info* fi)
+// a buffered file goes out here, so close sees its errors
+int flushDirty(struct fuse_file_info* fi)
 {
-	printf("Function call [truncate] on path %s\n", path);
-
-	(void)fi;
-	int err;
-
-	char* inBuffer = requestOp(
-		opTruncate(path, offset),
-		&err
-	);
+	HyperVDirtyFile* file = dirtyFile(fi);
+	int err = 0;
 
-	if (err) {
-		return -err;
+	if (file) {
+		pthread_mutex_lock(&file->lock);
+		err = createDirty(file);
+		pthread_mutex_unlock(&file->lock);
 	}
 
-	free(inBuffer);
+	return err;
+}
 
-	return 0;
+static int xmp_flush(const char* path, struct fuse_file_info* fi)
+{
+	printf("Function call [flush] on path %s\n", path);
+
+	return -flushDirty(fi);
 }
 
-static int xmp_create(const char* path, mode_t mode,
-	struct fuse_file_info* fi)
+static int xmp_release(const char* path, struct fuse_file_info* fi)
 {
-	printf("Function call [create] on path %s\n", path);
+	printf("Function call [release] on path %s\n", path);
+	(void)path;
 
-	(void)fi;
-	int err;
+	HyperVFile* file = (HyperVFile*)(uintptr_t)fi->fh;
+
+	if (!file) {
+		return 0;
+	}
 
-	char* inBuffer = requestOp(
-		opCreate(path, mode),
-		&err
-	);
+	// flush sent it already, unless the file was never closed
+	if (file->dirty) {
+		pthread_mutex_lock(&file->dirty->lock);
+		createDirty(file->dirty);
+		pthread_mutex_unlock(&file->dirty->lock);
 
-	if (err) {
-		return -err;
+		removeDirty(file->dirty);
 	}
 
-	free(inBuffer);
+	if (file->handle) {
+		int err;
+		free(requestOp(opRelease(file->handle), &err));
+	}
+
+	freeFile(file);
+	fi->fh = 0;
 
 	return 0;
 }
 
-static int xmp_open(const char* path, struct fuse_file_info* fi)
+static int xmp_fsync(const char* path, int isdatasync,
+	struct fuse_file_info* fi)
 {
-	printf("Function call [open] on path %s\n", path);
+	printf("Function call [fsync] on path %s\n", path);
+	/* Just a stub.	 This method is optional and can safely be left
+	   unimplemented */
 
-	(void)fi;
+	(void)path;
+	(void)isdatasync;
 
-	return 0;
+	return -flushDirty(fi);
 }
 
-static int xmp_read(const char* path, char* buf, size_t size, off_t offset,
-	struct fuse_file_info* fi)
+// asks the host for the allocated ranges, with the file lock held
+int fetchRanges(const char* path, struct fuse_file_info* fi, HyperVFile* file)
 {
-	printf("Function call [read] on path %s\n", path);
-
-	(void)fi;
 	int err;
 
+	if (file->ranges && monotonicNs() - file->ranges->fetched < RANGES_CACHE_NS) {
+		return 0;
+	}
+
 	char* inBuffer = requestOp(
-		opRead(path, size, offset),
+		opQueryRanges(path, fileHandle(fi)),
 		&err
 	);
 
 	if (err) {
-		return -err;
+		return err;
 	}
 
-	uint64 bytesRead = 0;
-	int iOffset = sizeof(uint64) + sizeof(short);
-	memcpy(&bytesRead, inBuffer + iOffset, sizeof(uint64));
+	HyperVRanges* ranges = (HyperVRanges*)calloc(1, sizeof(HyperVRanges));
+	int offset = sizeof(HyperVHeader);
+	memcpy(&ranges->size, inBuffer + offset, sizeof(int64));
+
+	offset += sizeof(int64);
+	memcpy(&ranges->count, inBuffer + offset, sizeof(uint32));
 
-	iOffset += sizeof(uint64);
-	memcpy(buf, inBuffer + iOffset, bytesRead);
+	offset += sizeof(uint32);
+	ranges->list = (HyperVRange*)malloc((ranges->count ? ranges->count : 1) * sizeof(HyperVRange));
+	memcpy(ranges->list, inBuffer + offset, ranges->count * sizeof(HyperVRange));
+	ranges->fetched = monotonicNs();
 
 	free(inBuffer);
 
-	return bytesRead;
+	freeRanges(file->ranges);
+	file->ranges = ranges;
+
+	return 0;
 }
 
-static int xmp_write(const char* path, const char* buf, size_t size,
-	off_t offset, struct fuse_file_info* fi)
+off_t seekRanges(HyperVRanges* ranges, off_t off, int whence)
 {
-	printf("Function call [write] on path %s\n", path);
+	if (off < 0 || off >= ranges->size) {
+		return -ENXIO;
+	}
 
-	(void)fi;
-	int err;
+	if (whence == SEEK_DATA) {
+		for (uint32 i = 0; i < ranges->count; i++) {
+			HyperVRange* range = &ranges->list[i];
 
-	char* inBuffer = requestOp(
-		opWrite(path, size, offset, buf),
-		&err
-	);
+			if (range->offset + range->length > off) {
+				return range->offset > off ? range->offset : off;
+			}
+		}
 
-	if (err) {
-		return -err;
+		return -ENXIO;
 	}
 
-	uint64 bytesWritten = 0;
-	int iOffset = sizeof(uint64) + sizeof(short);
-	memcpy(&bytesWritten, inBuffer + iOffset, sizeof(uint64));
+	// ranges can touch, the hole starts where they stop, or at the end of the file
+	off_t hole = off;
 
-	free(inBuffer);
+	for (uint32 i = 0; i < ranges->count && ranges->list[i].offset <= hole; i++) {
+		off_t end = ranges->list[i].offset + ranges->list[i].length;
+		hole = end > hole ? end : hole;
+	}
 
-	return bytesWritten;
+	return hole < ranges->size ? hole : ranges->size;
 }
 
-static int xmp_statfs(const char* path, struct statvfs* stbuf)
+// the kernel handles the other whences itself, holes are found
+// locally in the ranges, so only their data is read
+static off_t xmp_lseek(const char* path, off_t off, int whence, struct fuse_file_info* fi)
 {
-	fprintf(stderr, "UNIMPLEMENTED: Function call [statfs] on path %s\n", path);
+	printf("Function call [lseek] on path %s\n", path);
 
-	return -ENOSYS;
-}
+	HyperVFile* file = fi ? (HyperVFile*)(uintptr_t)fi->fh : NULL;
 
-static int xmp_release(const char* path, struct fuse_file_info* fi)
-{
-	printf("Function call [release] on path %s\n", path);
-	(void)path;
-	(void)fi;
-	return 0;
-}
+	if (!file) {
+		return -EBADF;
+	}
 
-static int xmp_fsync(const char* path, int isdatasync,
-	struct fuse_file_info* fi)
-{
-	printf("Function call [fsync] on path %s\n", path);
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+	if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+		return -EINVAL;
+	}
 
-	(void)path;
-	(void)isdatasync;
-	(void)fi;
-	return 0;
-}
+	int err = flushDirty(fi);
 
-static off_t xmp_lseek(const char* path, off_t off, int whence, struct fuse_file_info* fi)
-{
-	fprintf(stderr, "UNIMPLEMENTED: Function call [lseek] on path %s\n", path);
+	if (err) {
+		return -err;
+	}
 
-	return -ENOSYS;
+	pthread_mutex_lock(&file->lock);
+	err = fetchRanges(path, fi, file);
+	off_t position = err ? -err : seekRanges(file->ranges, off, whence);
+	pthread_mutex_unlock(&file->lock);
+
+	return position;
 }
 
 static int xmp_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi)
 {
     fprintf(stderr, "UNIMPLEMENTED: Function call [utimens] on path %s\n", path);
 
+	// the times are whatever the host has, not what was asked for
+	dropAttr(path);
+
 	return 0;
 }
 
@@ -1177,55 +4555,403 @@ static const struct fuse_operations xmp_oper = {
 	.create = xmp_create,
 	.read = xmp_read,
 	.write = xmp_write,
+	.read_buf = xmp_read_buf,
+	.write_buf = xmp_write_buf,
+	.copy_file_range = xmp_copy_file_range,
+	.fallocate = xmp_fallocate,
+	.ioctl = xmp_ioctl,
 	.statfs = xmp_statfs,
+	.flush = xmp_flush,
 	.release = xmp_release,
 	.fsync = xmp_fsync,
 	.lseek = xmp_lseek,
 	.utimens = xmp_utimens,
 };
 
-void opConnect()
+int connectTo(int family, struct sockaddr* addr, socklen_t addrSize)
+{
+	int sock = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (sock < 0) {
+		return -1;
+	}
+
+	if (connect(sock, addr, addrSize) != 0) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+int connectVsock(unsigned int cid)
 {
-#if defined VMNET
-	int family = AF_INET;
-	struct sockaddr_in addr = { 0 };
-	addr.sin_family = family;
-	inet_pton(family, "192.168.0.100", &addr.sin_addr);
-	addr.sin_port = htons(PORT_NUM);
-#else
-	int family = AF_VSOCK;
 	struct sockaddr_vm addr = { 0 };
 	addr.svm_family = AF_VSOCK;
-	addr.svm_port = PORT_NUM;
-	addr.svm_cid = VMADDR_CID_HOST;
-#endif
+	addr.svm_port = options.port;
+	addr.svm_cid = cid;
+
+	return connectTo(AF_VSOCK, (struct sockaddr*)&addr, sizeof addr);
+}
+
+int connectHost()
+{
+	return connectVsock(VMADDR_CID_HOST);
+}
+
+// a server on this machine, no hypervisor in between
+int connectLocal()
+{
+	return connectVsock(VMADDR_CID_LOCAL);
+}
+
+int connectTcp()
+{
+	struct addrinfo hints = { 0 };
+	struct addrinfo* found = NULL;
+	char port[16];
+	int sock = -1;
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(port, sizeof port, "%d", options.port);
+
+	if (getaddrinfo(options.host, port, &hints, &found) != 0) {
+		return -1;
+	}
+
+	for (struct addrinfo* ai = found; ai && sock < 0; ai = ai->ai_next) {
+		sock = connectTo(ai->ai_family, ai->ai_addr, ai->ai_addrlen);
+	}
+
+	freeaddrinfo(found);
+
+	// small requests must not wait for the next send
+	if (sock >= 0) {
+		int noDelay = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof noDelay);
+	}
+
+	// let the kernel spin on the device queue in recv, going over
+	// the net.core.busy_read default needs CAP_NET_ADMIN
+	if (sock >= 0 && options.busyPoll > 0
+		&& setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &options.busyPoll, sizeof options.busyPoll)) {
+		fprintf(stderr, "warning: SO_BUSY_POLL failed with %s, polling in user space\n", strerror(errno));
+	}
+
+	return sock;
+}
+
+int connectUnix()
+{
+	struct sockaddr_un addr = { 0 };
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, options.socketPath, sizeof addr.sun_path - 1);
+
+	return connectTo(AF_UNIX, (struct sockaddr*)&addr, sizeof addr);
+}
+
+static const HyperVTransport transports[] = {
+	{ "vsock", connectHost },
+	{ "vsock_local", connectLocal },
+	{ "tcp", connectTcp },
+	{ "unix", connectUnix },
+};
+
+const HyperVTransport* findTransport(const char* name)
+{
+	for (size_t i = 0; i < sizeof transports / sizeof transports[0]; i++) {
+		if (strcmp(transports[i].name, name) == 0) {
+			return &transports[i];
+		}
+	}
+
+	return NULL;
+}
+
+int connectSocket()
+{
+	return transport->connect();
+}
+
+int sayHello(int socket, short role, short lane, short connections)
+{
+	char* request = opHello(role, lane, connections, options.maxTransfer, options.compress ? HYPERV_FEATURES : 0);
+	char* response = NULL;
+	short granted = 0;
+
+	HyperVInput* input = openInput(socket, 0);
+
+	// the reply readers are not running yet, so this one is synchronous,
+	// and nothing else arrives until the next request
+	if (sendMessage(socket, request) > 0 && readMessage(input, &response)) {
+		if (((HyperVHeader*)response)->status == HYPERV_OK) {
+			memcpy(&granted, response + sizeof(HyperVHeader), sizeof(short));
+
+			// every connection agrees on the same transfer size
+			memcpy(&maxTransfer, response + sizeof(HyperVHeader) + sizeof(short), sizeof(uint32));
+			memcpy(&features, response + sizeof(HyperVHeader) + sizeof(short) + sizeof(uint32), sizeof(uint32));
+		}
+
+		free(response);
+	}
+
+	free(input);
+	free(request);
+
+	return granted;
+}
+
+int openConnection(HyperVPool* pool, int index, short wanted)
+{
+	HyperVConnection* conn = &pool->connections[index];
+	int sock = connectSocket();
+
+	if (sock < 0) {
+		return 0;
+	}
+
+	int granted = sayHello(sock, HYPERV_ROLE_DATA, pool->lane, wanted);
+
+	if (!granted) {
+		close(sock);
+		return 0;
+	}
+
+	conn->socket = sock;
+	conn->lane = pool->lane;
+	conn->busy = 0;
+	conn->users = 0;
+	conn->retired = 0;
+	conn->draining = 0;
+	sem_init(&conn->drained, 0, 0);
+	conn->frames = NULL;
+	pthread_create(&conn->reader, NULL, readReplies, (void*)conn);
+
+	return granted;
+}
+
+void retireConnection(HyperVPool* pool, int index)
+{
+	HyperVConnection* conn = &pool->connections[index];
+
+	// take it out of the pool, and wait for whoever picked it before that,
+	// putSocket and releaseSocket post once it's draining
+	__atomic_store_n(&conn->draining, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&pool->active, index, __ATOMIC_SEQ_CST);
+
+	for (int spins = 0; __atomic_load_n(&conn->users, __ATOMIC_SEQ_CST); spins++) {
+		if (spins < WAIT_SPINS) {
+			sched_yield();
+		} else {
+			sem_wait(&conn->drained);
+		}
+	}
+
+	for (int spins = 0; !trySocket(conn); spins++) {
+		if (spins < WAIT_SPINS) {
+			sched_yield();
+		} else {
+			sem_wait(&conn->drained);
+		}
+	}
+
+	// a holder may have let go before it could send the last frames
+	flushFrames(pool, conn);
+
+	// the server answers what is in flight, then closes the socket
+	__atomic_store_n(&conn->retired, 1, __ATOMIC_RELEASE);
+	shutdown(conn->socket, SHUT_WR);
+	pthread_join(conn->reader, NULL);
+
+	printf("Connection pool %d shrank to %d\n", pool->lane, index);
+}
+
+void adjustPool(HyperVPool* pool)
+{
+	uint64 count = __atomic_exchange_n(&pool->aquireCount, 0, __ATOMIC_RELAXED);
+	uint64 waitNs = __atomic_exchange_n(&pool->aquireWaitNs, 0, __ATOMIC_RELAXED);
+	int active = pool->active;
+
+	pool->idleSeconds = waitNs ? 0 : pool->idleSeconds + 1;
+
+	// requests queue up for a socket, add one
+	if (count && waitNs / count > GROW_WAIT_NS && active < pool->max) {
+		if (openConnection(pool, active, active + 1)) {
+			__atomic_store_n(&pool->active, active + 1, __ATOMIC_RELEASE);
+			printf("Connection pool %d grew to %d\n", pool->lane, active + 1);
+		}
+
+		return;
+	}
+
+	// nobody waited for a while, give one back
+	if (pool->idleSeconds >= SHRINK_IDLE_SECONDS && active > 1) {
+		retireConnection(pool, active - 1);
+		pool->idleSeconds = 0;
+	}
+}
+
+static void* adjustConnections(void* data)
+{
+	(void)data;
+
+	pthread_mutex_lock(&monitorLock);
+
+	while (!unmounting) {
+		struct timespec wake;
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_sec += 1;
+
+		pthread_cond_timedwait(&monitorCond, &monitorLock, &wake);
+
+		if (unmounting) {
+			break;
+		}
+
+		for (int lane = 0; lane < LANE_NUM; lane++) {
+			adjustPool(&pools[lane]);
+		}
+	}
+
+	pthread_mutex_unlock(&monitorLock);
+
+	return NULL;
+}
+
+int openPool(HyperVPool* pool, short lane, int wanted)
+{
+	pool->lane = lane;
+
+	// the server tells us how many data connections it allows
+	pool->max = openConnection(pool, 0, wanted);
+
+	if (!pool->max) {
+		return 0;
+	}
+
+	if (pool->max > options.maxConnections) {
+		pool->max = options.maxConnections;
+	}
+
+	if (pool->max > MAX_SOCKET_NUM) {
+		pool->max = MAX_SOCKET_NUM;
+	}
+
+	if (wanted > pool->max) {
+		wanted = pool->max;
+	}
+
+	pool->active = 1;
+
+	for (int i = 1; i < wanted && openConnection(pool, i, wanted); i++) {
+		pool->active = i + 1;
+	}
+
+	printf("Connection pool %d opened %d of at most %d connections\n", lane, pool->active, pool->max);
+
+	return 1;
+}
+
+void closePool(HyperVPool* pool)
+{
+	// close sockets, this also stops the reply readers
+	for (int i = 0; i < pool->active; i++) {
+		shutdown(pool->connections[i].socket, SHUT_RDWR);
+		pthread_join(pool->connections[i].reader, NULL);
+		close(pool->connections[i].socket);
+	}
+}
 
-	for (int i = 0; i < SOCKET_NUM; i++) {
-		sSockets[i] = socket(family, SOCK_STREAM, 0);
-		connect(sSockets[i], (struct sockaddr*)&addr, sizeof addr);
-		enqueue(&queue, sSockets[i]);
+int opConnect()
+{
+	initPending();
+	connected = 1;
+
+	// random, so mounts from different guests never share a session
+	int random = open("/dev/urandom", O_RDONLY);
+
+	if (random < 0 || read(random, &sessionId, sizeof(uint64)) != sizeof(uint64)) {
+		sessionId = monotonicNs() ^ (uint64)getpid() << 32;
+	}
+
+	if (random >= 0) {
+		close(random);
+	}
+
+	if (!openPool(&pools[HYPERV_LANE_META], HYPERV_LANE_META, options.metaConnections)
+		|| !openPool(&pools[HYPERV_LANE_BULK], HYPERV_LANE_BULK, options.connections)) {
+		fprintf(stderr, "error: could not connect to the server\n");
+		return 0;
 	}
 
 	// one more socket for change detection
-	changeSocket = socket(family, SOCK_STREAM, 0);
-	connect(changeSocket, (struct sockaddr*)&addr, sizeof addr);
+	changeSocket = connectSocket();
+
+	if (changeSocket < 0 || !sayHello(changeSocket, HYPERV_ROLE_CHANGE, 0, 1)) {
+		fprintf(stderr, "error: could not open the change socket\n");
+	}
+
 	pthread_mutex_unlock(&changeSocketLock);
+
+	pthread_create(&monitor, NULL, adjustConnections, NULL);
+
+	return 1;
 }
 
 void opDisconnect()
 {
-	pthread_cond_destroy(&sSocketCond);
-	pthread_mutex_destroy(&sSocketLock);
+	// stop resizing the pools first
+	pthread_mutex_lock(&monitorLock);
+	unmounting = 1;
+	pthread_cond_signal(&monitorCond);
+	pthread_mutex_unlock(&monitorLock);
+	pthread_join(monitor, NULL);
+
 	pthread_mutex_destroy(&changeSocketLock);
 
-	// close sockets
-	for (int i = 0; i < SOCKET_NUM; i++) {
-		close(sSockets[i]);
+	for (int lane = 0; lane < LANE_NUM; lane++) {
+		closePool(&pools[lane]);
 	}
 
 	close(changeSocket);
+
+	if (options.busyPoll > 0) {
+		printf("Busy poll: %llu of %llu waits and %llu of %llu reads caught a reply spinning\n",
+			(unsigned long long)busyStats.waitHits, (unsigned long long)(busyStats.waitHits + busyStats.waitMisses),
+			(unsigned long long)busyStats.recvHits, (unsigned long long)(busyStats.recvHits + busyStats.recvMisses));
+	}
+
+	if (compressStats.rawBytes) {
+		printf("Compressed %llu bytes to %llu (%.1f%%)\n",
+			(unsigned long long)compressStats.rawBytes, (unsigned long long)compressStats.wireBytes,
+			100.0 * compressStats.wireBytes / compressStats.rawBytes);
+	}
+
+	if (contentFiles) {
+		printf("Content cache: %u files, %llu bytes\n", contentFiles, (unsigned long long)contentBytes);
+	}
 }
 
+#define HYPERV_OPT(t, p) { t, offsetof(HyperVOptions, p), 1 }
+
+static const struct fuse_opt hypervOpts[] = {
+	HYPERV_OPT("connections=%d", connections),
+	HYPERV_OPT("meta_connections=%d", metaConnections),
+	HYPERV_OPT("max_connections=%d", maxConnections),
+	HYPERV_OPT("transport=%s", transport),
+	HYPERV_OPT("host=%s", host),
+	HYPERV_OPT("port=%d", port),
+	HYPERV_OPT("socket=%s", socketPath),
+	HYPERV_OPT("busy_poll=%d", busyPoll),
+	HYPERV_OPT("max_transfer=%d", maxTransfer),
+	HYPERV_OPT("stripe_size=%d", stripeSize),
+	HYPERV_OPT("compress", compress),
+	HYPERV_OPT("write_behind=%d", writeBehind),
+	HYPERV_OPT("content_cache=%d", contentCache),
+	FUSE_OPT_END
+};
+
 int main(int argc, char* argv[])
 {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
@@ -1234,6 +4960,33 @@ int main(int argc, char* argv[])
 	struct fuse_loop_config config;
 	int res;
 
+	if (fuse_opt_parse(&args, &options, hypervOpts, NULL) == -1)
+		return 1;
+
+	if (options.connections < 1) {
+		options.connections = 1;
+	}
+
+	if (options.metaConnections < 1) {
+		options.metaConnections = 1;
+	}
+
+	if (options.maxTransfer < 4096) {
+		options.maxTransfer = 4096;
+	}
+
+	// a buffered file goes out in a single message
+	if (options.writeBehind > options.maxTransfer) {
+		options.writeBehind = options.maxTransfer;
+	}
+
+	transport = findTransport(options.transport);
+
+	if (!transport) {
+		fprintf(stderr, "error: unknown transport %s\n", options.transport);
+		return 1;
+	}
+
 	if (fuse_parse_cmdline(&args, &opts) != 0)
 		return 1;
 
@@ -1271,6 +5024,8 @@ int main(int argc, char* argv[])
 		goto out3;
 	}
 
+	mountedFuse = fuse;
+
 	pthread_t updater;
 	pthread_mutex_lock(&changeSocketLock);
 	int ret = pthread_create(&updater, NULL, invalidatePath, (void*)fuse);
@@ -1279,7 +5034,10 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
-	opConnect();
+	if (!opConnect()) {
+		res = 1;
+		goto out3;
+	}
 
 	struct fuse_session* se = fuse_get_session(fuse);
 	if (fuse_set_signal_handlers(se) != 0) {
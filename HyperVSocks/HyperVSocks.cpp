@@ -6,10 +6,16 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <windows.h>
 #include <winioctl.h>
+#include <afunix.h>
 #include "windep.h"
 
+#if defined LZ4
+#include <lz4.h>
+#endif
+
 #ifdef VMWARE
 #include "vmci_sockets.h"
 #elif !defined VMNET
@@ -22,8 +28,39 @@
 
 #define PORT_NUM 5001
 #define MAX_PATH 260
-#define SOCKET_NUM 4
+#define MAX_SOCKET_NUM 32
+#define DATA_ALIGNMENT 4096
+
+// the largest read or write the client may send, and how many buffers
+// of that size are kept around for them
+#define MAX_TRANSFER (4 * 1024 * 1024)
+#define TRANSFER_BUFFERS 16
+#define TRANSFER_BUFFER_SIZE (MAX_TRANSFER + DATA_ALIGNMENT)
+
+// the most file data a single bulk read reply carries
+#define BULK_READ_MAX (32 * 1024 * 1024)
+// how much a tree op does before it replies, so the client can show progress
+#define TREE_STEP 4096
+#define TREE_STEP_BYTES (256 * 1024 * 1024)
+
+// bulk data smaller than this is never compressed
+#define COMPRESS_MIN 4096
+#define READ_AHEAD 65536
+#define SEND_BATCH 64
+#define COMPOUND_MAX 64
+
+// files are opened so the client can rename and delete them while they are open
+#define SHARE_ALL (FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE)
 #define VMADDR_CID_HOST 2
+#define SOCKET_PATH "hypervfs.sock"
+
+#if defined VMWARE
+#define DEFAULT_TRANSPORT "vmware"
+#elif defined VMNET
+#define DEFAULT_TRANSPORT "tcp"
+#else
+#define DEFAULT_TRANSPORT "hyperv"
+#endif
 
 #define TICKS_PER_SECOND 10000000
 #define EPOCH_DIFFERENCE 11644473600
@@ -57,11 +94,29 @@ typedef struct
     uint32 ctime;
 } HyperVStat;
 
+// every message starts with this, replies echo the id and op code of the request,
+// the last dataSize bytes of a message are bulk data which is read into its own buffer,
+// compressed bulk data is rawSize bytes once unpacked
+typedef struct
+{
+    uint64 size;
+    uint64 dataSize;
+    uint32 id;
+    short op;
+    short status;
+    uint32 flags;
+    uint32 rawSize;
+} HyperVHeader;
+
 enum
 {
     HYPERV_OK = 0,
     HYPERV_NOENT = ENOENT,
     HYPERV_EXIST = EEXIST,
+    HYPERV_INVAL = EINVAL,
+    HYPERV_NOSPC = ENOSPC,
+    HYPERV_ACCES = EACCES,
+    HYPERV_OPNOTSUPP = 95, // EOPNOTSUPP is 130 on windows, the client wants the linux value
 
     // op codes
     HYPERV_ATTR = 10,
@@ -76,7 +131,78 @@ enum
     HYPERV_RENAME = 100,
     HYPERV_SYMLINK = 110,
     HYPERV_LINK = 120,
-    HYPERV_READLINK = 130
+    HYPERV_READLINK = 130,
+    HYPERV_HELLO = 140,
+    HYPERV_COMPOUND = 150,
+    HYPERV_CREATE_WITH_DATA = 160,
+    HYPERV_OPEN = 170,
+    HYPERV_RELEASE = 180,
+    HYPERV_COPY = 190,
+    HYPERV_FALLOCATE = 200,
+    HYPERV_QUERY_RANGES = 210,
+    HYPERV_WALK = 220,
+    HYPERV_BULK_STAT = 230,
+    HYPERV_BULK_READ = 240,
+    HYPERV_RMTREE = 250,
+    HYPERV_COPYTREE = 260
+};
+
+// open flags, the client maps its own O_ flags to these
+enum
+{
+    HYPERV_OPEN_READ = 1,
+    HYPERV_OPEN_WRITE = 2,
+    HYPERV_OPEN_CREATE = 4,
+    HYPERV_OPEN_EXCL = 8,
+    HYPERV_OPEN_TRUNC = 16,
+    HYPERV_OPEN_APPEND = 32
+};
+
+// fallocate modes, a plain allocation also extends the file
+enum
+{
+    HYPERV_FALLOC_KEEP_SIZE = 1,
+    HYPERV_FALLOC_PUNCH_HOLE = 2,
+    HYPERV_FALLOC_ZERO_RANGE = 4
+};
+
+// what a connection is used for, sent in the hello
+enum
+{
+    HYPERV_ROLE_DATA = 0,
+    HYPERV_ROLE_CHANGE = 1
+};
+
+enum
+{
+    HYPERV_FLAG_COMPRESSED = 1
+};
+
+// which attributes follow the reply of a mutating op
+enum
+{
+    HYPERV_ATTR_SELF = 1,
+    HYPERV_ATTR_PARENT = 2
+};
+
+// what a connection can use, agreed on in HELLO
+enum
+{
+    HYPERV_FEATURE_LZ4 = 1
+};
+
+#if defined LZ4
+#define HYPERV_FEATURES HYPERV_FEATURE_LZ4
+#else
+#define HYPERV_FEATURES 0
+#endif
+
+// data connections are split by op class, metadata is served first
+enum
+{
+    HYPERV_LANE_META = 0,
+    HYPERV_LANE_BULK = 1,
+    LANE_NUM
 };
 
 typedef struct
@@ -85,11 +211,95 @@ typedef struct
     HANDLE hDir;
 } HyperVWatch;
 
+// bytes received ahead of the message being parsed, so back to back
+// small messages cost a single recv
+typedef struct
+{
+    SOCKET socket;
+    uint32 start;
+    uint32 end;
+    char buffer[READ_AHEAD];
+} HyperVInput;
+
+// a reply waiting to be sent, whoever holds the send lock sends all of them
+typedef struct
+{
+    SLIST_ENTRY entry;
+    char* buffer;
+} HyperVReply;
+
+// a file the client opened, workers using it hold a reference
+typedef struct
+{
+    HANDLE file;
+    uint32 flags;
+    volatile LONG refs;
+} HyperVOpenFile;
+
+// open handles belong to the client, so any of its data connections can use them,
+// they are closed when the last one goes away, a handle is its slot + 1 with the
+// slot's generation on top, so a stale one never finds the next file
+typedef struct HyperVSession
+{
+    uint64 id;
+    int connections;
+    SRWLOCK lock;
+    HyperVOpenFile** files;
+    uint32* generations;
+    uint32 capacity;
+    uint32 firstFree;
+    struct HyperVSession* next;
+} HyperVSession;
+
+typedef struct
+{
+    SOCKET socket;
+    HyperVSession* session;
+    SLIST_HEADER replies;
+    CRITICAL_SECTION sendLock;
+    volatile LONG refs;
+    HANDLE idle;
+    PTP_CALLBACK_ENVIRON env;
+    uint32 features;
+    uint32 maxTransfer;
+
+    // bulk data before and after compression, both ways
+    volatile LONG64 rawBytes;
+    volatile LONG64 wireBytes;
+} HyperVConnection;
+
+typedef struct
+{
+    HyperVConnection* conn;
+    char* inBuffer;
+    char* data;
+} HyperVWork;
+
+// the listening socket of every transport, picked on the command line
+typedef struct
+{
+    const char* name;
+    SOCKET (*listen)(const char* address);
+    int noDelay;
+} HyperVTransport;
+
 volatile SOCKET sServer = 0;
-volatile SOCKET dClient = 0;
-volatile SOCKET sClients[SOCKET_NUM] = { 0 };
+volatile SOCKET sClients[MAX_SOCKET_NUM + 1] = { 0 };
+volatile LONG dataConnections = 0;
+CRITICAL_SECTION clientsLock;
+HyperVSession* sessions = NULL;
+CRITICAL_SECTION sessionsLock;
+
+// every lane has its own thread pool, so bulk transfers can't take
+// the threads metadata ops need
+TP_CALLBACK_ENVIRON laneEnv[LANE_NUM];
+PTP_POOL lanePool[LANE_NUM];
 volatile int shuttingDown = 0;
 
+// transfer buffers are carved out of one region, the free ones sit on a lock free list
+SLIST_HEADER freeBuffers;
+char* bufferRegion = NULL;
+
 void Log(int ret, const char* function, int retZeroSuccess = 1)
 {
     int success = (ret == 0 && retZeroSuccess == 1) || (ret != 0 && retZeroSuccess == 0);
@@ -101,6 +311,47 @@ void Log(int ret, const char* function, int retZeroSuccess = 1)
     }
 }
 
+void initBuffers()
+{
+    InitializeSListHead(&freeBuffers);
+
+    bufferRegion = (char*) VirtualAlloc(NULL, (SIZE_T) TRANSFER_BUFFER_SIZE * TRANSFER_BUFFERS, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+    if (!bufferRegion) {
+        printf("Could not allocate transfer buffers\n");
+        return;
+    }
+
+    for (int i = 0; i < TRANSFER_BUFFERS; i++) {
+        InterlockedPushEntrySList(&freeBuffers, (PSLIST_ENTRY) (bufferRegion + (SIZE_T) i * TRANSFER_BUFFER_SIZE));
+    }
+}
+
+// buffers for read and write data, and anything sent back with it
+char* aquireBuffer(uint64 size)
+{
+    if (size <= TRANSFER_BUFFER_SIZE) {
+        PSLIST_ENTRY entry = InterlockedPopEntrySList(&freeBuffers);
+
+        if (entry) {
+            return (char*) entry;
+        }
+    }
+
+    // all of them are in use, this one is freed for good
+    return (char*) malloc(size);
+}
+
+void releaseBuffer(char* buffer)
+{
+    if (bufferRegion && buffer >= bufferRegion && buffer < bufferRegion + (SIZE_T) TRANSFER_BUFFER_SIZE * TRANSFER_BUFFERS) {
+        InterlockedPushEntrySList(&freeBuffers, (PSLIST_ENTRY) buffer);
+        return;
+    }
+
+    free(buffer);
+}
+
 uint64 makeLong(uint32 high, uint32 low)
 {
     return (uint64) high << 32 | low;
@@ -113,7 +364,59 @@ uint32 fileTimeToUnix(FILETIME ft)
     return (uint32)(ticks / TICKS_PER_SECOND - EPOCH_DIFFERENCE);
 }
 
-int getPathAttr(const char *path, HyperVStat** stat)
+char* makeRemotePath(const char* path, const char* name);
+
+// the target of an open symlink as the client sees it, external targets are kept as they are
+char* linkTarget(HANDLE hFile, short* ext)
+{
+    // bacause windows always complicates things
+    DWORD bytesReturned;
+    REPARSE_DATA_BUFFER* lpOutBuffer = (REPARSE_DATA_BUFFER*) malloc(MAXIMUM_REPARSE_DATA_BUFFER_SIZE);
+
+    if (!DeviceIoControl(hFile, FSCTL_GET_REPARSE_POINT, NULL, 0, lpOutBuffer, MAXIMUM_REPARSE_DATA_BUFFER_SIZE, &bytesReturned, NULL)
+        || lpOutBuffer->ReparseTag != IO_REPARSE_TAG_SYMLINK) {
+        free(lpOutBuffer);
+        return NULL;
+    }
+
+    short targetLen = lpOutBuffer->SymbolicLinkReparseBuffer.PrintNameLength / sizeof(WCHAR);
+    WCHAR* printName = lpOutBuffer->SymbolicLinkReparseBuffer.PathBuffer + lpOutBuffer->SymbolicLinkReparseBuffer.PrintNameOffset / sizeof(WCHAR);
+    char* targetPath = (char*) calloc(1, targetLen + 1);
+    wcstombs(targetPath, printName, targetLen);
+    free(lpOutBuffer);
+
+    // extern paths are not translated
+    *ext = targetPath[0] == '/';
+
+    if (!*ext) {
+        char* remotePath = makeRemotePath(ROOT, targetPath);
+        free(targetPath);
+        targetPath = remotePath;
+    }
+
+    return targetPath;
+}
+
+// a symlink target follows its stat in attr and readdir replies, so readlink
+// needs no trip of its own, an empty target means it couldn't be read
+int linkSize(const char* target)
+{
+    return 2 * sizeof(short) + (target ? strlen(target) + 1 : 0);
+}
+
+int writeLink(char* buffer, const char* target, short ext)
+{
+    short targetLen = target ? strlen(target) + 1 : 0;
+
+    memcpy(buffer, &ext, sizeof(short));
+    memcpy(buffer + sizeof(short), &targetLen, sizeof(short));
+    memcpy(buffer + 2 * sizeof(short), target, targetLen);
+
+    return 2 * sizeof(short) + targetLen;
+}
+
+// the link target is read from the same handle when asked for
+int getPathAttr(const char *path, HyperVStat** stat, char** target = NULL, short* ext = NULL)
 {
     uint32 fileAttr = GetFileAttributes(path);
 
@@ -136,11 +439,11 @@ int getPathAttr(const char *path, HyperVStat** stat)
         dwFlagsAndAttributes = FILE_ATTRIBUTE_DIRECTORY | FILE_FLAG_BACKUP_SEMANTICS;
     } else {
         type = 1;
-        mode = S_IFREG | 0644;
+        mode = fileAttr & FILE_ATTRIBUTE_READONLY ? S_IFREG | 0444 : S_IFREG | 0644;
         dwFlagsAndAttributes = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED;
     }
 
-    HANDLE hFile = CreateFile(path, FILE_READ_EA, FILE_SHARE_READ, NULL, OPEN_EXISTING, dwFlagsAndAttributes, NULL);
+    HANDLE hFile = CreateFile(path, FILE_READ_EA, SHARE_ALL, NULL, OPEN_EXISTING, dwFlagsAndAttributes, NULL);
 
     if (hFile == INVALID_HANDLE_VALUE) {
         return HYPERV_NOENT;
@@ -148,6 +451,11 @@ int getPathAttr(const char *path, HyperVStat** stat)
 
     BY_HANDLE_FILE_INFORMATION lpFileInformation;
     GetFileInformationByHandle(hFile, &lpFileInformation);
+
+    if (target) {
+        *target = type == 2 ? linkTarget(hFile, ext) : NULL;
+    }
+
     CloseHandle(hFile);
 
     uint64 size = makeLong(lpFileInformation.nFileSizeHigh, lpFileInformation.nFileSizeLow);
@@ -265,347 +573,1725 @@ char* makeLocalPath(const char* path, const char* name)
     return filePath;
 }
 
+int writeHeader(char* buffer, uint64 size, short status)
+{
+    // the request id and op code are set by processMessage
+    HyperVHeader header = { 0 };
+    header.size = size;
+    header.status = status;
+
+    memcpy(buffer, &header, sizeof(HyperVHeader));
+
+    return sizeof(HyperVHeader);
+}
+
 int opNotify(char* path, char** outBuffer)
 {
     int pathLen = strlen(path) + 1;
-    uint64 size = sizeof(uint64) + sizeof(short) + sizeof(short) + pathLen;
+    uint64 size = sizeof(HyperVHeader) + sizeof(short) + pathLen;
     *outBuffer = (char*)malloc(size);
 
-    short status = HYPERV_OK;
-    memcpy(*outBuffer, &size, sizeof(uint64));
-    memcpy(*outBuffer + sizeof(uint64), &status, sizeof(short));
-    memcpy(*outBuffer + sizeof(uint64) + sizeof(short), &pathLen, sizeof(short));
-    memcpy(*outBuffer + sizeof(uint64) + sizeof(short) + sizeof(short), path, pathLen);
+    int offset = writeHeader(*outBuffer, size, HYPERV_OK);
+    memcpy(*outBuffer + offset, &pathLen, sizeof(short));
+
+    offset += sizeof(short);
+    memcpy(*outBuffer + offset, path, pathLen);
 
     return (int)size;
 }
 
+// what the client is told for a failed host call
+short hostError(DWORD error)
+{
+    switch (error)
+    {
+    case ERROR_FILE_NOT_FOUND:
+    case ERROR_PATH_NOT_FOUND:
+        return HYPERV_NOENT;
+    case ERROR_FILE_EXISTS:
+    case ERROR_ALREADY_EXISTS:
+        return HYPERV_EXIST;
+    case ERROR_DISK_FULL:
+        return HYPERV_NOSPC;
+    default:
+        return HYPERV_ACCES;
+    }
+}
+
 int opError(short err, char** outBuffer)
 {
-    uint64 size = sizeof(uint64) + sizeof(short);
+    uint64 size = sizeof(HyperVHeader);
     *outBuffer = (char*)malloc(size);
 
-    memcpy(*outBuffer, &size, sizeof(uint64));
-    memcpy(*outBuffer + sizeof(uint64), &err, sizeof(short));
+    writeHeader(*outBuffer, size, err);
 
     return (int)size;
 }
 
 int opOk(char** outBuffer)
 {
-    uint64 size = sizeof(uint64) + sizeof(short);
+    uint64 size = sizeof(HyperVHeader);
     *outBuffer = (char*)malloc(size);
 
-    short status = HYPERV_OK;
-    memcpy(*outBuffer, &size, sizeof(uint64));
-    memcpy(*outBuffer + sizeof(uint64), &status, sizeof(short));
+    writeHeader(*outBuffer, size, HYPERV_OK);
 
     return (int)size;
 }
 
-int opReadAttr(char* inBuffer, char** outBuffer)
+HyperVOpenFile* newOpenFile(HANDLE hFile, uint32 flags)
 {
-    int offset = sizeof(uint64) + sizeof(short) + sizeof(short);
-    char* path = inBuffer + offset;
+    HyperVOpenFile* file = (HyperVOpenFile*) malloc(sizeof(HyperVOpenFile));
+    file->file = hFile;
+    file->flags = flags;
+    file->refs = 1;
 
-    // prefix the path
-    char* filePath = makeLocalPath(ROOT, path);
-    HyperVStat* stat = NULL; 
-    int err = getPathAttr(filePath, &stat);
-    free(filePath);
+    return file;
+}
 
-    if (err) {
-        return opError(err, outBuffer);
+void putFile(HyperVOpenFile* file)
+{
+    if (InterlockedDecrement(&file->refs) == 0) {
+        CloseHandle(file->file);
+        free(file);
     }
-
-    int status = HYPERV_OK;
-    uint64 size = sizeof(uint64) + sizeof(short) + sizeof(HyperVStat);
-    *outBuffer = (char*) malloc(size);
-
-    memcpy(*outBuffer, &size, sizeof(uint64));
-    memcpy(*outBuffer + sizeof(uint64), &status, sizeof(short));
-    memcpy(*outBuffer + sizeof(uint64) + sizeof(short), stat, sizeof(HyperVStat));
-
-    free(stat);
-
-    return size;
 }
 
-int opReadDir(char* inBuffer, char** outBuffer)
+uint64 addHandle(HyperVSession* session, HyperVOpenFile* file)
 {
-    int offset = sizeof(uint64) + sizeof(short) + sizeof(short);
-    char* path = inBuffer + offset;
+    AcquireSRWLockExclusive(&session->lock);
 
-    // prefix the path
-    char* dirPath = makeLocalPath(ROOT, path);
+    uint32 index = session->firstFree;
 
-    char *findPath = (char*) calloc(1, strlen(dirPath) + 3 + 1);
-    strcpy(findPath, dirPath);
-    strcat(findPath, "\\*");
+    while (index < session->capacity && session->files[index]) {
+        index++;
+    }
 
-    WIN32_FIND_DATA fileinfo;
-    HANDLE handle = FindFirstFile(findPath, &fileinfo);
-    free(findPath);
+    if (index == session->capacity) {
+        uint32 capacity = session->capacity ? session->capacity * 2 : 64;
 
-    if (handle == INVALID_HANDLE_VALUE) {
-        free(dirPath);
-        return opError(HYPERV_NOENT, outBuffer);
+        session->files = (HyperVOpenFile**) realloc(session->files, capacity * sizeof(HyperVOpenFile*));
+        session->generations = (uint32*) realloc(session->generations, capacity * sizeof(uint32));
+        memset(session->files + session->capacity, 0, (capacity - session->capacity) * sizeof(HyperVOpenFile*));
+        memset(session->generations + session->capacity, 0, (capacity - session->capacity) * sizeof(uint32));
+        session->capacity = capacity;
     }
 
-    // allocate for average file length
-    int blockSize = sizeof(short) + MAX_PATH + sizeof(HyperVStat);
-    int blockNum = 5;
-    int allocatedBlocks = 0;
+    session->files[index] = file;
+    session->firstFree = index + 1;
+    uint64 handle = (uint64) session->generations[index] << 32 | (index + 1);
 
-    int bufferSize = 0;
-    int realSize = bufferSize;
-    char* buffer = NULL;
+    ReleaseSRWLockExclusive(&session->lock);
 
-    do {
-        // get file stat
-        char* filePath = makePath(dirPath, fileinfo.cFileName);
-        HyperVStat* stat = NULL;
-        int err = getPathAttr(filePath, &stat);
-        free(filePath);
+    return handle;
+}
 
-        if (err) {
-            continue;
-        }
+// the slot of a handle, if it is still open
+int handleSlot(HyperVSession* session, uint64 handle)
+{
+    uint32 index = (uint32) handle - 1;
 
-        short nameLength = strlen(fileinfo.cFileName) + 1;
+    if ((uint32) handle == 0 || index >= session->capacity || !session->files[index]
+        || session->generations[index] != (uint32) (handle >> 32)) {
+        return -1;
+    }
 
-        // allocate space if blocks are needed
-        realSize += sizeof(short) + nameLength + sizeof(HyperVStat);
-        int requestedSize = realSize / blockSize + (realSize % blockSize != 0);
+    return (int) index;
+}
 
-        if (requestedSize > allocatedBlocks) {
-            allocatedBlocks += blockNum;
-            buffer = (char*) realloc(buffer, blockSize * allocatedBlocks);
-        }
+HyperVOpenFile* findHandle(HyperVSession* session, uint64 handle)
+{
+    HyperVOpenFile* file = NULL;
 
-        // copy file name length
-        memcpy(buffer + bufferSize, &nameLength, nameLength);
+    AcquireSRWLockShared(&session->lock);
 
-        // copy file name
-        bufferSize += sizeof(short);
-        memcpy(buffer + bufferSize, fileinfo.cFileName, nameLength);
+    int index = handleSlot(session, handle);
 
-        // copy file stat
-        bufferSize += nameLength;
-        memcpy(buffer + bufferSize, stat, sizeof(HyperVStat));
+    if (index >= 0) {
+        file = session->files[index];
+        InterlockedIncrement(&file->refs);
+    }
 
-        free(stat);
+    ReleaseSRWLockShared(&session->lock);
 
-        bufferSize += sizeof(HyperVStat);
-    } while (FindNextFile(handle, &fileinfo) != 0);
+    return file;
+}
 
-    FindClose(handle);
+// the file closes once the workers still using it are done
+int removeHandle(HyperVSession* session, uint64 handle)
+{
+    HyperVOpenFile* file = NULL;
 
-    // prefix it with the status and final size
-    short status = HYPERV_OK;
-    uint64 size = sizeof(uint64) + sizeof(short) + realSize;
-    *outBuffer = (char*) malloc(size);
+    AcquireSRWLockExclusive(&session->lock);
 
-    memcpy(*outBuffer, &size, sizeof(uint64));
-    memcpy(*outBuffer + sizeof(uint64), &status, sizeof(short));
-    memcpy(*outBuffer + sizeof(uint64) + sizeof(short), buffer, realSize);
+    int index = handleSlot(session, handle);
 
-    free(buffer);
+    if (index >= 0) {
+        file = session->files[index];
+        session->files[index] = NULL;
+        session->generations[index]++;
+        session->firstFree = (uint32) index < session->firstFree ? index : session->firstFree;
+    }
 
-    return size;
+    ReleaseSRWLockExclusive(&session->lock);
+
+    if (file) {
+        putFile(file);
+    }
+
+    return file != NULL;
 }
 
-int opRead(char* inBuffer, char** outBuffer)
+HyperVSession* joinSession(uint64 id)
 {
-    int offset = sizeof(uint64) + sizeof(short);
-    short* pathLength = (short*) (inBuffer + offset);
-
-    offset += sizeof(short);
-    char* path = inBuffer + offset;
-    char* fPath = makeLocalPath(ROOT, path);
+    EnterCriticalSection(&sessionsLock);
 
-    HANDLE hFile = CreateFile(fPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-    free(fPath);
+    HyperVSession* session = sessions;
 
-    if (hFile == INVALID_HANDLE_VALUE) {
-        return opError(HYPERV_NOENT, outBuffer);
+    while (session && session->id != id) {
+        session = session->next;
     }
 
-    offset += *pathLength;
-    uint64* rSize = (uint64*) (inBuffer + offset);
+    if (!session) {
+        session = (HyperVSession*) calloc(1, sizeof(HyperVSession));
+        session->id = id;
+        InitializeSRWLock(&session->lock);
+        session->next = sessions;
+        sessions = session;
+    }
 
-    offset += sizeof(uint64);
-    int64* rOffset = (int64*) (inBuffer + offset);
+    session->connections++;
 
-    // TODO: maybe validate rSize
-    char* buffer = (char*) calloc(1, *rSize);
+    LeaveCriticalSection(&sessionsLock);
 
-    // set offset
-    LARGE_INTEGER lrOffset;
-    lrOffset.QuadPart = *rOffset;
-    SetFilePointer(hFile, lrOffset.LowPart, &lrOffset.HighPart, FILE_BEGIN);
+    return session;
+}
 
-    unsigned long readBytes = 0;
-    int success = ReadFile(hFile, buffer, *rSize, &readBytes, NULL);
-    CloseHandle(hFile);
+void leaveSession(HyperVSession* session)
+{
+    EnterCriticalSection(&sessionsLock);
 
-    if (!success)
-    {
-        return opError(HYPERV_NOENT, outBuffer);
+    if (--session->connections > 0) {
+        LeaveCriticalSection(&sessionsLock);
+        return;
     }
 
-    int status = HYPERV_OK;
-    uint64 lReadBytes = (uint64) readBytes;
-    uint64 size = sizeof(uint64) + sizeof(short) + sizeof(uint64) + lReadBytes;
-    *outBuffer = (char*) malloc(size);
-
-    offset = 0;
-    memcpy(*outBuffer + offset, &size, sizeof(uint64));
+    for (HyperVSession** next = &sessions; *next; next = &(*next)->next) {
+        if (*next == session) {
+            *next = session->next;
+            break;
+        }
+    }
 
-    offset += sizeof(uint64);
-    memcpy(*outBuffer + offset, &status, sizeof(short));
+    LeaveCriticalSection(&sessionsLock);
 
-    offset += sizeof(short);
-    memcpy(*outBuffer + offset, &lReadBytes, sizeof(uint64));
+    // nobody can reach the session anymore, close what the client left open
+    int left = 0;
 
-    offset += sizeof(uint64);
-    memcpy(*outBuffer + offset, buffer, lReadBytes);
+    for (uint32 i = 0; i < session->capacity; i++) {
+        if (session->files[i]) {
+            putFile(session->files[i]);
+            left++;
+        }
+    }
 
-    free(buffer);
+    if (left) {
+        printf("Closed %d files left open by the client\n", left);
+    }
 
-    return size;
+    free(session->files);
+    free(session->generations);
+    free(session);
 }
 
-int opCreate(char* inBuffer, char** outBuffer)
+// the file an op works on, the client's open handle when it sent one,
+// else the path is opened just for this op, putFile undoes either
+HyperVOpenFile* getFile(HyperVSession* session, uint64 handle, const char* path, DWORD access, DWORD disposition)
 {
-    int offset = sizeof(uint64) + sizeof(short);
-    short* pathLength = (short*) (inBuffer + offset);
+    HyperVOpenFile* file = session && handle ? findHandle(session, handle) : NULL;
 
-    offset += sizeof(short);
-    char* path = inBuffer + offset;
-    char* fPath = makeLocalPath(ROOT, path);
+    if (file) {
+        return file;
+    }
 
-    HANDLE hFile = CreateFile(fPath, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+    char* fPath = makeLocalPath(ROOT, path);
+    HANDLE hFile = CreateFile(fPath, access, SHARE_ALL, NULL, disposition, FILE_ATTRIBUTE_NORMAL, NULL);
+    DWORD error = GetLastError();
+    free(fPath);
+
+    // callers tell the client why with hostError
+    if (hFile == INVALID_HANDLE_VALUE) {
+        SetLastError(error);
+        return NULL;
+    }
+
+    return newOpenFile(hFile, 0);
+}
+
+// i/o at an offset, workers can share a handle so its file pointer means nothing
+OVERLAPPED filePosition(int64 position)
+{
+    OVERLAPPED at = { 0 };
+    at.Offset = (DWORD) position;
+    at.OffsetHigh = (DWORD) (position >> 32);
+
+    return at;
+}
+
+// the directory holding path, the root is its own parent
+char* parentPath(const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    int length = slash && slash != path ? (int)(slash - path) : 1;
+    char* parent = (char*) malloc(length + 1);
+
+    memcpy(parent, slash ? path : "/", length);
+    parent[length] = '\0';
+
+    return parent;
+}
+
+// ok with the body of the op, then the attributes of path after the change and
+// of its parent when an entry was added or removed, so the client needs no getattr
+int opAttrs(const char* path, int self, int parent, const void* body, int bodySize, char** outBuffer)
+{
+    HyperVStat* stats[2] = { NULL, NULL };
+    short mask = 0;
+
+    if (self) {
+        char* filePath = makeLocalPath(ROOT, path);
+        mask |= getPathAttr(filePath, &stats[0]) ? 0 : HYPERV_ATTR_SELF;
+        free(filePath);
+    }
+
+    if (parent) {
+        char* parentName = parentPath(path);
+        char* filePath = makeLocalPath(ROOT, parentName);
+        mask |= getPathAttr(filePath, &stats[1]) ? 0 : HYPERV_ATTR_PARENT;
+        free(filePath);
+        free(parentName);
+    }
+
+    uint64 size = sizeof(HyperVHeader) + bodySize + sizeof(short) + 2 * sizeof(HyperVStat);
+    *outBuffer = (char*) calloc(1, size);
+
+    int offset = writeHeader(*outBuffer, size, HYPERV_OK);
+    memcpy(*outBuffer + offset, body, bodySize);
+
+    offset += bodySize;
+    memcpy(*outBuffer + offset, &mask, sizeof(short));
+
+    offset += sizeof(short);
+
+    for (int i = 0; i < 2; i++) {
+        if (stats[i]) {
+            memcpy(*outBuffer + offset, stats[i], sizeof(HyperVStat));
+            free(stats[i]);
+        }
+
+        offset += sizeof(HyperVStat);
+    }
+
+    return (int) size;
+}
+
+int opReadAttr(char* inBuffer, char** outBuffer)
+{
+    int offset = sizeof(HyperVHeader) + sizeof(short);
+    char* path = inBuffer + offset;
+
+    // prefix the path
+    char* filePath = makeLocalPath(ROOT, path);
+    HyperVStat* stat = NULL; 
+    char* target = NULL;
+    short ext = 0;
+    int err = getPathAttr(filePath, &stat, &target, &ext);
+    free(filePath);
+
+    if (err) {
+        return opError(err, outBuffer);
+    }
+
+    int status = HYPERV_OK;
+    int link = stat->type == 2 ? linkSize(target) : 0;
+    uint64 size = sizeof(HyperVHeader) + sizeof(HyperVStat) + link;
+    *outBuffer = (char*) malloc(size);
+
+    offset = writeHeader(*outBuffer, size, status);
+    memcpy(*outBuffer + offset, stat, sizeof(HyperVStat));
+
+    if (link) {
+        offset += sizeof(HyperVStat);
+        writeLink(*outBuffer + offset, target, ext);
+    }
+
+    free(target);
+    free(stat);
+
+    return size;
+}
+
+// the attributes of the root, every directory on the way and the path itself,
+// stopping at the first one missing or at a symlink, which the client resolves itself
+int opWalk(char* inBuffer, char** outBuffer)
+{
+    int offset = sizeof(HyperVHeader) + sizeof(short);
+    char* path = _strdup(inBuffer + offset);
+
+    char* buffer = NULL;
+    int bufferSize = 0;
+    short count = 0;
+    int length = strlen(path);
+    int end = 1;
+
+    for (;;) {
+        // cut the path after the current component, the root goes first
+        char saved = path[end];
+        path[end] = '\0';
+
+        char* filePath = makeLocalPath(ROOT, path);
+        HyperVStat* stat = NULL;
+        char* target = NULL;
+        short ext = 0;
+        int err = getPathAttr(filePath, &stat, &target, &ext);
+        free(filePath);
+
+        path[end] = saved;
+
+        if (err) {
+            break;
+        }
+
+        int link = stat->type == 2 ? linkSize(target) : 0;
+        buffer = (char*) realloc(buffer, bufferSize + sizeof(HyperVStat) + link);
+        memcpy(buffer + bufferSize, stat, sizeof(HyperVStat));
+        bufferSize += sizeof(HyperVStat);
+
+        if (link) {
+            bufferSize += writeLink(buffer + bufferSize, target, ext);
+        }
+
+        count++;
+        free(target);
+        free(stat);
+
+        if (link || end >= length) {
+            break;
+        }
+
+        // the next component ends at the next slash or at the end
+        char* slash = strchr(path + end + 1, '/');
+        end = slash ? (int)(slash - path) : length;
+    }
+
+    free(path);
+
+    if (!count) {
+        free(buffer);
+        return opError(HYPERV_NOENT, outBuffer);
+    }
+
+    // the count, then a stat for each component, symlinks with their target
+    uint64 size = sizeof(HyperVHeader) + sizeof(short) + bufferSize;
+    *outBuffer = (char*) malloc(size);
+
+    offset = writeHeader(*outBuffer, size, HYPERV_OK);
+    memcpy(*outBuffer + offset, &count, sizeof(short));
+
+    offset += sizeof(short);
+    memcpy(*outBuffer + offset, buffer, bufferSize);
+
+    free(buffer);
+
+    return (int) size;
+}
+
+// the stats of a list of paths in one reply, in the order asked, each entry
+// has its own status so one missing path doesn't fail the rest
+int opBulkStat(char* inBuffer, char** outBuffer)
+{
+    int offset = sizeof(HyperVHeader);
+    short* count = (short*)(inBuffer + offset);
+
+    offset += sizeof(short);
+
+    char* buffer = NULL;
+    int bufferSize = 0;
+
+    for (short i = 0; i < *count; i++) {
+        short* pathLength = (short*)(inBuffer + offset);
+
+        offset += sizeof(short);
+        char* path = inBuffer + offset;
+
+        offset += *pathLength;
+
+        char* filePath = makeLocalPath(ROOT, path);
+        HyperVStat* stat = NULL;
+        char* target = NULL;
+        short ext = 0;
+        short status = getPathAttr(filePath, &stat, &target, &ext);
+        free(filePath);
+
+        int link = !status && stat->type == 2 ? linkSize(target) : 0;
+        buffer = (char*) realloc(buffer, bufferSize + sizeof(short) + sizeof(HyperVStat) + link);
+        memcpy(buffer + bufferSize, &status, sizeof(short));
+        bufferSize += sizeof(short);
+
+        if (!status) {
+            memcpy(buffer + bufferSize, stat, sizeof(HyperVStat));
+            bufferSize += sizeof(HyperVStat);
+        }
+
+        if (link) {
+            bufferSize += writeLink(buffer + bufferSize, target, ext);
+        }
+
+        free(target);
+        free(stat);
+    }
+
+    // the count, then a status for each path, followed by its stat when found
+    uint64 size = sizeof(HyperVHeader) + sizeof(short) + bufferSize;
+    *outBuffer = (char*) malloc(size);
+
+    offset = writeHeader(*outBuffer, size, HYPERV_OK);
+    memcpy(*outBuffer + offset, count, sizeof(short));
+
+    offset += sizeof(short);
+    memcpy(*outBuffer + offset, buffer, bufferSize);
+
+    free(buffer);
+
+    return (int) size;
+}
+
+// what a bulk read gathered so far, files before the one it resumes from
+// are skipped, and it stops at the first that doesn't fit
+typedef struct
+{
+    char* buffer;
+    uint64 size;
+    uint64 capacity;
+    uint32 count;
+    uint64 maxFile;
+    uint64 maxTotal;
+    const char* resume;
+    char* stopped;
+} HyperVBulkRead;
+
+// the order of the bulk read walk, a directory's entries come right after it
+// and before its next sibling, so a separator sorts before any other character
+int walkOrder(const char* a, const char* b)
+{
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+
+    int ca = *a == '/' ? 1 : *a ? (unsigned char) *a + 1 : 0;
+    int cb = *b == '/' ? 1 : *b ? (unsigned char) *b + 1 : 0;
+
+    return ca - cb;
+}
+
+// path is root or somewhere under it
+int underPath(const char* path, const char* root)
+{
+    int length = strlen(root);
+
+    if (!strcmp(root, "/")) {
+        return 1;
+    }
+
+    return !strncmp(path, root, length) && (path[length] == '/' || !path[length]);
+}
+
+typedef struct
+{
+    char* name;
+    DWORD attributes;
+} HyperVDirEntry;
+
+int compareEntries(const void* a, const void* b)
+{
+    return strcmp(((HyperVDirEntry*) a)->name, ((HyperVDirEntry*) b)->name);
+}
+
+void bulkReadFile(HyperVBulkRead* state, const char* path, const char* filePath)
+{
+    if (state->stopped) {
+        return;
+    }
+
+    // the file it stopped at may be gone by now, the walk goes on from the next one
+    if (state->resume) {
+        if (walkOrder(path, state->resume) < 0) {
+            return;
+        }
+
+        state->resume = NULL;
+    }
+
+    HyperVStat* stat = NULL;
+
+    if (getPathAttr(filePath, &stat) || stat->type != 1 || stat->size > state->maxFile) {
+        free(stat);
+        return;
+    }
+
+    short pathLength = strlen(path) + 1;
+    uint64 entrySize = sizeof(short) + pathLength + sizeof(HyperVStat) + sizeof(uint64) + stat->size;
+
+    if (state->count && state->size + entrySize > state->maxTotal) {
+        state->stopped = _strdup(path);
+        free(stat);
+        return;
+    }
+
+    HANDLE hFile = CreateFile(filePath, GENERIC_READ, SHARE_ALL, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (hFile == INVALID_HANDLE_VALUE) {
+        free(stat);
+        return;
+    }
+
+    if (state->size + entrySize > state->capacity) {
+        state->capacity = (state->size + entrySize) * 2;
+        state->buffer = (char*) realloc(state->buffer, state->capacity);
+    }
+
+    // the path, its stat, then the length and the data as it was read
+    char* entry = state->buffer + state->size;
+    int offset = 0;
+    memcpy(entry, &pathLength, sizeof(short));
+
+    offset += sizeof(short);
+    memcpy(entry + offset, path, pathLength);
+
+    offset += pathLength;
+    memcpy(entry + offset, stat, sizeof(HyperVStat));
+
+    offset += sizeof(HyperVStat);
+    unsigned long readBytes = 0;
+    int success = ReadFile(hFile, entry + offset + sizeof(uint64), (DWORD) stat->size, &readBytes, NULL);
+    CloseHandle(hFile);
+    free(stat);
+
+    if (!success) {
+        return;
+    }
+
+    uint64 length = readBytes;
+    memcpy(entry + offset, &length, sizeof(uint64));
+
+    state->size += offset + sizeof(uint64) + length;
+    state->count++;
+}
+
+// the entries are walked sorted by name, the host doesn't promise any order
+void bulkReadDir(HyperVBulkRead* state, const char* path, const char* dirPath)
+{
+    char* findPath = makePath(dirPath, "*");
+    WIN32_FIND_DATA fileinfo;
+    HANDLE handle = FindFirstFile(findPath, &fileinfo);
+    free(findPath);
+
+    if (handle == INVALID_HANDLE_VALUE) {
+        return;
+    }
+
+    HyperVDirEntry* entries = NULL;
+    uint32 count = 0;
+    uint32 capacity = 0;
+
+    do {
+        // links are not followed, so a loop can't keep it going
+        if (!strcmp(fileinfo.cFileName, ".") || !strcmp(fileinfo.cFileName, "..")
+            || (fileinfo.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            entries = (HyperVDirEntry*) realloc(entries, capacity * sizeof(HyperVDirEntry));
+        }
+
+        entries[count].name = _strdup(fileinfo.cFileName);
+        entries[count].attributes = fileinfo.dwFileAttributes;
+        count++;
+    } while (FindNextFile(handle, &fileinfo) != 0);
+
+    FindClose(handle);
+    qsort(entries, count, sizeof(HyperVDirEntry), compareEntries);
+
+    int root = strcmp(path, "/") == 0;
+
+    for (uint32 i = 0; i < count && !state->stopped; i++) {
+        char* childPath = (char*) malloc(strlen(path) + strlen(entries[i].name) + 2);
+        sprintf(childPath, "%s/%s", root ? "" : path, entries[i].name);
+        // a directory that ends before the resume point was read already
+        int done = state->resume && walkOrder(childPath, state->resume) < 0 && !underPath(state->resume, childPath);
+
+        if (!done) {
+            char* filePath = makePath(dirPath, entries[i].name);
+
+            if (entries[i].attributes & FILE_ATTRIBUTE_DIRECTORY) {
+                bulkReadDir(state, childPath, filePath);
+            } else {
+                bulkReadFile(state, childPath, filePath);
+            }
+
+            free(filePath);
+        }
+
+        free(childPath);
+    }
+
+    for (uint32 i = 0; i < count; i++) {
+        free(entries[i].name);
+    }
+
+    free(entries);
+}
+
+// the stat and the whole content of many small files in one reply, directories
+// are read recursively, files over the size cap are left out, and when the reply
+// is full it names the file to resume from, the walk is in the same order every time
+int opBulkRead(char* inBuffer, char** outBuffer)
+{
+    int offset = sizeof(HyperVHeader);
+    HyperVBulkRead state = { 0 };
+
+    state.maxFile = *(uint64*)(inBuffer + offset);
+
+    offset += sizeof(uint64);
+    state.maxTotal = *(uint64*)(inBuffer + offset);
+
+    offset += sizeof(uint64);
+    short* resumeLength = (short*)(inBuffer + offset);
+
+    offset += sizeof(short);
+    state.resume = *resumeLength ? inBuffer + offset : NULL;
+
+    offset += *resumeLength;
+    short* count = (short*)(inBuffer + offset);
+
+    offset += sizeof(short);
+
+    if (state.maxTotal > BULK_READ_MAX) {
+        state.maxTotal = BULK_READ_MAX;
+    }
+
+    if (state.maxFile > MAX_TRANSFER) {
+        state.maxFile = MAX_TRANSFER;
+    }
+
+    for (short i = 0; i < *count && !state.stopped; i++) {
+        short* pathLength = (short*)(inBuffer + offset);
+
+        offset += sizeof(short);
+        char* path = inBuffer + offset;
+
+        offset += *pathLength;
+
+        // the paths before the one holding the resume point were read already
+        if (state.resume && !underPath(state.resume, path)) {
+            continue;
+        }
+
+        char* filePath = makeLocalPath(ROOT, path);
+        uint32 fileAttr = GetFileAttributes(filePath);
+
+        if (fileAttr != INVALID_FILE_ATTRIBUTES && (fileAttr & FILE_ATTRIBUTE_DIRECTORY)) {
+            bulkReadDir(&state, path, filePath);
+        } else if (fileAttr != INVALID_FILE_ATTRIBUTES) {
+            bulkReadFile(&state, path, filePath);
+        }
+
+        free(filePath);
+
+        // whatever came after the resume point in it was read, the rest is new
+        state.resume = NULL;
+    }
+
+    // the count and where to resume, then the entries
+    short stoppedLength = state.stopped ? strlen(state.stopped) + 1 : 0;
+    uint64 bodySize = sizeof(uint32) + sizeof(short) + stoppedLength + state.size;
+    uint64 size = sizeof(HyperVHeader) + bodySize;
+    *outBuffer = (char*) malloc(size);
+
+    offset = writeHeader(*outBuffer, size, HYPERV_OK);
+    memcpy(*outBuffer + offset, &state.count, sizeof(uint32));
+
+    offset += sizeof(uint32);
+    memcpy(*outBuffer + offset, &stoppedLength, sizeof(short));
+
+    offset += sizeof(short);
+    memcpy(*outBuffer + offset, state.stopped, stoppedLength);
+
+    offset += stoppedLength;
+    memcpy(*outBuffer + offset, state.buffer, state.size);
+
+    // the files are bulk data, so they can be compressed
+    ((HyperVHeader*) *outBuffer)->dataSize = bodySize;
+
+    free(state.stopped);
+    free(state.buffer);
+
+    return (int) size;
+}
+
+// what a tree op did in this step, a removal starts over on the next step,
+// a copy skips everything before the entry it stopped at
+typedef struct
+{
+    uint32 files;
+    uint32 dirs;
+    uint64 bytes;
+    uint32 entries;
+    const char* resume;
+    char* stopped;
+    short err;
+} HyperVTree;
+
+int treeFull(HyperVTree* state)
+{
+    return state->entries >= TREE_STEP || state->bytes >= TREE_STEP_BYTES;
+}
+
+int removeTree(HyperVTree* state, const char* dirPath);
+
+// returns 1 once the entry is gone, links are removed themselves,
+// never what they point to
+int removeEntry(HyperVTree* state, const char* filePath, DWORD attributes)
+{
+    int dir = (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+
+    if (dir && !(attributes & FILE_ATTRIBUTE_REPARSE_POINT) && !removeTree(state, filePath)) {
+        return 0;
+    }
+
+    if (treeFull(state)) {
+        return 0;
+    }
+
+    // read only entries can't be deleted
+    if (attributes & FILE_ATTRIBUTE_READONLY) {
+        SetFileAttributes(filePath, FILE_ATTRIBUTE_NORMAL);
+    }
+
+    if (!(dir ? RemoveDirectory(filePath) : DeleteFile(filePath))) {
+        state->err = hostError(GetLastError());
+        return 0;
+    }
+
+    if (dir) {
+        state->dirs++;
+    } else {
+        state->files++;
+    }
+
+    state->entries++;
+
+    return 1;
+}
+
+// empties a directory depth first, returns 1 when nothing is left in it
+int removeTree(HyperVTree* state, const char* dirPath)
+{
+    char* findPath = makePath(dirPath, "*");
+    WIN32_FIND_DATA fileinfo;
+    HANDLE handle = FindFirstFile(findPath, &fileinfo);
+    free(findPath);
+
+    if (handle == INVALID_HANDLE_VALUE) {
+        state->err = hostError(GetLastError());
+        return 0;
+    }
+
+    int empty = 1;
+
+    do {
+        if (!strcmp(fileinfo.cFileName, ".") || !strcmp(fileinfo.cFileName, "..")) {
+            continue;
+        }
+
+        char* filePath = makePath(dirPath, fileinfo.cFileName);
+        empty = removeEntry(state, filePath, fileinfo.dwFileAttributes);
+        free(filePath);
+    } while (empty && FindNextFile(handle, &fileinfo) != 0);
+
+    FindClose(handle);
+
+    return empty;
+}
+
+// removes a whole tree on the host, a step at a time, the reply says how many
+// files and directories went and whether the tree is gone
+int opRmTree(char* inBuffer, char** outBuffer)
+{
+    int offset = sizeof(HyperVHeader) + sizeof(short);
+    char* path = inBuffer + offset;
+
+    if (!strcmp(path, "/")) {
+        return opError(HYPERV_INVAL, outBuffer);
+    }
+
+    char* filePath = makeLocalPath(ROOT, path);
+    DWORD attributes = GetFileAttributes(filePath);
+
+    if (attributes == INVALID_FILE_ATTRIBUTES) {
+        free(filePath);
+        return opError(HYPERV_NOENT, outBuffer);
+    }
+
+    HyperVTree state = { 0 };
+    short done = removeEntry(&state, filePath, attributes);
+    free(filePath);
+
+    if (state.err) {
+        return opError(state.err, outBuffer);
+    }
+
+    char body[sizeof(uint32) + sizeof(uint32) + sizeof(short)];
+    memcpy(body, &state.files, sizeof(uint32));
+    memcpy(body + sizeof(uint32), &state.dirs, sizeof(uint32));
+    memcpy(body + 2 * sizeof(uint32), &done, sizeof(short));
+
+    return opAttrs(path, 0, 1, body, sizeof(body), outBuffer);
+}
+
+void copyTree(HyperVTree* state, const char* path, const char* fromPath, const char* toPath);
+
+// links are copied as links, a directory is created unless the copy
+// resumes somewhere inside it, then it's there already
+void copyEntry(HyperVTree* state, const char* path, const char* fromPath, const char* toPath, WIN32_FIND_DATA* info)
+{
+    int within = 0;
+
+    if (state->resume) {
+        int length = strlen(path);
+
+        if (!strcmp(path, state->resume)) {
+            state->resume = NULL;
+        } else if (!strncmp(path, state->resume, length) && state->resume[length] == '/') {
+            within = 1;
+        } else {
+            return;
+        }
+    }
+
+    if (!within && treeFull(state)) {
+        state->stopped = _strdup(path);
+        return;
+    }
+
+    if (!(info->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || (info->dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+        if (!CopyFileEx(fromPath, toPath, NULL, NULL, NULL, COPY_FILE_FAIL_IF_EXISTS | COPY_FILE_COPY_SYMLINK)) {
+            state->err = hostError(GetLastError());
+            return;
+        }
+
+        state->files++;
+        state->bytes += ((uint64) info->nFileSizeHigh << 32) | info->nFileSizeLow;
+        state->entries++;
+
+        return;
+    }
+
+    if (!within) {
+        if (!CreateDirectory(toPath, NULL)) {
+            state->err = hostError(GetLastError());
+            return;
+        }
+
+        state->dirs++;
+        state->entries++;
+    }
+
+    copyTree(state, path, fromPath, toPath);
+}
+
+void copyTree(HyperVTree* state, const char* path, const char* fromPath, const char* toPath)
+{
+    char* findPath = makePath(fromPath, "*");
+    WIN32_FIND_DATA fileinfo;
+    HANDLE handle = FindFirstFile(findPath, &fileinfo);
+    free(findPath);
+
+    if (handle == INVALID_HANDLE_VALUE) {
+        state->err = hostError(GetLastError());
+        return;
+    }
+
+    do {
+        if (!strcmp(fileinfo.cFileName, ".") || !strcmp(fileinfo.cFileName, "..")) {
+            continue;
+        }
+
+        char* childPath = (char*) malloc(strlen(path) + strlen(fileinfo.cFileName) + 2);
+        sprintf(childPath, "%s/%s", path, fileinfo.cFileName);
+        char* childFrom = makePath(fromPath, fileinfo.cFileName);
+        char* childTo = makePath(toPath, fileinfo.cFileName);
+
+        copyEntry(state, childPath, childFrom, childTo, &fileinfo);
+
+        free(childTo);
+        free(childFrom);
+        free(childPath);
+    } while (!state->err && !state->stopped && FindNextFile(handle, &fileinfo) != 0);
+
+    FindClose(handle);
+}
+
+// copies a whole tree on the host to a path that doesn't exist yet, a step at a
+// time, the reply has the counts and the source entry to resume from, if any
+int opCopyTree(char* inBuffer, char** outBuffer)
+{
+    int offset = sizeof(HyperVHeader);
+    short* fromLength = (short*)(inBuffer + offset);
+
+    offset += sizeof(short);
+    char* from = inBuffer + offset;
+
+    offset += *fromLength;
+    short* toLength = (short*)(inBuffer + offset);
+
+    offset += sizeof(short);
+    char* to = inBuffer + offset;
+
+    offset += *toLength;
+    short* resumeLength = (short*)(inBuffer + offset);
+
+    offset += sizeof(short);
+    HyperVTree state = { 0 };
+    state.resume = *resumeLength ? inBuffer + offset : NULL;
+
+    // a tree can't be copied into itself
+    int length = *fromLength - 1;
+
+    if (!strcmp(from, "/") || (!strncmp(to, from, length) && (to[length] == '/' || !to[length]))) {
+        return opError(HYPERV_INVAL, outBuffer);
+    }
+
+    char* fromPath = makeLocalPath(ROOT, from);
+    char* toPath = makeLocalPath(ROOT, to);
+    WIN32_FIND_DATA fileinfo;
+    HANDLE handle = FindFirstFile(fromPath, &fileinfo);
+
+    if (handle == INVALID_HANDLE_VALUE) {
+        state.err = HYPERV_NOENT;
+    } else if (!state.resume && GetFileAttributes(toPath) != INVALID_FILE_ATTRIBUTES) {
+        state.err = HYPERV_EXIST;
+    }
+
+    if (handle != INVALID_HANDLE_VALUE) {
+        FindClose(handle);
+    }
+
+    if (!state.err) {
+        copyEntry(&state, from, fromPath, toPath, &fileinfo);
+    }
+
+    free(fromPath);
+    free(toPath);
+
+    if (state.err) {
+        free(state.stopped);
+        return opError(state.err, outBuffer);
+    }
+
+    // the counts, then where to resume
+    short stoppedLength = state.stopped ? strlen(state.stopped) + 1 : 0;
+    int bodySize = sizeof(uint32) + sizeof(uint32) + sizeof(uint64) + sizeof(short) + stoppedLength;
+    char* body = (char*) malloc(bodySize);
+
+    offset = 0;
+    memcpy(body + offset, &state.files, sizeof(uint32));
+
+    offset += sizeof(uint32);
+    memcpy(body + offset, &state.dirs, sizeof(uint32));
+
+    offset += sizeof(uint32);
+    memcpy(body + offset, &state.bytes, sizeof(uint64));
+
+    offset += sizeof(uint64);
+    memcpy(body + offset, &stoppedLength, sizeof(short));
+
+    offset += sizeof(short);
+    memcpy(body + offset, state.stopped, stoppedLength);
+
+    int size = opAttrs(to, 1, 1, body, bodySize, outBuffer);
+
+    free(body);
+    free(state.stopped);
+
+    return size;
+}
+
+int opReadDir(char* inBuffer, char** outBuffer)
+{
+    int offset = sizeof(HyperVHeader) + sizeof(short);
+    char* path = inBuffer + offset;
+
+    // prefix the path
+    char* dirPath = makeLocalPath(ROOT, path);
+
+    char *findPath = (char*) calloc(1, strlen(dirPath) + 3 + 1);
+    strcpy(findPath, dirPath);
+    strcat(findPath, "\\*");
+
+    WIN32_FIND_DATA fileinfo;
+    HANDLE handle = FindFirstFile(findPath, &fileinfo);
+    free(findPath);
+
+    if (handle == INVALID_HANDLE_VALUE) {
+        free(dirPath);
+        return opError(HYPERV_NOENT, outBuffer);
+    }
+
+    // allocate for average file length
+    int blockSize = sizeof(short) + MAX_PATH + sizeof(HyperVStat);
+    int blockNum = 5;
+    int allocatedBlocks = 0;
+
+    int bufferSize = 0;
+    int realSize = bufferSize;
+    char* buffer = NULL;
+
+    do {
+        // get file stat
+        char* filePath = makePath(dirPath, fileinfo.cFileName);
+        HyperVStat* stat = NULL;
+        char* target = NULL;
+        short ext = 0;
+        int err = getPathAttr(filePath, &stat, &target, &ext);
+        free(filePath);
+
+        if (err) {
+            continue;
+        }
+
+        short nameLength = strlen(fileinfo.cFileName) + 1;
+        int link = stat->type == 2 ? linkSize(target) : 0;
+
+        // allocate space if blocks are needed
+        realSize += sizeof(short) + nameLength + sizeof(HyperVStat) + link;
+        int requestedSize = realSize / blockSize + (realSize % blockSize != 0);
+
+        if (requestedSize > allocatedBlocks) {
+            allocatedBlocks = requestedSize + blockNum;
+            buffer = (char*) realloc(buffer, blockSize * allocatedBlocks);
+        }
+
+        // copy file name length
+        memcpy(buffer + bufferSize, &nameLength, sizeof(short));
+
+        // copy file name
+        bufferSize += sizeof(short);
+        memcpy(buffer + bufferSize, fileinfo.cFileName, nameLength);
+
+        // copy file stat
+        bufferSize += nameLength;
+        memcpy(buffer + bufferSize, stat, sizeof(HyperVStat));
+
+        free(stat);
+
+        bufferSize += sizeof(HyperVStat);
+
+        // symlinks carry their target
+        if (link) {
+            bufferSize += writeLink(buffer + bufferSize, target, ext);
+        }
+
+        free(target);
+    } while (FindNextFile(handle, &fileinfo) != 0);
+
+    FindClose(handle);
+
+    // prefix it with the status and final size
+    short status = HYPERV_OK;
+    uint64 size = sizeof(HyperVHeader) + realSize;
+    *outBuffer = (char*) malloc(size);
+
+    // the listing is bulk data, so it can be compressed
+    writeHeader(*outBuffer, size, status);
+    ((HyperVHeader*) *outBuffer)->dataSize = realSize;
+    memcpy(*outBuffer + sizeof(HyperVHeader), buffer, realSize);
+
+    free(buffer);
+
+    return size;
+}
+
+int opRead(HyperVSession* session, char* inBuffer, char** outBuffer)
+{
+    int offset = sizeof(HyperVHeader);
+    short* pathLength = (short*) (inBuffer + offset);
+
+    offset += sizeof(short);
+    char* path = inBuffer + offset;
+
+    offset += *pathLength;
+    uint64* rSize = (uint64*) (inBuffer + offset);
+
+    offset += sizeof(uint64);
+    int64* rOffset = (int64*) (inBuffer + offset);
+
+    offset += sizeof(int64);
+    uint64* handle = (uint64*) (inBuffer + offset);
+
+    if (*rSize > MAX_TRANSFER) {
+        return opError(HYPERV_INVAL, outBuffer);
+    }
+
+    HyperVOpenFile* file = getFile(session, *handle, path, GENERIC_READ, OPEN_EXISTING);
+
+    if (!file) {
+        return opError(HYPERV_NOENT, outBuffer);
+    }
+
+    // read straight into the reply, after the byte count
+    int status = HYPERV_OK;
+    uint64 size = sizeof(HyperVHeader) + sizeof(uint64) + *rSize;
+    *outBuffer = aquireBuffer(size);
+    char* buffer = *outBuffer + sizeof(HyperVHeader) + sizeof(uint64);
+
+    OVERLAPPED at = filePosition(*rOffset);
+    unsigned long readBytes = 0;
+    int success = ReadFile(file->file, buffer, *rSize, &readBytes, &at) || GetLastError() == ERROR_HANDLE_EOF;
+    putFile(file);
+
+    if (!success)
+    {
+        releaseBuffer(*outBuffer);
+        return opError(HYPERV_NOENT, outBuffer);
+    }
+
+    uint64 lReadBytes = (uint64) readBytes;
+    size = sizeof(HyperVHeader) + sizeof(uint64) + lReadBytes;
+
+    // the file data is marked as bulk data, so the client can receive it in place
+    offset = writeHeader(*outBuffer, size, status);
+    ((HyperVHeader*) *outBuffer)->dataSize = lReadBytes;
+    memcpy(*outBuffer + offset, &lReadBytes, sizeof(uint64));
+
+    return size;
+}
+
+int opCreate(char* inBuffer, char** outBuffer)
+{
+    int offset = sizeof(HyperVHeader);
+    short* pathLength = (short*) (inBuffer + offset);
+
+    offset += sizeof(short);
+    char* path = inBuffer + offset;
+    char* fPath = makeLocalPath(ROOT, path);
+
+    HANDLE hFile = CreateFile(fPath, GENERIC_WRITE, SHARE_ALL, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+    free(fPath);
+
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return opError(HYPERV_NOENT, outBuffer);
+    }
+
+    CloseHandle(hFile);
+
+    return opAttrs(path, 1, 1, NULL, 0, outBuffer);
+}
+
+// creates and truncates as the flags say in a single CreateFile, so nothing
+// happens between them, the reply has the handle and the attributes
+int opOpen(HyperVSession* session, char* inBuffer, char** outBuffer)
+{
+    int offset = sizeof(HyperVHeader);
+    short* pathLength = (short*)(inBuffer + offset);
+
+    offset += sizeof(short);
+    char* path = inBuffer + offset;
+
+    offset += *pathLength;
+    uint32 flags = *(uint32*)(inBuffer + offset);
+
+    offset += sizeof(uint32);
+    uint32 mode = *(uint32*)(inBuffer + offset);
+
+    DWORD access = 0;
+    DWORD disposition = OPEN_EXISTING;
+
+    if (flags & HYPERV_OPEN_READ) {
+        access |= GENERIC_READ;
+    }
+
+    if (flags & HYPERV_OPEN_WRITE) {
+        access |= GENERIC_WRITE;
+    }
+
+    if (flags & HYPERV_OPEN_APPEND) {
+        access |= FILE_APPEND_DATA;
+    }
+
+    if (flags & HYPERV_OPEN_CREATE) {
+        disposition = flags & HYPERV_OPEN_EXCL ? CREATE_NEW : flags & HYPERV_OPEN_TRUNC ? CREATE_ALWAYS : OPEN_ALWAYS;
+    } else if (flags & HYPERV_OPEN_TRUNC) {
+        disposition = TRUNCATE_EXISTING;
+        access |= GENERIC_WRITE;
+    }
+
+    // a file created without any write bit is read only
+    DWORD attributes = flags & HYPERV_OPEN_CREATE && !(mode & 0222) ? FILE_ATTRIBUTE_READONLY : FILE_ATTRIBUTE_NORMAL;
+
+    char* fPath = makeLocalPath(ROOT, path);
+    HANDLE hFile = CreateFile(fPath, access ? access : GENERIC_READ, SHARE_ALL, NULL, disposition, attributes, NULL);
+    DWORD error = GetLastError();
+    free(fPath);
+
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return opError(hostError(error), outBuffer);
+    }
+
+    // the parent only changed when the file is new
+    int created = disposition == CREATE_NEW
+        || ((disposition == OPEN_ALWAYS || disposition == CREATE_ALWAYS) && error != ERROR_ALREADY_EXISTS);
+    uint64 handle = 0;
+
+    if (session) {
+        handle = addHandle(session, newOpenFile(hFile, flags));
+    } else {
+        CloseHandle(hFile);
+    }
+
+    return opAttrs(path, 1, created, &handle, sizeof(uint64), outBuffer);
+}
+
+int opRelease(HyperVSession* session, char* inBuffer, char** outBuffer)
+{
+    uint64 handle = *(uint64*)(inBuffer + sizeof(HyperVHeader));
+
+    if (!session || !removeHandle(session, handle)) {
+        return opError(HYPERV_NOENT, outBuffer);
+    }
+
+    return opOk(outBuffer);
+}
+
+// a new file and all of its data, sent by the client once the file was closed
+int opCreateWithData(char* inBuffer, char* data, char** outBuffer)
+{
+    HyperVHeader* header = (HyperVHeader*) inBuffer;
+    int offset = sizeof(HyperVHeader);
+    short* pathLength = (short*)(inBuffer + offset);
+
+    offset += sizeof(short);
+    char* path = inBuffer + offset;
+    char* fPath = makeLocalPath(ROOT, path);
+
+    offset += *pathLength;
+    uint32 mode = *(uint32*)(inBuffer + offset);
+
+    // the mode getattr reported while the file was buffered stays the same
+    DWORD attributes = mode & 0222 ? FILE_ATTRIBUTE_NORMAL : FILE_ATTRIBUTE_READONLY;
+
+    HANDLE hFile = CreateFile(fPath, GENERIC_WRITE, SHARE_ALL, NULL, CREATE_NEW, attributes, NULL);
+    free(fPath);
+
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return opError(GetLastError() == ERROR_FILE_EXISTS ? HYPERV_EXIST : HYPERV_NOENT, outBuffer);
+    }
+
+    unsigned long writtenBytes = 0;
+    int success = !header->dataSize || WriteFile(hFile, data, (DWORD) header->dataSize, &writtenBytes, NULL);
+    CloseHandle(hFile);
+
+    if (!success || writtenBytes != header->dataSize) {
+        return opError(HYPERV_NOENT, outBuffer);
+    }
+
+    return opAttrs(path, 1, 1, NULL, 0, outBuffer);
+}
+
+int opWrite(HyperVSession* session, char* inBuffer, char* data, char** outBuffer)
+{
+    int offset = sizeof(HyperVHeader);
+    short* pathLength = (short*)(inBuffer + offset);
+
+    offset += sizeof(short);
+    char* path = inBuffer + offset;
+
+    offset += *pathLength;
+    uint64* wSize = (uint64*)(inBuffer + offset);
+
+    offset += sizeof(uint64);
+    int64* wOffset = (int64*)(inBuffer + offset);
+
+    offset += sizeof(int64);
+    uint64* handle = (uint64*)(inBuffer + offset);
+
+    // the data was read into its own aligned buffer, unless it came inline
+    HyperVHeader* header = (HyperVHeader*) inBuffer;
+    offset += sizeof(uint64);
+    uint64 available = data ? header->dataSize : header->size > (uint64) offset ? header->size - offset : 0;
+
+    if (*wSize > MAX_TRANSFER || *wSize > available) {
+        return opError(HYPERV_INVAL, outBuffer);
+    }
+
+    HyperVOpenFile* file = getFile(session, *handle, path, GENERIC_WRITE, OPEN_ALWAYS);
+
+    if (!file) {
+        return opError(HYPERV_NOENT, outBuffer);
+    }
+
+    // files opened for append are always written at their end
+    OVERLAPPED at = filePosition(*wOffset);
+
+    if (file->flags & HYPERV_OPEN_APPEND) {
+        at.Offset = 0xFFFFFFFF;
+        at.OffsetHigh = 0xFFFFFFFF;
+    }
+
+    char* wData = data ? data : inBuffer + offset;
+    unsigned long writtenBytes = 0;
+    int success = WriteFile(file->file, wData, *wSize, &writtenBytes, &at);
+    putFile(file);
+
+    if (!success)
+    {
+        return opError(HYPERV_NOENT, outBuffer);
+    }
+
+    uint64 lWrittenBytes = (uint64)writtenBytes;
+
+    return opAttrs(path, 1, 0, &lWrittenBytes, sizeof(uint64), outBuffer);
+}
+
+int opUnlink(char* inBuffer, char** outBuffer)
+{
+    int offset = sizeof(HyperVHeader);
+    short* pathLength = (short*)(inBuffer + offset);
+
+    offset += sizeof(short);
+    char* path = inBuffer + offset;
+    char* fPath = makeLocalPath(ROOT, path);
+
+    int success = DeleteFile(fPath);
     free(fPath);
 
-    if (hFile == INVALID_HANDLE_VALUE) {
-        return opError(HYPERV_NOENT, outBuffer);
+    if (!success) {
+        return opError(HYPERV_NOENT, outBuffer);
+    }
+
+    return opAttrs(path, 0, 1, NULL, 0, outBuffer);
+}
+
+int opTruncate(HyperVSession* session, char* inBuffer, char** outBuffer)
+{
+    int offset = sizeof(HyperVHeader);
+    short* pathLength = (short*)(inBuffer + offset);
+
+    offset += sizeof(short);
+    char* path = inBuffer + offset;
+
+    offset += *pathLength;
+    int64* tOffset = (int64*)(inBuffer + offset);
+
+    offset += sizeof(int64);
+    uint64* handle = (uint64*)(inBuffer + offset);
+
+    HyperVOpenFile* file = getFile(session, *handle, path, GENERIC_WRITE, OPEN_ALWAYS);
+
+    if (!file) {
+        return opError(HYPERV_NOENT, outBuffer);
+    }
+
+    // set the end without moving the file pointer
+    FILE_END_OF_FILE_INFO end;
+    end.EndOfFile.QuadPart = *tOffset;
+    int success = SetFileInformationByHandle(file->file, FileEndOfFileInfo, &end, sizeof(end));
+    putFile(file);
+
+    if (!success) {
+        return opError(HYPERV_NOENT, outBuffer);
+    }
+
+    return opAttrs(path, 1, 0, NULL, 0, outBuffer);
+}
+
+// copies a range between two files on the host, so none of it crosses the socket,
+// CopyFileEx only copies whole files over a closed target, so it's done in chunks
+int opCopy(HyperVSession* session, char* inBuffer, char** outBuffer)
+{
+    int offset = sizeof(HyperVHeader);
+    short* fromLength = (short*)(inBuffer + offset);
+
+    offset += sizeof(short);
+    char* from = inBuffer + offset;
+
+    offset += *fromLength;
+    int64* fromOffset = (int64*)(inBuffer + offset);
+
+    offset += sizeof(int64);
+    uint64* fromHandle = (uint64*)(inBuffer + offset);
+
+    offset += sizeof(uint64);
+    short* toLength = (short*)(inBuffer + offset);
+
+    offset += sizeof(short);
+    char* to = inBuffer + offset;
+
+    offset += *toLength;
+    int64* toOffset = (int64*)(inBuffer + offset);
+
+    offset += sizeof(int64);
+    uint64* toHandle = (uint64*)(inBuffer + offset);
+
+    offset += sizeof(uint64);
+    uint64* cSize = (uint64*)(inBuffer + offset);
+
+    HyperVOpenFile* source = getFile(session, *fromHandle, from, GENERIC_READ, OPEN_EXISTING);
+
+    if (!source) {
+        return opError(hostError(GetLastError()), outBuffer);
     }
 
-    CloseHandle(hFile);
+    HyperVOpenFile* target = getFile(session, *toHandle, to, GENERIC_WRITE, OPEN_EXISTING);
 
-    return opOk(outBuffer);
+    if (!target) {
+        DWORD error = GetLastError();
+        putFile(source);
+        return opError(hostError(error), outBuffer);
+    }
+
+    char* buffer = aquireBuffer(MAX_TRANSFER);
+    uint64 copied = 0;
+    int success = 1;
+    DWORD error = 0;
+
+    // stops at the end of the source, a short copy is fine
+    while (copied < *cSize) {
+        uint64 left = *cSize - copied;
+        DWORD chunk = (DWORD) (left < MAX_TRANSFER ? left : MAX_TRANSFER);
+        OVERLAPPED readAt = filePosition(*fromOffset + copied);
+        unsigned long readBytes = 0;
+
+        if (!ReadFile(source->file, buffer, chunk, &readBytes, &readAt)) {
+            error = GetLastError();
+            success = error == ERROR_HANDLE_EOF;
+            break;
+        }
+
+        if (!readBytes) {
+            break;
+        }
+
+        OVERLAPPED writeAt = filePosition(*toOffset + copied);
+        unsigned long writtenBytes = 0;
+        success = WriteFile(target->file, buffer, readBytes, &writtenBytes, &writeAt);
+        error = success ? 0 : GetLastError();
+        copied += writtenBytes;
+
+        if (!success || writtenBytes != readBytes) {
+            break;
+        }
+    }
+
+    releaseBuffer(buffer);
+    putFile(source);
+    putFile(target);
+
+    // whatever was copied before a failure is still reported
+    if (!success && !copied) {
+        return opError(hostError(error), outBuffer);
+    }
+
+    return opAttrs(to, 1, 0, &copied, sizeof(uint64), outBuffer);
 }
 
-int opWrite(char* inBuffer, char** outBuffer)
+// reserves space without writing it, or zeroes a range, punching a hole makes
+// the file sparse first so the range is deallocated rather than written
+int opFallocate(HyperVSession* session, char* inBuffer, char** outBuffer)
 {
-    int offset = sizeof(uint64) + sizeof(short);
+    int offset = sizeof(HyperVHeader);
     short* pathLength = (short*)(inBuffer + offset);
 
     offset += sizeof(short);
     char* path = inBuffer + offset;
-    char* fPath = makeLocalPath(ROOT, path);
-
-    HANDLE hFile = CreateFile(fPath, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-    free(fPath);
-
-    if (hFile == INVALID_HANDLE_VALUE) {
-        return opError(HYPERV_NOENT, outBuffer);
-    }
 
     offset += *pathLength;
-    uint64* wSize = (uint64*)(inBuffer + offset);
+    uint32* mode = (uint32*)(inBuffer + offset);
 
-    offset += sizeof(uint64);
-    int64* wOffset = (int64*)(inBuffer + offset);
+    offset += sizeof(uint32);
+    int64* fOffset = (int64*)(inBuffer + offset);
 
-    // set offset
-    LARGE_INTEGER lrOffset;
-    lrOffset.QuadPart = *wOffset;
-    SetFilePointer(hFile, lrOffset.LowPart, &lrOffset.HighPart, FILE_BEGIN);
+    offset += sizeof(int64);
+    int64* fLength = (int64*)(inBuffer + offset);
 
     offset += sizeof(int64);
-    unsigned long writtenBytes = 0;
-    int success = WriteFile(hFile, inBuffer + offset, *wSize, &writtenBytes, NULL);
-    CloseHandle(hFile);
+    uint64* handle = (uint64*)(inBuffer + offset);
 
-    if (!success)
-    {
-        return opError(HYPERV_NOENT, outBuffer);
+    if (*fOffset < 0 || *fLength <= 0) {
+        return opError(HYPERV_INVAL, outBuffer);
     }
 
-    int status = HYPERV_OK;
-    uint64 lWrittenBytes = (uint64)writtenBytes;
-    uint64 size = sizeof(uint64) + sizeof(short) + sizeof(uint64);
-    *outBuffer = (char*)malloc(size);
+    // space kept past the end is given back when the handle closes,
+    // a handle opened just for this op would lose it right away
+    if (!*handle && *mode == HYPERV_FALLOC_KEEP_SIZE) {
+        return opError(HYPERV_OPNOTSUPP, outBuffer);
+    }
 
-    offset = 0;
-    memcpy(*outBuffer + offset, &size, sizeof(uint64));
+    HyperVOpenFile* file = getFile(session, *handle, path, GENERIC_WRITE, OPEN_EXISTING);
 
-    offset += sizeof(uint64);
-    memcpy(*outBuffer + offset, &status, sizeof(short));
+    if (!file) {
+        return opError(hostError(GetLastError()), outBuffer);
+    }
 
-    offset += sizeof(short);
-    memcpy(*outBuffer + offset, &lWrittenBytes, sizeof(uint64));
+    // every step runs only after the one before it worked, so err is set by the one that failed
+    int64 end = *fOffset + *fLength;
+    LARGE_INTEGER fileSize = { 0 };
+    DWORD returned = 0;
+    int success = GetFileSizeEx(file->file, &fileSize);
+    short err = hostError(GetLastError());
+
+    if (success && (*mode & (HYPERV_FALLOC_PUNCH_HOLE | HYPERV_FALLOC_ZERO_RANGE))) {
+        // zeroing a sparse file deallocates, otherwise the zeros are written by the host
+        if (*mode & HYPERV_FALLOC_PUNCH_HOLE) {
+            FILE_SET_SPARSE_BUFFER sparse = { TRUE };
+            success = DeviceIoControl(file->file, FSCTL_SET_SPARSE, &sparse, sizeof(sparse), NULL, 0, &returned, NULL);
+            err = HYPERV_OPNOTSUPP;
+        }
 
-    return size;
-}
+        // nothing past the end needs zeroing
+        FILE_ZERO_DATA_INFORMATION zero;
+        zero.FileOffset.QuadPart = *fOffset;
+        zero.BeyondFinalZero.QuadPart = end < fileSize.QuadPart ? end : fileSize.QuadPart;
 
-int opUnlink(char* inBuffer, char** outBuffer)
-{
-    int offset = sizeof(uint64) + sizeof(short);
-    short* pathLength = (short*)(inBuffer + offset);
+        if (success && zero.FileOffset.QuadPart < zero.BeyondFinalZero.QuadPart) {
+            success = DeviceIoControl(file->file, FSCTL_SET_ZERO_DATA, &zero, sizeof(zero), NULL, 0, &returned, NULL);
+            err = hostError(GetLastError());
+        }
+    } else if (success) {
+        // the allocation size only grows, it never cuts into the file
+        FILE_ALLOCATION_INFO allocation;
+        allocation.AllocationSize.QuadPart = end;
+
+        FILE_STANDARD_INFO standard;
+        success = GetFileInformationByHandleEx(file->file, FileStandardInfo, &standard, sizeof(standard));
+        err = hostError(GetLastError());
+
+        if (success && standard.AllocationSize.QuadPart < end) {
+            success = SetFileInformationByHandle(file->file, FileAllocationInfo, &allocation, sizeof(allocation));
+            err = hostError(GetLastError());
+        }
+    }
 
-    offset += sizeof(short);
-    char* path = inBuffer + offset;
-    char* fPath = makeLocalPath(ROOT, path);
+    // the new end reads as zeros without the host writing them
+    if (success && !(*mode & (HYPERV_FALLOC_KEEP_SIZE | HYPERV_FALLOC_PUNCH_HOLE)) && end > fileSize.QuadPart) {
+        FILE_END_OF_FILE_INFO endOfFile;
+        endOfFile.EndOfFile.QuadPart = end;
+        success = SetFileInformationByHandle(file->file, FileEndOfFileInfo, &endOfFile, sizeof(endOfFile));
+        err = hostError(GetLastError());
+    }
 
-    int success = DeleteFile(fPath);
-    free(fPath);
+    putFile(file);
 
     if (!success) {
-        return opError(HYPERV_NOENT, outBuffer);
+        return opError(err, outBuffer);
     }
 
-    return opOk(outBuffer);
+    return opAttrs(path, 1, 0, NULL, 0, outBuffer);
 }
 
-int opTruncate(char* inBuffer, char** outBuffer)
+// the allocated parts of a file, so the client can skip its holes
+int opQueryRanges(HyperVSession* session, char* inBuffer, char** outBuffer)
 {
-    int offset = sizeof(uint64) + sizeof(short);
+    int offset = sizeof(HyperVHeader);
     short* pathLength = (short*)(inBuffer + offset);
 
     offset += sizeof(short);
     char* path = inBuffer + offset;
-    char* fPath = makeLocalPath(ROOT, path);
 
-    HANDLE hFile = CreateFile(fPath, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-    free(fPath);
+    offset += *pathLength;
+    uint64* handle = (uint64*)(inBuffer + offset);
 
-    if (hFile == INVALID_HANDLE_VALUE) {
+    HyperVOpenFile* file = getFile(session, *handle, path, GENERIC_READ, OPEN_EXISTING);
+
+    if (!file) {
         return opError(HYPERV_NOENT, outBuffer);
     }
 
-    offset += *pathLength;
-    int64* tOffset = (int64*)(inBuffer + offset);
-
-    // set offset
-    LARGE_INTEGER ltOffset;
-    ltOffset.QuadPart = *tOffset;
-    SetFilePointer(hFile, ltOffset.LowPart, &ltOffset.HighPart, FILE_BEGIN);
-    int success = SetEndOfFile(hFile);
-    CloseHandle(hFile);
+    LARGE_INTEGER fileSize = { 0 };
 
-    if (!success) {
+    if (!GetFileSizeEx(file->file, &fileSize)) {
+        putFile(file);
         return opError(HYPERV_NOENT, outBuffer);
     }
 
-    return opOk(outBuffer);
+    FILE_ALLOCATED_RANGE_BUFFER query;
+    query.FileOffset.QuadPart = 0;
+    query.Length.QuadPart = fileSize.QuadPart;
+
+    FILE_ALLOCATED_RANGE_BUFFER* ranges = NULL;
+    uint32 count = 0;
+    int capacity = 64;
+
+    // ask again from the end of the last range while the buffer runs out
+    while (query.Length.QuadPart > 0) {
+        ranges = (FILE_ALLOCATED_RANGE_BUFFER*) realloc(ranges, (count + capacity) * sizeof(FILE_ALLOCATED_RANGE_BUFFER));
+
+        DWORD returned = 0;
+        int success = DeviceIoControl(file->file, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query),
+            ranges + count, capacity * sizeof(FILE_ALLOCATED_RANGE_BUFFER), &returned, NULL);
+        int more = !success && GetLastError() == ERROR_MORE_DATA;
+
+        // the rest of the file counts as data when the filesystem can't tell
+        if (!success && !more) {
+            ranges[count++] = query;
+            break;
+        }
+
+        count += returned / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
+
+        if (!more || !returned) {
+            break;
+        }
+
+        FILE_ALLOCATED_RANGE_BUFFER* last = &ranges[count - 1];
+        query.FileOffset.QuadPart = last->FileOffset.QuadPart + last->Length.QuadPart;
+        query.Length.QuadPart = fileSize.QuadPart - query.FileOffset.QuadPart;
+        capacity *= 2;
+    }
+
+    putFile(file);
+
+    // the size, the range count, then an offset and a length for each range
+    uint64 size = sizeof(HyperVHeader) + sizeof(int64) + sizeof(uint32) + (uint64) count * 2 * sizeof(int64);
+    *outBuffer = (char*) malloc(size);
+
+    offset = writeHeader(*outBuffer, size, HYPERV_OK);
+    memcpy(*outBuffer + offset, &fileSize.QuadPart, sizeof(int64));
+
+    offset += sizeof(int64);
+    memcpy(*outBuffer + offset, &count, sizeof(uint32));
+
+    offset += sizeof(uint32);
+
+    for (uint32 i = 0; i < count; i++) {
+        memcpy(*outBuffer + offset, &ranges[i].FileOffset.QuadPart, sizeof(int64));
+
+        offset += sizeof(int64);
+        memcpy(*outBuffer + offset, &ranges[i].Length.QuadPart, sizeof(int64));
+
+        offset += sizeof(int64);
+    }
+
+    free(ranges);
+
+    return (int) size;
 }
 
 int opMkdir(char* inBuffer, char** outBuffer)
 {
-    int offset = sizeof(uint64) + sizeof(short);
+    int offset = sizeof(HyperVHeader);
     short* pathLength = (short*)(inBuffer + offset);
 
     offset += sizeof(short);
@@ -619,12 +2305,12 @@ int opMkdir(char* inBuffer, char** outBuffer)
         return opError(HYPERV_NOENT, outBuffer);
     }
 
-    return opOk(outBuffer);
+    return opAttrs(path, 1, 1, NULL, 0, outBuffer);
 }
 
 int opRmdir(char* inBuffer, char** outBuffer)
 {
-    int offset = sizeof(uint64) + sizeof(short);
+    int offset = sizeof(HyperVHeader);
     short* pathLength = (short*)(inBuffer + offset);
 
     offset += sizeof(short);
@@ -638,12 +2324,12 @@ int opRmdir(char* inBuffer, char** outBuffer)
         return opError(HYPERV_NOENT, outBuffer);
     }
 
-    return opOk(outBuffer);
+    return opAttrs(path, 0, 1, NULL, 0, outBuffer);
 }
 
 int opRename(char* inBuffer, char** outBuffer)
 {
-    int offset = sizeof(uint64) + sizeof(short);
+    int offset = sizeof(HyperVHeader);
     short* pathLength = (short*)(inBuffer + offset);
 
     offset += sizeof(short);
@@ -664,12 +2350,13 @@ int opRename(char* inBuffer, char** outBuffer)
         return opError(HYPERV_NOENT, outBuffer);
     }
 
-    return opOk(outBuffer);
+    // the client forgets about the old parent itself
+    return opAttrs(to, 1, 1, NULL, 0, outBuffer);
 }
 
 int opSymlink(char* inBuffer, char** outBuffer)
 {
-    int offset = sizeof(uint64) + sizeof(short);
+    int offset = sizeof(HyperVHeader);
     short* fromLength = (short*)(inBuffer + offset);
 
     offset += sizeof(short);
@@ -713,12 +2400,12 @@ int opSymlink(char* inBuffer, char** outBuffer)
         return opError(HYPERV_NOENT, outBuffer);
     }
 
-    return opOk(outBuffer);
+    return opAttrs(to, 1, 1, NULL, 0, outBuffer);
 }
 
 int opLink(char* inBuffer, char** outBuffer)
 {
-    int offset = sizeof(uint64) + sizeof(short);
+    int offset = sizeof(HyperVHeader);
     short* pathLength = (short*)(inBuffer + offset);
 
     offset += sizeof(short);
@@ -738,12 +2425,12 @@ int opLink(char* inBuffer, char** outBuffer)
         return opError(HYPERV_NOENT, outBuffer);
     }
 
-    return opOk(outBuffer);
+    return opAttrs(to, 1, 1, NULL, 0, outBuffer);
 }
 
 int opReadlink(char* inBuffer, char** outBuffer)
 {
-    int offset = sizeof(uint64) + sizeof(short);
+    int offset = sizeof(HyperVHeader);
     short* pathLength = (short*)(inBuffer + offset);
 
     offset += sizeof(short);
@@ -751,176 +2438,648 @@ int opReadlink(char* inBuffer, char** outBuffer)
     
     char* linkPath = makeLocalPath(ROOT, path);
     uint32 dwFlagsAndAttributes = FILE_ATTRIBUTE_REPARSE_POINT | FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_BACKUP_SEMANTICS;
-    HANDLE hFile = CreateFile(linkPath, FILE_READ_EA, FILE_SHARE_READ, NULL, OPEN_EXISTING, dwFlagsAndAttributes, NULL);
+    HANDLE hFile = CreateFile(linkPath, FILE_READ_EA, SHARE_ALL, NULL, OPEN_EXISTING, dwFlagsAndAttributes, NULL);
     free(linkPath);
 
     if (hFile == INVALID_HANDLE_VALUE) {
         return opError(HYPERV_NOENT, outBuffer);
     }
 
-    // bacause windows always complicates things
-    DWORD bytesReturned;
-    REPARSE_DATA_BUFFER* lpOutBuffer = (REPARSE_DATA_BUFFER*) malloc(MAXIMUM_REPARSE_DATA_BUFFER_SIZE);
-    DeviceIoControl(hFile, FSCTL_GET_REPARSE_POINT, NULL, 0, lpOutBuffer, MAXIMUM_REPARSE_DATA_BUFFER_SIZE, &bytesReturned, NULL);
+    short ext = 0;
+    char* targetPath = linkTarget(hFile, &ext);
     CloseHandle(hFile);
 
-    if (lpOutBuffer->ReparseTag != IO_REPARSE_TAG_SYMLINK) {
-        free(lpOutBuffer);
+    if (!targetPath) {
         return opError(HYPERV_NOENT, outBuffer);
     }
 
-    short targetLen = lpOutBuffer->SymbolicLinkReparseBuffer.PrintNameLength / sizeof(WCHAR);
-    char* targetPath = (char*) calloc(1, targetLen + 1);
-    wcstombs(targetPath, lpOutBuffer->SymbolicLinkReparseBuffer.PathBuffer, targetLen);
-    free(lpOutBuffer);
+    int status = HYPERV_OK;
+    uint64 size = sizeof(HyperVHeader) + linkSize(targetPath);
+    *outBuffer = (char*) malloc(size);
 
-    // extern paths are not translated
-    short ext = targetPath[0] == '/';
+    offset = writeHeader(*outBuffer, size, status);
+    writeLink(*outBuffer + offset, targetPath, ext);
 
-    if (!ext) {
-        char* remotePath = makeRemotePath(ROOT, targetPath);
-        free(targetPath);
-        targetPath = remotePath;
+    free(targetPath);
+
+    return size;
+}
+
+int opHello(char* inBuffer, char** outBuffer)
+{
+    int offset = sizeof(HyperVHeader);
+    short* role = (short*)(inBuffer + offset);
+
+    offset += sizeof(short);
+    short* lane = (short*)(inBuffer + offset);
+
+    offset += sizeof(short);
+    short* wanted = (short*)(inBuffer + offset);
+
+    offset += sizeof(short);
+    uint32 maxTransfer = *(uint32*)(inBuffer + offset);
+
+    offset += sizeof(uint32);
+    uint32 features = *(uint32*)(inBuffer + offset) & HYPERV_FEATURES;
+
+    if (*lane < 0 || *lane >= LANE_NUM) {
+        return opError(HYPERV_NOENT, outBuffer);
+    }
+
+    // the client gets the largest transfer both sides can do
+    if (maxTransfer > MAX_TRANSFER) {
+        maxTransfer = MAX_TRANSFER;
+    }
+
+    // the client grows and shrinks its pool on its own, we only cap it
+    short granted = MAX_SOCKET_NUM;
+
+    if (*role == HYPERV_ROLE_DATA) {
+        if (InterlockedIncrement(&dataConnections) > MAX_SOCKET_NUM) {
+            InterlockedDecrement(&dataConnections);
+            return opError(HYPERV_NOENT, outBuffer);
+        }
+
+        printf("Data connection %d opened on lane %d, client wants %d\n", (int)dataConnections, *lane, *wanted);
+    }
+
+    uint64 size = sizeof(HyperVHeader) + sizeof(short) + sizeof(uint32) + sizeof(uint32);
+    *outBuffer = (char*)malloc(size);
+
+    offset = writeHeader(*outBuffer, size, HYPERV_OK);
+    memcpy(*outBuffer + offset, &granted, sizeof(short));
+
+    offset += sizeof(short);
+    memcpy(*outBuffer + offset, &maxTransfer, sizeof(uint32));
+
+    offset += sizeof(uint32);
+    memcpy(*outBuffer + offset, &features, sizeof(uint32));
+
+    return size;
+}
+
+int recvAll(int socket, char* buffer, uint64 size)
+{
+    while (size > 0)
+    {
+        int ret = recv(socket, buffer, size > INT_MAX ? INT_MAX : (int)size, 0);
+
+        // if we read 0 bytes, connection might be closed, return
+        if (ret <= 0) {
+            return 0;
+        }
+
+        size -= ret;
+        buffer += ret;
+    }
+
+    return 1;
+}
+
+HyperVInput* openInput(SOCKET socket)
+{
+    HyperVInput* input = (HyperVInput*) malloc(sizeof(HyperVInput));
+    input->socket = socket;
+    input->start = 0;
+    input->end = 0;
+
+    return input;
+}
+
+int fillInput(HyperVInput* input)
+{
+    int ret = recv(input->socket, input->buffer, READ_AHEAD, 0);
+
+    if (ret <= 0) {
+        return 0;
+    }
+
+    input->start = 0;
+    input->end = ret;
+
+    return 1;
+}
+
+int readInput(HyperVInput* input, char* buffer, uint64 size)
+{
+    while (size > 0)
+    {
+        uint64 buffered = input->end - input->start;
+
+        if (buffered) {
+            uint64 n = buffered < size ? buffered : size;
+            memcpy(buffer, input->buffer + input->start, n);
+            input->start += (uint32)n;
+            buffer += n;
+            size -= n;
+            continue;
+        }
+
+        // large reads skip the buffer
+        if (size >= READ_AHEAD) {
+            return recvAll(input->socket, buffer, size);
+        }
+
+        if (!fillInput(input)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int skipInput(HyperVInput* input, uint64 size)
+{
+    while (size > 0)
+    {
+        uint64 buffered = input->end - input->start;
+
+        if (!buffered) {
+            if (!fillInput(input)) {
+                return 0;
+            }
+
+            continue;
+        }
+
+        uint64 n = buffered < size ? buffered : size;
+        input->start += (uint32)n;
+        size -= n;
+    }
+
+    return 1;
+}
+
+// bulk data over maxData is skipped, the message comes back without it
+// so only that request fails
+int readMessage(HyperVInput* input, char** buffer, char** data, uint64 maxData)
+{
+    HyperVHeader header;
+
+    // read the header first, it tells us where the bulk data starts
+    if (!readInput(input, (char*)&header, sizeof(HyperVHeader))) {
+        return 0;
+    }
+
+    if (header.size < sizeof(HyperVHeader) || header.dataSize > header.size - sizeof(HyperVHeader)) {
+        return 0;
+    }
+
+    // callers that don't take data get it inline
+    uint64 size = data ? header.size - header.dataSize : header.size;
+
+    *buffer = (char*)malloc(size);
+    memcpy(*buffer, &header, sizeof(HyperVHeader));
+
+    if (!readInput(input, *buffer + sizeof(HyperVHeader), size - sizeof(HyperVHeader))) {
+        free(*buffer);
+        return 0;
+    }
+
+    if (!data || !header.dataSize) {
+        return (int)header.size;
+    }
+
+    if (header.dataSize > maxData) {
+        if (!skipInput(input, header.dataSize)) {
+            free(*buffer);
+            return 0;
+        }
+
+        return (int)header.size;
+    }
+
+    // bulk data goes straight into a pooled buffer, ready for the disk
+    *data = aquireBuffer(header.dataSize);
+
+    if (!readInput(input, *data, header.dataSize)) {
+        releaseBuffer(*data);
+        free(*buffer);
+        return 0;
+    }
+
+    return (int)header.size;
+}
+
+int sendAll(SOCKET socket, WSABUF* bufs, DWORD count)
+{
+    while (count > 0)
+    {
+        DWORD sent = 0;
+
+        if (WSASend(socket, bufs, count, &sent, 0, NULL, NULL) == SOCKET_ERROR || sent == 0) {
+            return 0;
+        }
+
+        // skip what was sent, a send can stop anywhere
+        while (count > 0 && sent >= bufs->len) {
+            sent -= bufs->len;
+            bufs++;
+            count--;
+        }
+
+        if (count > 0) {
+            bufs->buf += sent;
+            bufs->len -= sent;
+        }
+    }
+
+    return 1;
+}
+
+int sendMessage(int socket, char* buffer)
+{
+    uint64 *size = (uint64*) buffer;
+    WSABUF buf = { (ULONG) *size, buffer };
+
+    if (!sendAll(socket, &buf, 1)) {
+        return 0;
+    }
+
+    return (int) *size;
+}
+
+void flushReplies(HyperVConnection* conn)
+{
+    PSLIST_ENTRY entry = InterlockedFlushSList(&conn->replies);
+    PSLIST_ENTRY ordered = NULL;
+
+    // the list comes out newest first
+    while (entry) {
+        PSLIST_ENTRY next = entry->Next;
+        entry->Next = ordered;
+        ordered = entry;
+        entry = next;
     }
 
-    int status = HYPERV_OK;
-    targetLen = strlen(targetPath) + 1;
-    uint64 size = sizeof(uint64) + sizeof(short) + sizeof(short) + sizeof(short) + targetLen;
-    *outBuffer = (char*) malloc(size);
+    while (ordered) {
+        WSABUF bufs[SEND_BATCH];
+        HyperVReply* batch[SEND_BATCH];
+        DWORD count = 0;
 
-    offset = 0;
-    memcpy(*outBuffer + offset, &size, sizeof(uint64));
+        for (; ordered && count < SEND_BATCH; count++) {
+            batch[count] = (HyperVReply*) ordered;
+            bufs[count].buf = batch[count]->buffer;
+            bufs[count].len = (ULONG) ((HyperVHeader*) batch[count]->buffer)->size;
+            ordered = ordered->Next;
+        }
 
-    offset += sizeof(uint64);
-    memcpy(*outBuffer + offset, &status, sizeof(short));
+        // if this fails the client is gone, the reader notices that
+        sendAll(conn->socket, bufs, count);
 
-    offset += sizeof(short);
-    memcpy(*outBuffer + offset, &ext, sizeof(short));
+        for (DWORD i = 0; i < count; i++) {
+            releaseBuffer(batch[i]->buffer);
+            _aligned_free(batch[i]);
+        }
+    }
+}
 
-    offset += sizeof(short);
-    memcpy(*outBuffer + offset, &targetLen, sizeof(short));
+void queueReply(HyperVConnection* conn, char* buffer)
+{
+    HyperVReply* reply = (HyperVReply*) _aligned_malloc(sizeof(HyperVReply), MEMORY_ALLOCATION_ALIGNMENT);
+    reply->buffer = buffer;
 
-    offset += sizeof(short);
-    memcpy(*outBuffer + offset, targetPath, targetLen);
+    InterlockedPushEntrySList(&conn->replies, &reply->entry);
 
-    free(targetPath);
+    // whoever gets the lock sends everything queued, and checks again after
+    // letting go, so a reply queued while it was sending is never left behind
+    while (QueryDepthSList(&conn->replies) > 0 && TryEnterCriticalSection(&conn->sendLock)) {
+        flushReplies(conn);
+        LeaveCriticalSection(&conn->sendLock);
+    }
+}
 
-    return size;
+// match the reply to the request, the client can have many in flight
+void stampReply(char* inBuffer, char* outBuffer)
+{
+    HyperVHeader* header = (HyperVHeader*) inBuffer;
+    HyperVHeader* reply = (HyperVHeader*) outBuffer;
+
+    reply->id = header->id;
+    reply->op = header->op;
 }
 
-int readMessage(int socket, char** buffer)
+// swaps the bulk data of a reply for its compressed form, when that saves enough
+void compressReply(HyperVConnection* conn, char** outBuffer)
 {
-    uint64 size = 0;
-    char sizeBuffer[sizeof(uint64)];
+#if defined LZ4
+    HyperVHeader* header = (HyperVHeader*) *outBuffer;
+
+    if (!(conn->features & HYPERV_FEATURE_LZ4) || header->dataSize < COMPRESS_MIN) {
+        return;
+    }
 
-    int ret = recv(socket, sizeBuffer, sizeof(uint64), MSG_WAITALL);
+    uint64 headSize = header->size - header->dataSize;
+    int rawSize = (int) header->dataSize;
+    int limit = rawSize - rawSize / 16;
+    char* compressed = aquireBuffer(headSize + limit);
 
-    // if we read 0 bytes, connection might be closed, return
-    if (ret <= 0) {
-        return 0;
+    // it gives up once the output would not fit, then the data goes raw
+    int size = LZ4_compress_default(*outBuffer + headSize, compressed + headSize, rawSize, limit);
+    InterlockedAdd64(&conn->rawBytes, rawSize);
+
+    if (size <= 0) {
+        InterlockedAdd64(&conn->wireBytes, rawSize);
+        releaseBuffer(compressed);
+        return;
     }
 
-    memcpy(&size, sizeBuffer, sizeof(uint64));
+    InterlockedAdd64(&conn->wireBytes, size);
+    memcpy(compressed, *outBuffer, headSize);
+    releaseBuffer(*outBuffer);
+    *outBuffer = compressed;
 
-    *buffer = (char*)malloc(size);
-    memcpy(*buffer, sizeBuffer, sizeof(uint64));
+    header = (HyperVHeader*) compressed;
+    header->flags |= HYPERV_FLAG_COMPRESSED;
+    header->rawSize = rawSize;
+    header->dataSize = size;
+    header->size = headSize + size;
+#endif
+}
 
-    uint64 rOffset = sizeof(uint64);
-    uint64 rSize = size - rOffset;
+int decompressData(HyperVConnection* conn, char* inBuffer, char** data)
+{
+    HyperVHeader* header = (HyperVHeader*) inBuffer;
 
-    while (rSize > 0)
-    {
-        ret = recv(socket, *buffer + rOffset, rSize, 0);
+    if (!(header->flags & HYPERV_FLAG_COMPRESSED)) {
+        return 1;
+    }
 
-        // if we read 0 bytes, connection might be closed, return
-        if (ret <= 0) {
-            free(buffer);
-            return 0;
-        }
+#if defined LZ4
+    if (!*data || header->rawSize > conn->maxTransfer) {
+        return 0;
+    }
+
+    char* raw = aquireBuffer(header->rawSize);
+    int size = LZ4_decompress_safe(*data, raw, (int) header->dataSize, (int) header->rawSize);
 
-        rSize -= ret;
-        rOffset += ret;
+    if (size != (int) header->rawSize) {
+        releaseBuffer(raw);
+        return 0;
     }
 
-    return size;
-}
+    InterlockedAdd64(&conn->rawBytes, size);
+    InterlockedAdd64(&conn->wireBytes, header->dataSize);
+    releaseBuffer(*data);
+    *data = raw;
 
-int sendMessage(int socket, char* buffer)
-{
-    uint64 *size = (uint64*) buffer;
+    header->size += header->rawSize - header->dataSize;
+    header->dataSize = header->rawSize;
+    header->flags &= ~HYPERV_FLAG_COMPRESSED;
 
-    return send(socket, buffer, *size, 0);
+    return 1;
+#else
+    return 0;
+#endif
 }
 
-int processMessage(char* inBuffer, char** outBuffer)
+int opCompound(HyperVSession* session, char* inBuffer, char** outBuffer);
+
+int processMessage(HyperVSession* session, char* inBuffer, char* data, char** outBuffer)
 {
-    // get the op code
-    short *op = (short*) (inBuffer + sizeof(uint64));
+    HyperVHeader* header = (HyperVHeader*) inBuffer;
+    int size = 0;
 
-    switch (*op)
+    switch (header->op)
     {
     case HYPERV_ATTR:
-        return opReadAttr(inBuffer, outBuffer);
+        size = opReadAttr(inBuffer, outBuffer);
+        break;
     case HYPERV_READDIR:
-        return opReadDir(inBuffer, outBuffer);
+        size = opReadDir(inBuffer, outBuffer);
+        break;
     case HYPERV_READ:
-        return opRead(inBuffer, outBuffer);
+        size = opRead(session, inBuffer, outBuffer);
+        break;
     case HYPERV_CREATE:
-        return opCreate(inBuffer, outBuffer);
+        size = opCreate(inBuffer, outBuffer);
+        break;
     case HYPERV_WRITE:
-        return opWrite(inBuffer, outBuffer);
+        size = opWrite(session, inBuffer, data, outBuffer);
+        break;
     case HYPERV_UNLINK:
-        return opUnlink(inBuffer, outBuffer);
+        size = opUnlink(inBuffer, outBuffer);
+        break;
     case HYPERV_TRUNCATE:
-        return opTruncate(inBuffer, outBuffer);
+        size = opTruncate(session, inBuffer, outBuffer);
+        break;
     case HYPERV_MKDIR:
-        return opMkdir(inBuffer, outBuffer);
+        size = opMkdir(inBuffer, outBuffer);
+        break;
     case HYPERV_RMDIR:
-        return opRmdir(inBuffer, outBuffer);
+        size = opRmdir(inBuffer, outBuffer);
+        break;
     case HYPERV_RENAME:
-        return opRename(inBuffer, outBuffer);
+        size = opRename(inBuffer, outBuffer);
+        break;
     case HYPERV_SYMLINK:
-        return opSymlink(inBuffer, outBuffer);
+        size = opSymlink(inBuffer, outBuffer);
+        break;
     case HYPERV_LINK:
-        return opLink(inBuffer, outBuffer);
+        size = opLink(inBuffer, outBuffer);
+        break;
     case HYPERV_READLINK:
-        return opReadlink(inBuffer, outBuffer);
+        size = opReadlink(inBuffer, outBuffer);
+        break;
+    case HYPERV_HELLO:
+        size = opHello(inBuffer, outBuffer);
+        break;
+    case HYPERV_COMPOUND:
+        size = opCompound(session, inBuffer, outBuffer);
+        break;
+    case HYPERV_CREATE_WITH_DATA:
+        size = opCreateWithData(inBuffer, data, outBuffer);
+        break;
+    case HYPERV_OPEN:
+        size = opOpen(session, inBuffer, outBuffer);
+        break;
+    case HYPERV_RELEASE:
+        size = opRelease(session, inBuffer, outBuffer);
+        break;
+    case HYPERV_COPY:
+        size = opCopy(session, inBuffer, outBuffer);
+        break;
+    case HYPERV_FALLOCATE:
+        size = opFallocate(session, inBuffer, outBuffer);
+        break;
+    case HYPERV_QUERY_RANGES:
+        size = opQueryRanges(session, inBuffer, outBuffer);
+        break;
+    case HYPERV_WALK:
+        size = opWalk(inBuffer, outBuffer);
+        break;
+    case HYPERV_BULK_STAT:
+        size = opBulkStat(inBuffer, outBuffer);
+        break;
+    case HYPERV_BULK_READ:
+        size = opBulkRead(inBuffer, outBuffer);
+        break;
+    case HYPERV_RMTREE:
+        size = opRmTree(inBuffer, outBuffer);
+        break;
+    case HYPERV_COPYTREE:
+        size = opCopyTree(inBuffer, outBuffer);
+        break;
     default:
-        return opError(HYPERV_NOENT, outBuffer);
+        size = opError(HYPERV_NOENT, outBuffer);
+        break;
     }
+
+    stampReply(inBuffer, *outBuffer);
+
+    return size;
 }
 
-DWORD WINAPI handleOp (void* arg)
+void releaseConnection(HyperVConnection* conn)
 {
-    uint64 sClient = *((uint64*)arg);
-    int ret = 0;
+    if (InterlockedDecrement(&conn->refs) == 0) {
+        SetEvent(conn->idle);
+    }
+}
 
-    do
-    {
-        char* inBuffer = NULL;
-        char* outBuffer = NULL;
+// runs whole request messages one after the other, and replies with all their replies,
+// sub ops can't carry bulk data and can't be compounds themselves
+int opCompound(HyperVSession* session, char* inBuffer, char** outBuffer)
+{
+    HyperVHeader* header = (HyperVHeader*) inBuffer;
+    int offset = sizeof(HyperVHeader);
+
+    if (header->size < sizeof(HyperVHeader) + sizeof(short)) {
+        return opError(HYPERV_INVAL, outBuffer);
+    }
 
-        ret = readMessage(sClient, &inBuffer);
+    short count = *(short*)(inBuffer + offset);
 
-        if (ret <= 0) {
-            goto cleanup;
+    offset += sizeof(short);
+
+    if (count < 0 || count > COMPOUND_MAX) {
+        return opError(HYPERV_INVAL, outBuffer);
+    }
+
+    char* replies[COMPOUND_MAX];
+    uint64 size = sizeof(HyperVHeader) + sizeof(short);
+    int done = 0;
+
+    for (; done < count; done++) {
+        HyperVHeader* sub = (HyperVHeader*)(inBuffer + offset);
+        uint64 left = header->size - offset;
+
+        // the sub op header and all it says it holds must be in what is left
+        if (left < sizeof(HyperVHeader) || sub->size < sizeof(HyperVHeader) || sub->size > left) {
+            break;
+        }
+
+        if (sub->dataSize || sub->op == HYPERV_COMPOUND || sub->op == HYPERV_HELLO) {
+            opError(HYPERV_INVAL, &replies[done]);
+            stampReply((char*) sub, replies[done]);
+        } else {
+            processMessage(session, (char*) sub, NULL, &replies[done]);
         }
 
-        ret = processMessage(inBuffer, &outBuffer);
-        ret = sendMessage(sClient, outBuffer);
+        size += ((HyperVHeader*) replies[done])->size;
+        offset += (int) sub->size;
+    }
 
-    cleanup:
-        if (inBuffer) {
-            free(inBuffer);
+    // a sub op running past the end means the whole message is garbage
+    if (done < count) {
+        for (int i = 0; i < done; i++) {
+            releaseBuffer(replies[i]);
         }
 
-        if (outBuffer) {
-            free(outBuffer);
+        return opError(HYPERV_INVAL, outBuffer);
+    }
+
+    *outBuffer = (char*) malloc(size);
+
+    offset = writeHeader(*outBuffer, size, HYPERV_OK);
+    memcpy(*outBuffer + offset, &count, sizeof(short));
+    offset += sizeof(short);
+
+    for (int i = 0; i < count; i++) {
+        HyperVHeader* reply = (HyperVHeader*) replies[i];
+
+        memcpy(*outBuffer + offset, replies[i], reply->size);
+        offset += (int) reply->size;
+        releaseBuffer(replies[i]);
+    }
+
+    return (int) size;
+}
+
+void CALLBACK processWork(PTP_CALLBACK_INSTANCE instance, void* arg)
+{
+    HyperVWork* work = (HyperVWork*) arg;
+    HyperVConnection* conn = work->conn;
+    char* outBuffer = NULL;
+
+    // data that was too large to take was dropped by the reader, and
+    // compressed data is unpacked and packed here, not on the reader thread
+    if ((work->data || !((HyperVHeader*) work->inBuffer)->dataSize) && decompressData(conn, work->inBuffer, &work->data)) {
+        processMessage(conn->session, work->inBuffer, work->data, &outBuffer);
+        compressReply(conn, &outBuffer);
+    } else {
+        opError(HYPERV_INVAL, &outBuffer);
+        stampReply(work->inBuffer, outBuffer);
+    }
+
+    // replies from different workers are batched, and never interleave on the socket
+    queueReply(conn, outBuffer);
+
+    free(work->inBuffer);
+    releaseBuffer(work->data);
+    free(work);
+
+    releaseConnection(conn);
+}
+
+void handleOp(HyperVInput* input, short lane, uint32 features, uint32 maxTransfer, HyperVSession* session)
+{
+    HyperVConnection conn = { 0 };
+    conn.socket = input->socket;
+    conn.session = session;
+    conn.features = features;
+    conn.maxTransfer = maxTransfer;
+    conn.env = &laneEnv[lane];
+    conn.refs = 1;
+    conn.idle = CreateEvent(NULL, true, false, NULL);
+    InitializeSListHead(&conn.replies);
+    InitializeCriticalSection(&conn.sendLock);
+
+    // keep reading, the requests are processed on the thread pool
+    // and the replies are sent back in the order they complete
+    for (;;)
+    {
+        char* inBuffer = NULL;
+        char* data = NULL;
+
+        if (readMessage(input, &inBuffer, &data, conn.maxTransfer) <= 0) {
+            break;
         }
 
-    } while (ret > 0);
+        HyperVWork* work = (HyperVWork*) malloc(sizeof(HyperVWork));
+        work->conn = &conn;
+        work->inBuffer = inBuffer;
+        work->data = data;
 
-    return 0;
+        InterlockedIncrement(&conn.refs);
+
+        if (!TrySubmitThreadpoolCallback(processWork, work, conn.env)) {
+            processWork(NULL, work);
+        }
+    }
+
+    // wait for the requests still in flight before the connection goes away
+    releaseConnection(&conn);
+    WaitForSingleObject(conn.idle, INFINITE);
+
+    CloseHandle(conn.idle);
+    DeleteCriticalSection(&conn.sendLock);
+
+    if (conn.rawBytes) {
+        printf("Compressed %lld bytes to %lld (%.1f%%)\n", (long long) conn.rawBytes, (long long) conn.wireBytes, 100.0 * conn.wireBytes / conn.rawBytes);
+    }
+
+    printf("Data connection closed\n");
 }
 
 DWORD WINAPI detectChanges(void* arg)
@@ -983,17 +3142,240 @@ out:
     return 0;
 }
 
-void closeClientSockets()
+void initLanes()
 {
-    for (int i = 0; i < SOCKET_NUM; i++) {
-        closesocket(sClients[i]);
-        printf("Client socket closed\n");
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    for (int lane = 0; lane < LANE_NUM; lane++) {
+        lanePool[lane] = CreateThreadpool(NULL);
+        InitializeThreadpoolEnvironment(&laneEnv[lane]);
+        SetThreadpoolCallbackPool(&laneEnv[lane], lanePool[lane]);
     }
 
-    closesocket(dClient);
+    // the lanes don't share threads, so metadata ops never queue behind bulk
+    // transfers, they are short, keep threads around for them
+    SetThreadpoolThreadMinimum(lanePool[HYPERV_LANE_META], 2);
+    SetThreadpoolThreadMaximum(lanePool[HYPERV_LANE_META], info.dwNumberOfProcessors * 2);
+
+    // bulk transfers mostly wait on the disk, cap them so they can't starve the cpu
+    SetThreadpoolThreadMaximum(lanePool[HYPERV_LANE_BULK], info.dwNumberOfProcessors);
+}
+
+void handleChanges(SOCKET sClient)
+{
+    HANDLE hDir = CreateFile(
+        ROOT, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL
+    );
+
+    HyperVWatch watch = { sClient, hDir };
+    HANDLE dThread = CreateThread(NULL, 0, detectChanges, (void*)&watch, 0, NULL);
+    printf("Change socket connected\n");
+
+    // the client never writes here, so this returns once it goes away
+    char buffer;
+    while (recv(sClient, &buffer, 1, 0) > 0);
+
+    // stop the change detection theread
+    CancelIoEx(hDir, NULL);
+    WaitForSingleObject(dThread, INFINITE);
+    CloseHandle(dThread);
+    CloseHandle(hDir);
+
     printf("Change socket closed\n");
 }
 
+DWORD WINAPI handleConnection(void* arg)
+{
+    int slot = (int)(intptr_t)arg;
+    SOCKET sClient = sClients[slot];
+    HyperVInput* input = openInput(sClient);
+    char* inBuffer = NULL;
+    char* outBuffer = NULL;
+    short role = 0;
+    short lane = 0;
+    uint32 features = 0;
+    uint32 maxTransfer = 0;
+    HyperVSession* session = NULL;
+    int counted = 0;
+
+    // the first message says what the connection is for
+    if (readMessage(input, &inBuffer, NULL, 0) <= 0 || ((HyperVHeader*)inBuffer)->op != HYPERV_HELLO) {
+        goto out;
+    }
+
+    role = *(short*)(inBuffer + sizeof(HyperVHeader));
+    lane = *(short*)(inBuffer + sizeof(HyperVHeader) + sizeof(short));
+    processMessage(NULL, inBuffer, NULL, &outBuffer);
+    counted = role == HYPERV_ROLE_DATA && ((HyperVHeader*)outBuffer)->status == HYPERV_OK;
+
+    if (sendMessage(sClient, outBuffer) <= 0 || ((HyperVHeader*)outBuffer)->status != HYPERV_OK) {
+        goto out;
+    }
+
+    maxTransfer = *(uint32*)(outBuffer + sizeof(HyperVHeader) + sizeof(short));
+    features = *(uint32*)(outBuffer + sizeof(HyperVHeader) + sizeof(short) + sizeof(uint32));
+
+    if (role == HYPERV_ROLE_CHANGE) {
+        handleChanges(sClient);
+    } else {
+        // the session id follows the features
+        session = joinSession(*(uint64*)(inBuffer + sizeof(HyperVHeader) + 3 * sizeof(short) + 2 * sizeof(uint32)));
+        handleOp(input, lane, features, maxTransfer, session);
+    }
+
+out:
+    free(input);
+    free(inBuffer);
+    free(outBuffer);
+
+    if (counted) {
+        InterlockedDecrement(&dataConnections);
+    }
+
+    if (session) {
+        leaveSession(session);
+    }
+
+    EnterCriticalSection(&clientsLock);
+    sClients[slot] = 0;
+    LeaveCriticalSection(&clientsLock);
+
+    closesocket(sClient);
+
+    return 0;
+}
+
+int registerClient(SOCKET sClient)
+{
+    int slot = -1;
+
+    EnterCriticalSection(&clientsLock);
+
+    for (int i = 0; i < MAX_SOCKET_NUM + 1; i++) {
+        if (!sClients[i]) {
+            sClients[i] = sClient;
+            slot = i;
+            break;
+        }
+    }
+
+    LeaveCriticalSection(&clientsLock);
+
+    return slot;
+}
+
+void closeClientSockets()
+{
+    EnterCriticalSection(&clientsLock);
+
+    // the connection threads close the sockets once they see this
+    for (int i = 0; i < MAX_SOCKET_NUM + 1; i++) {
+        if (sClients[i]) {
+            shutdown(sClients[i], SD_BOTH);
+            printf("Client socket closed\n");
+        }
+    }
+
+    LeaveCriticalSection(&clientsLock);
+}
+
+SOCKET listenOn(int family, int protocol, struct sockaddr* addr, int addrSize)
+{
+    SOCKET sock = socket(family, SOCK_STREAM, protocol);
+    Log(sock != INVALID_SOCKET, "server socket", 0);
+
+    if (sock == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+
+    int ret = bind(sock, addr, addrSize);
+    Log(ret, "bind");
+
+    if (ret == 0) {
+        ret = listen(sock, MAX_SOCKET_NUM + 1);
+        Log(ret, "listen");
+    }
+
+    if (ret != 0) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+
+    return sock;
+}
+
+int toPort(const char* address)
+{
+    return address ? atoi(address) : PORT_NUM;
+}
+
+#if defined VMWARE
+SOCKET listenVmware(const char* address)
+{
+    int family = VMCISock_GetAFValue();
+    struct sockaddr_vm addr = { 0 };
+    addr.svm_family = family;
+    addr.svm_cid = VMADDR_CID_HOST;
+    addr.svm_port = toPort(address);
+
+    return listenOn(family, 0, (struct sockaddr*)&addr, sizeof addr);
+}
+#elif !defined VMNET
+SOCKET listenHyperV(const char* address)
+{
+    SOCKADDR_HV addr = { 0 };
+    addr.Family = AF_HYPERV;
+    addr.ServiceId = HV_GUID_VSOCK_TEMPLATE;
+    addr.ServiceId.Data1 = toPort(address);
+
+    return listenOn(AF_HYPERV, HV_PROTOCOL_RAW, (struct sockaddr*)&addr, sizeof addr);
+}
+#endif
+
+SOCKET listenTcp(const char* address)
+{
+    struct sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(toPort(address));
+
+    return listenOn(AF_INET, 0, (struct sockaddr*)&addr, sizeof addr);
+}
+
+SOCKET listenUnix(const char* address)
+{
+    SOCKADDR_UN addr = { 0 };
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, address ? address : SOCKET_PATH, sizeof addr.sun_path - 1);
+
+    // a socket file left over from the last run makes bind fail
+    DeleteFile(addr.sun_path);
+
+    return listenOn(AF_UNIX, 0, (struct sockaddr*)&addr, sizeof addr);
+}
+
+const HyperVTransport transports[] = {
+#if defined VMWARE
+    { "vmware", listenVmware, 0 },
+#elif !defined VMNET
+    { "hyperv", listenHyperV, 0 },
+#endif
+    { "tcp", listenTcp, 1 },
+    { "unix", listenUnix, 0 },
+};
+
+const HyperVTransport* findTransport(const char* name)
+{
+    for (size_t i = 0; i < sizeof transports / sizeof transports[0]; i++) {
+        if (strcmp(transports[i].name, name) == 0) {
+            return &transports[i];
+        }
+    }
+
+    return NULL;
+}
+
 BOOL WINAPI ctrlHandler(DWORD type)
 {
     switch (type)
@@ -1019,96 +3401,70 @@ BOOL WINAPI ctrlHandler(DWORD type)
     }
 }
 
-int main(void)
+// usage: HyperVSocks [hyperv|vmware|tcp|unix] [port or socket path]
+int main(int argc, char* argv[])
 {
+    const char* name = argc > 1 ? argv[1] : DEFAULT_TRANSPORT;
+    const HyperVTransport* transport = findTransport(name);
+
+    if (!transport) {
+        printf("Unknown transport %s\n", name);
+        return 1;
+    }
+
     if (!SetConsoleCtrlHandler(ctrlHandler, true)) {
         return 1;
     }
 
+    InitializeCriticalSection(&clientsLock);
+    InitializeCriticalSection(&sessionsLock);
+    initLanes();
+    initBuffers();
+
     WSADATA wdata;
     int ret = WSAStartup(MAKEWORD(2,2), &wdata);
     Log(ret, "WSAStartup");
 
-#if defined VMWARE
-    int family = VMCISock_GetAFValue();
-    int protocol = 0;
-    struct sockaddr_vm addr = { 0 };
-    addr.svm_family = family;
-    addr.svm_cid = VMADDR_CID_HOST;
-    addr.svm_port = PORT_NUM;
-#elif defined VMNET
-    int family = AF_INET;
-    int protocol = 0;
-    struct sockaddr_in addr = { 0 };
-    addr.sin_family = family;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(PORT_NUM);
-#else
-    int family = AF_HYPERV;
-    int protocol = HV_PROTOCOL_RAW;
-    SOCKADDR_HV addr = { 0 };
-    addr.Family = family;
-    addr.ServiceId = HV_GUID_VSOCK_TEMPLATE;
-    addr.ServiceId.Data1 = PORT_NUM;
-#endif
-
-    sServer = socket(family, SOCK_STREAM, protocol);
-    Log(sServer, "server socket", 0);
-
-    ret = bind(sServer, (struct sockaddr*)&addr, sizeof addr);
-    Log(ret, "bind");
-
-    ret = listen(sServer, SOCKET_NUM + 1);
-    Log(ret, "listen");
+    printf("Listening on %s\n", transport->name);
+    sServer = transport->listen(argc > 2 ? argv[2] : NULL);
 
-    HANDLE dThread = 0;
-    HANDLE hDir = CreateFile(
-        ROOT, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL
-    );
-
-    HANDLE threads[SOCKET_NUM] = { 0 };
-    HyperVWatch watch = { 0 };
+    if (sServer == INVALID_SOCKET) {
+        WSACleanup();
+        return 1;
+    }
 
-accept:
-    for (int i = 0; i < SOCKET_NUM; i++) {
-        sClients[i] = accept(sServer, NULL, NULL);
+    // connections come and go as the client resizes its pool
+    for (;;) {
+        SOCKET sClient = accept(sServer, NULL, NULL);
 
         if (shuttingDown) {
             goto out;
         }
 
-        printf("Client socket connected\n");
-        threads[i] = CreateThread(NULL, 0, handleOp, (void*)&sClients[i], 0, NULL);
-    }
-
-    // accept the change detection socket
-    dClient = accept(sServer, NULL, NULL);
-    printf("Change socket connected\n");
-    watch = { dClient, hDir };
-    dThread = CreateThread(NULL, 0, detectChanges, (void*)&watch, 0, NULL);
+        if (sClient == INVALID_SOCKET) {
+            continue;
+        }
 
-    // wait untill the client disconnects
-    WaitForMultipleObjects(SOCKET_NUM, threads, true, INFINITE);
+        // small replies must not wait for the next send
+        if (transport->noDelay) {
+            BOOL noDelay = true;
+            setsockopt(sClient, IPPROTO_TCP, TCP_NODELAY, (char*)&noDelay, sizeof noDelay);
+        }
 
-    // cleanup threads
-    for (int i = 0; i < SOCKET_NUM; i++) {
-        CloseHandle(threads[i]);
-    }
+        int slot = registerClient(sClient);
 
-    // stop the change detection theread
-    CancelIoEx(hDir, NULL);
-    WaitForSingleObject(dThread, INFINITE);
-    CloseHandle(dThread);
+        if (slot < 0) {
+            printf("Too many client sockets\n");
+            closesocket(sClient);
+            continue;
+        }
 
-    if (!shuttingDown) {
-        // close sockets, accept new client
-        closeClientSockets();
-        goto accept;
+        printf("Client socket connected\n");
+        CloseHandle(CreateThread(NULL, 0, handleConnection, (void*)(intptr_t)slot, 0, NULL));
     }
 
 out:
     printf("Shutting down...\n");
-    CloseHandle(hDir);
     WSACleanup();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,69 @@
+/**
+ * Warms the content cache of a hypervfs mount, through its prefetch ioctl.
+ * Build it into a tool with
+ *
+ * gcc -Wall -x c Prefetch.cpp RootPath.cpp PrefetchTool.cpp -o hypervprefetch
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "Prefetch.h"
+
+int hypervPrefetch(const char* mountpoint, const char** paths, int count, uint64_t maxFileSize,
+	uint64_t* files, uint64_t* bytes)
+{
+	int fd = open(mountpoint, O_RDONLY | O_DIRECTORY);
+
+	if (fd < 0) {
+		return errno;
+	}
+
+	HyperVPrefetch request;
+	int done = 0;
+	int err = 0;
+
+	*files = 0;
+	*bytes = 0;
+
+	while (done < count) {
+		request.maxFileSize = maxFileSize;
+		request.count = 0;
+		request.size = 0;
+
+		// as many paths as fit, a directory is a single path however big it is
+		while (done < count) {
+			int length = strlen(paths[done]) + 1;
+
+			if (request.size + length > PREFETCH_BUFFER) {
+				break;
+			}
+
+			memcpy(request.buffer + request.size, paths[done], length);
+			request.size += length;
+			request.count++;
+			done++;
+		}
+
+		if (!request.count) {
+			err = ENAMETOOLONG;
+			break;
+		}
+
+		if (ioctl(fd, HYPERVFS_IOC_PREFETCH, &request) < 0) {
+			err = errno;
+			break;
+		}
+
+		*files += request.files;
+		*bytes += request.bytes;
+	}
+
+	close(fd);
+
+	return err;
+}
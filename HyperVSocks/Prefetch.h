@@ -0,0 +1,28 @@
+#ifndef HYPERVFS_PREFETCH_H
+#define HYPERVFS_PREFETCH_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define PREFETCH_BUFFER (4 * 1024 - 32)
+
+// count paths go in as null terminated strings relative to the mount root,
+// directories are fetched with everything under them, files over maxFileSize
+// are left out, 0 takes the client's default, files and bytes say what was cached
+typedef struct {
+	uint64_t maxFileSize;
+	uint64_t bytes;
+	uint32_t files;
+	uint32_t count;
+	uint32_t size;
+	char buffer[PREFETCH_BUFFER];
+} HyperVPrefetch;
+
+#define HYPERVFS_IOC_PREFETCH _IOWR('H', 2, HyperVPrefetch)
+
+// fetches the content of count paths under a mounted hypervfs into its cache,
+// returns 0 or an errno value, files and bytes add up what was cached
+int hypervPrefetch(const char* mountpoint, const char** paths, int count, uint64_t maxFileSize,
+	uint64_t* files, uint64_t* bytes);
+
+#endif
@@ -0,0 +1,66 @@
+/**
+ * hypervprefetch [-s MAX_FILE_SIZE] MOUNTPOINT PATH...
+ *
+ * Fetches the content of every file under the given paths into the client's
+ * cache in a few large replies, like a whole vendor/ tree after a mount. Paths
+ * are taken relative to the mount root, or as full paths under the mountpoint.
+ * Compile with
+ *
+ * gcc -Wall -x c Prefetch.cpp RootPath.cpp PrefetchTool.cpp -o hypervprefetch
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "Prefetch.h"
+#include "RootPath.h"
+
+int main(int argc, char* argv[])
+{
+	uint64_t maxFileSize = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:")) != -1) {
+		if (opt != 's') {
+			break;
+		}
+
+		maxFileSize = strtoull(optarg, NULL, 10);
+	}
+
+	if (argc - optind < 2) {
+		fprintf(stderr, "usage: %s [-s MAX_FILE_SIZE] MOUNTPOINT PATH...\n", argv[0]);
+		return 2;
+	}
+
+	const char* mountpoint = argv[optind];
+	int count = argc - optind - 1;
+	char** paths = (char**)malloc(count * sizeof(char*));
+
+	for (int i = 0; i < count; i++) {
+		paths[i] = rootPath(mountpoint, argv[optind + 1 + i]);
+	}
+
+	uint64_t files = 0;
+	uint64_t bytes = 0;
+	int err = hypervPrefetch(mountpoint, (const char**)paths, count, maxFileSize, &files, &bytes);
+
+	for (int i = 0; i < count; i++) {
+		free(paths[i]);
+	}
+
+	free(paths);
+
+	if (err) {
+		fprintf(stderr, "%s: %s\n", mountpoint, strerror(err));
+		return 1;
+	}
+
+	printf("Cached %llu files, %llu bytes\n", (unsigned long long)files, (unsigned long long)bytes);
+
+	return 0;
+}
@@ -0,0 +1,30 @@
+/**
+ * Turns the paths given to the hypervfs tools into paths from the mount root.
+ * Compiled into every tool, see their headers.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "RootPath.h"
+
+char* rootPath(const char* mountpoint, const char* path)
+{
+	int length = strlen(mountpoint);
+
+	while (length > 1 && mountpoint[length - 1] == '/') {
+		length--;
+	}
+
+	if (strncmp(path, mountpoint, length) == 0 && (path[length] == '/' || !path[length])) {
+		path += length;
+	}
+
+	char* relative = (char*)malloc(strlen(path) + 2);
+	sprintf(relative, "%s%s", path[0] == '/' ? "" : "/", path);
+
+	return relative;
+}
@@ -0,0 +1,9 @@
+#ifndef HYPERVFS_ROOT_PATH_H
+#define HYPERVFS_ROOT_PATH_H
+
+// the path as the mount root sees it, always starting with a slash, path is
+// relative to the mount root or a full path under the mountpoint, the result
+// is malloc'ed
+char* rootPath(const char* mountpoint, const char* path);
+
+#endif
@@ -0,0 +1,83 @@
+/**
+ * hypervstat MOUNTPOINT [PATH...]
+ *
+ * Prints the mode, size and mtime of every path, read from stdin, one per line,
+ * when none are given. Paths are taken relative to the mount root, or as full
+ * paths under the mountpoint. Compile with
+ *
+ * gcc -Wall -x c BulkStat.cpp RootPath.cpp StatTool.cpp -o hypervstat
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "BulkStat.h"
+#include "RootPath.h"
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s MOUNTPOINT [PATH...]\n", argv[0]);
+		return 2;
+	}
+
+	const char* mountpoint = argv[1];
+	char** paths = NULL;
+	int count = 0;
+
+	if (argc > 2) {
+		paths = (char**)malloc((argc - 2) * sizeof(char*));
+
+		for (int i = 2; i < argc; i++) {
+			paths[count++] = rootPath(mountpoint, argv[i]);
+		}
+	} else {
+		char* line = NULL;
+		size_t capacity = 0;
+		ssize_t length;
+
+		while ((length = getline(&line, &capacity, stdin)) > 0) {
+			if (line[length - 1] == '\n') {
+				line[--length] = '\0';
+			}
+
+			if (!length) {
+				continue;
+			}
+
+			paths = (char**)realloc(paths, (count + 1) * sizeof(char*));
+			paths[count++] = rootPath(mountpoint, line);
+		}
+
+		free(line);
+	}
+
+	HyperVBulkEntry* entries = (HyperVBulkEntry*)calloc(count ? count : 1, sizeof(HyperVBulkEntry));
+	int err = hypervBulkStat(mountpoint, (const char**)paths, count, entries);
+
+	if (err) {
+		fprintf(stderr, "%s: %s\n", mountpoint, strerror(err));
+		return 1;
+	}
+
+	int missing = 0;
+
+	for (int i = 0; i < count; i++) {
+		if (entries[i].status) {
+			fprintf(stderr, "%s: %s\n", paths[i], strerror(entries[i].status));
+			missing = 1;
+		} else {
+			printf("%06o %llu %u %s\n", entries[i].mode, (unsigned long long)entries[i].size, entries[i].mtime, paths[i]);
+		}
+
+		free(paths[i]);
+	}
+
+	free(paths);
+	free(entries);
+
+	return missing;
+}
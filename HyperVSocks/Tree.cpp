@@ -0,0 +1,81 @@
+/**
+ * Removes and copies whole trees of a hypervfs mount on the host, through its
+ * tree ioctls. Build it into a tool with
+ *
+ * gcc -Wall -x c Tree.cpp RootPath.cpp TreeTool.cpp -o hypervtree
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "Tree.h"
+
+// runs the steps until the host says it's done, adding up their counts
+int runTree(const char* mountpoint, unsigned long cmd, HyperVTreeStep* step,
+	HyperVTreeProgress progress, void* data)
+{
+	int fd = open(mountpoint, O_RDONLY | O_DIRECTORY);
+
+	if (fd < 0) {
+		return errno;
+	}
+
+	HyperVTreeStep total = *step;
+	int err = 0;
+
+	total.bytes = 0;
+	total.files = 0;
+	total.dirs = 0;
+	total.done = 0;
+
+	while (!total.done) {
+		if (ioctl(fd, cmd, step) < 0) {
+			err = errno;
+			break;
+		}
+
+		total.bytes += step->bytes;
+		total.files += step->files;
+		total.dirs += step->dirs;
+		total.done = step->done;
+
+		if (progress) {
+			progress(&total, data);
+		}
+	}
+
+	close(fd);
+
+	return err;
+}
+
+int hypervRemoveTree(const char* mountpoint, const char* path, HyperVTreeProgress progress, void* data)
+{
+	HyperVTreeStep step = { 0 };
+
+	if (strlen(path) >= TREE_PATH_MAX) {
+		return ENAMETOOLONG;
+	}
+
+	strcpy(step.from, path);
+
+	return runTree(mountpoint, HYPERVFS_IOC_RMTREE, &step, progress, data);
+}
+
+int hypervCopyTree(const char* mountpoint, const char* from, const char* to, HyperVTreeProgress progress, void* data)
+{
+	HyperVTreeStep step = { 0 };
+
+	if (strlen(from) >= TREE_PATH_MAX || strlen(to) >= TREE_PATH_MAX) {
+		return ENAMETOOLONG;
+	}
+
+	strcpy(step.from, from);
+	strcpy(step.to, to);
+
+	return runTree(mountpoint, HYPERVFS_IOC_COPYTREE, &step, progress, data);
+}
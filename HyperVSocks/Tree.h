@@ -0,0 +1,34 @@
+#ifndef HYPERVFS_TREE_H
+#define HYPERVFS_TREE_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define TREE_PATH_MAX 1024
+
+// one step of a tree op, paths are relative to the mount root, from is the
+// tree to remove or copy and to where it's copied, a copy that didn't finish
+// leaves the path to resume from, it goes back in as is with the next step,
+// the counts are what this step did
+typedef struct {
+	uint64_t bytes;
+	uint32_t files;
+	uint32_t dirs;
+	uint32_t done;
+	char from[TREE_PATH_MAX];
+	char to[TREE_PATH_MAX];
+	char resume[TREE_PATH_MAX];
+} HyperVTreeStep;
+
+#define HYPERVFS_IOC_RMTREE _IOWR('H', 3, HyperVTreeStep)
+#define HYPERVFS_IOC_COPYTREE _IOWR('H', 4, HyperVTreeStep)
+
+// called after every step with what was done so far
+typedef void (*HyperVTreeProgress)(const HyperVTreeStep* total, void* data);
+
+// removes or copies a tree under a mounted hypervfs on the host, returns 0 or
+// an errno value, progress can be NULL
+int hypervRemoveTree(const char* mountpoint, const char* path, HyperVTreeProgress progress, void* data);
+int hypervCopyTree(const char* mountpoint, const char* from, const char* to, HyperVTreeProgress progress, void* data);
+
+#endif
@@ -0,0 +1,71 @@
+/**
+ * hypervtree rm MOUNTPOINT PATH
+ * hypervtree cp MOUNTPOINT FROM TO
+ *
+ * Removes or copies a whole tree on the host, instead of an op per entry, like
+ * rm -rf and cp -r to a path that doesn't exist yet. Paths are taken relative to
+ * the mount root, or as full paths under the mountpoint. Compile with
+ *
+ * gcc -Wall -x c Tree.cpp RootPath.cpp TreeTool.cpp -o hypervtree
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "Tree.h"
+#include "RootPath.h"
+
+// on a terminal the line is redrawn after every step
+void printProgress(const HyperVTreeStep* total, void* data)
+{
+	const char* verb = (const char*)data;
+
+	if (!total->done && !isatty(STDERR_FILENO)) {
+		return;
+	}
+
+	fprintf(stderr, "\r%s %u files, %u directories", verb, total->files, total->dirs);
+
+	if (total->bytes) {
+		fprintf(stderr, ", %llu bytes", (unsigned long long)total->bytes);
+	}
+
+	if (total->done) {
+		fprintf(stderr, "\n");
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	int remove = argc == 4 && strcmp(argv[1], "rm") == 0;
+	int copy = argc == 5 && strcmp(argv[1], "cp") == 0;
+
+	if (!remove && !copy) {
+		fprintf(stderr, "usage: %s rm MOUNTPOINT PATH\n       %s cp MOUNTPOINT FROM TO\n", argv[0], argv[0]);
+		return 2;
+	}
+
+	const char* mountpoint = argv[2];
+	char* from = rootPath(mountpoint, argv[3]);
+	char* to = copy ? rootPath(mountpoint, argv[4]) : NULL;
+	int err;
+
+	if (remove) {
+		err = hypervRemoveTree(mountpoint, from, printProgress, "Removed");
+	} else {
+		err = hypervCopyTree(mountpoint, from, to, printProgress, "Copied");
+	}
+
+	if (err) {
+		fprintf(stderr, "%s%s: %s\n", isatty(STDERR_FILENO) ? "\n" : "", argv[3], strerror(err));
+	}
+
+	free(from);
+	free(to);
+
+	return err ? 1 : 0;
+}